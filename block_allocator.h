@@ -2,72 +2,270 @@
 #ifndef BLOCK_ALLOCATOR_H
 #define BLOCK_ALLOCATOR_H
 
-#include <list>
+#include "block_source.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
 #include <memory>
+#include <type_traits>
+#include <vector>
 
-// The BlockAllocator class is meant to minimize calls to the allocator for small objects. 
-// This class allocates increasingly large blocks like std::vector, 
-// but without invalidating previously generated pointers. 
+// The BlockAllocator class is meant to minimize calls to the allocator for small objects.
+// This class allocates increasingly large blocks like std::vector,
+// but without invalidating previously generated pointers.
 // It also never lets go of the memory it allocates until it is destroyed.
-template<typename T>
+// - Objects given back with deallocate() are reused by allocate() first
+// - rewind() throws away everything allocated since a mark(), and reset()
+//   everything, keeping the blocks for the allocations after
+// - Blocks come from Source, see block_source.h
+template<typename T, typename Source = AlignedBlockSource>
 struct BlockAllocator {
-	BlockAllocator(size_t initial_size, size_t alignment)
-	  : alignment_(alignment),
-	  	last_block_size_(initial_size),
-	  	last_block_next_index_(0),
-	  	total_allocated_(0) {
+	// Where allocation was at mark()
+	struct Mark {
+		size_t block;
+		size_t next_index;
+		size_t n_free;
+	};
+
+	// In bytes
+	struct Stats {
+		// Taken from the source, in blocks
+		size_t committed;
+		// Holding objects
+		size_t used;
+		// Neither used nor left to allocate: deallocated objects and padding
+		size_t wasted;
+	};
+
+	BlockAllocator(size_t initial_size, size_t alignment, Source&& source = Source())
+	  : source_(std::move(source)),
+	  	alignment_(alignment),
+	  	block_(0),
+	  	next_index_(0),
+	  	total_allocated_(0),
+	  	n_marks_(0) {
 		assert(initial_size > 0);
 		size_t size_rounded = sizeof(T)*initial_size;
 		size_rounded = (size_rounded+(alignment-1))/alignment;
 		size_rounded *= alignment;
-		blocks_.push_back((T*)::aligned_alloc(alignment, size_rounded));
-		last_block_size_bytes_ = size_rounded;
+		blocks_.push_back(Block{(T*)source_.Allocate(size_rounded, alignment), initial_size, size_rounded});
 	}
 
 	~BlockAllocator() {
 		assert(blocks_.size() > 0);
-		// Last block may be partial
-		auto rit = blocks_.rbegin();
-		for(size_t i=0;i<last_block_next_index_;++i) {
-			(*rit)[i].~T();
-		}
-		// Earlier blocks are fully occupied
-		for(++rit;rit != blocks_.rend();++rit) {
-			delete [] *rit;
+		DestroyAll();
+		for(Block const&block : blocks_) {
+			source_.Free(block.first, block.size_bytes);
 		}
 	}
 
+	BlockAllocator(BlockAllocator const&) = delete;
+	BlockAllocator& operator=(BlockAllocator const&) = delete;
+
 	// Returns unconstructed pointer
-	// Use new on this address. Don't use delete. 
+	// Use new on this address. Don't use delete.
 	T* allocate() {
-		if(last_block_next_index_ == last_block_size_) {
-			last_block_size_bytes_ *= 2;
-			last_block_size_ *= 2;
-			last_block_next_index_ = 0;
-			blocks_.push_back((T*)::aligned_alloc(alignment_, last_block_size_bytes_));
+		// Slots freed before a mark might be rewound over, so aren't reused under one
+		if(free_.size() && !n_marks_) {
+			T* reused = free_.back();
+			free_.pop_back();
+			return reused;
+		}
+		if(next_index_ == blocks_[block_].size) {
+			++block_;
+			next_index_ = 0;
+			if(block_ == blocks_.size()) {
+				Block const&last = blocks_.back();
+				const size_t size_bytes = last.size_bytes*2;
+				const size_t size = last.size*2;
+				blocks_.push_back(Block{(T*)source_.Allocate(size_bytes, alignment_), size, size_bytes});
+			}
 		}
 		++total_allocated_;
-		return &blocks_.back()[last_block_next_index_++];
+		return &blocks_[block_].first[next_index_++];
+	}
+
+	// Destroys p and keeps its memory for the next allocate()
+	void deallocate(T* p) {
+		p->~T();
+		free_.push_back(p);
+	}
+
+	// Marks can nest. Each needs a rewind() or commit(), innermost first.
+	Mark mark() {
+		++n_marks_;
+		return Mark{block_, next_index_, free_.size()};
+	}
+
+	// Destroys everything allocated since m
+	// Objects from before m which were deallocated since stay deallocated
+	void rewind(Mark const&m) {
+		assert(n_marks_ > 0);
+		assert((m.block < block_) || ((m.block == block_) && (m.next_index <= next_index_)));
+
+		// Deallocated since m: drop the ones from after it, they're already destroyed
+		std::vector<T*> destroyed;
+		size_t n_free = m.n_free;
+		for(size_t fi=m.n_free;fi<free_.size();++fi) {
+			if(IsAfter(free_[fi], m)) {
+				destroyed.push_back(free_[fi]);
+			} else {
+				free_[n_free++] = free_[fi];
+			}
+		}
+		free_.resize(n_free);
+
+		if(!std::is_trivially_destructible<T>::value) {
+			std::sort(destroyed.begin(), destroyed.end());
+			ForEachSince(m, [&destroyed](T* p) {
+				if(!std::binary_search(destroyed.begin(), destroyed.end(), p)) {
+					p->~T();
+				}
+			});
+		}
+
+		total_allocated_ -= CountSince(m);
+		block_ = m.block;
+		next_index_ = m.next_index;
+		--n_marks_;
+	}
+
+	// Keeps everything allocated since m
+	void commit(Mark const&) {
+		assert(n_marks_ > 0);
+		--n_marks_;
+	}
+
+	// Destroys everything, keeping the blocks
+	void reset() {
+		assert(n_marks_ == 0);
+		DestroyAll();
+		free_.clear();
+		block_ = 0;
+		next_index_ = 0;
+		total_allocated_ = 0;
 	}
 
 	T* get_first()const {
 		assert(size() > 0);
 		assert(blocks_.size() > 0);
-		return blocks_.front();
+		return blocks_.front().first;
 	}
 
+	// The number of objects allocated and not deallocated
 	size_t size()const {
-		return total_allocated_;
+		return total_allocated_ - free_.size();
+	}
+
+	size_t num_free()const {
+		return free_.size();
+	}
+
+	Stats stats()const {
+		Stats stats;
+		stats.committed = 0;
+		size_t available = blocks_[block_].size - next_index_;
+		for(size_t bi=0;bi<blocks_.size();++bi) {
+			stats.committed += blocks_[bi].size_bytes;
+			if(bi > block_) {
+				available += blocks_[bi].size;
+			}
+		}
+		stats.used = size() * sizeof(T);
+		stats.wasted = stats.committed - stats.used - (available * sizeof(T));
+		return stats;
+	}
+
+	Source const&source()const {
+		return source_;
+	}
+
+	// Calls f(T*) on each object allocated and not deallocated
+	template<typename F>
+	void for_each(F f)const {
+		std::vector<T*> &free_sorted = free_sorted_;
+		free_sorted.assign(free_.begin(), free_.end());
+		std::sort(free_sorted.begin(), free_sorted.end());
+
+		ForEachSince(Mark{0, 0, 0}, [&free_sorted, &f](T* p) {
+			if(!std::binary_search(free_sorted.begin(), free_sorted.end(), p)) {
+				f(p);
+			}
+		});
+	}
+
+	void swap(BlockAllocator& o) {
+		source_.swap(o.source_);
+		std::swap(alignment_, o.alignment_);
+		std::swap(block_, o.block_);
+		std::swap(next_index_, o.next_index_);
+		std::swap(total_allocated_, o.total_allocated_);
+		std::swap(n_marks_, o.n_marks_);
+		blocks_.swap(o.blocks_);
+		free_.swap(o.free_);
+		free_sorted_.swap(o.free_sorted_);
 	}
 
 private:
 
+	struct Block {
+		T* first;
+		size_t size;
+		size_t size_bytes;
+	};
+
+	// Every slot handed out since m, including deallocated ones
+	template<typename F>
+	void ForEachSince(Mark const&m, F f)const {
+		for(size_t bi=m.block;bi<=block_;++bi) {
+			const size_t first = (bi == m.block) ? m.next_index : 0;
+			const size_t last = (bi == block_) ? next_index_ : blocks_[bi].size;
+			for(size_t i=first;i<last;++i) {
+				f(&blocks_[bi].first[i]);
+			}
+		}
+	}
+
+	size_t CountSince(Mark const&m)const {
+		size_t count = 0;
+		for(size_t bi=m.block;bi<=block_;++bi) {
+			const size_t first = (bi == m.block) ? m.next_index : 0;
+			const size_t last = (bi == block_) ? next_index_ : blocks_[bi].size;
+			count += last - first;
+		}
+		return count;
+	}
+
+	bool IsAfter(T* p, Mark const&m)const {
+		for(size_t bi=m.block;bi<=block_;++bi) {
+			T* const first = blocks_[bi].first + ((bi == m.block) ? m.next_index : 0);
+			if((p >= first) && (p < (blocks_[bi].first + blocks_[bi].size))) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void DestroyAll() {
+		if(!std::is_trivially_destructible<T>::value) {
+			for_each([](T* p) {
+				p->~T();
+			});
+		}
+	}
+
+	Source source_;
 	size_t alignment_;
-	size_t last_block_size_;
-	size_t last_block_size_bytes_;
-	size_t last_block_next_index_;
+	// The block and index allocate() takes from next
+	size_t block_;
+	size_t next_index_;
 	size_t total_allocated_;
-	std::list<T*> blocks_;
+	size_t n_marks_;
+	std::vector<Block> blocks_;
+	std::vector<T*> free_;
+	// for_each()'s, kept to not allocate each time
+	mutable std::vector<T*> free_sorted_;
 };
 
 #endif//BLOCK_ALLOCATOR_H
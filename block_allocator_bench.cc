@@ -0,0 +1,128 @@
+
+#include "block_allocator.h"
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+// Times allocating small objects with new/delete against BlockAllocator
+//  used the ways the parser does: growing, through the free list,
+//  rewound to a mark, and reset between parses.
+
+namespace {
+
+struct Small {
+	Small(size_t v) : a(v), b(v), c(v) {}
+	size_t a;
+	size_t b;
+	size_t c;
+};
+
+const size_t kObjects = 1 << 16;
+const int kRounds = 50;
+
+template<typename F>
+void Time(char const* name, F f) {
+	auto start = std::chrono::steady_clock::now();
+	size_t check = 0;
+	for(int ri=0;ri<kRounds;++ri) {
+		check += f();
+	}
+	auto end = std::chrono::steady_clock::now();
+	const double ms = std::chrono::duration<double, std::milli>(end - start).count();
+	printf("%-24s %8.2f ms  %6.2f ns/object  (%zu)\n", name, ms,
+		(ms * 1e6) / (double(kRounds) * kObjects), check);
+}
+
+}  // namespace
+
+int main() {
+	std::vector<Small*> ptrs(kObjects);
+
+	Time("new/delete", [&ptrs]() {
+		size_t sum = 0;
+		for(size_t i=0;i<kObjects;++i) {
+			ptrs[i] = new Small(i);
+		}
+		for(size_t i=0;i<kObjects;++i) {
+			sum += ptrs[i]->c;
+			delete ptrs[i];
+		}
+		return sum;
+	});
+
+	Time("allocate, destroy", [&ptrs]() {
+		BlockAllocator<Small> alloc(1024, 64);
+		size_t sum = 0;
+		for(size_t i=0;i<kObjects;++i) {
+			ptrs[i] = new (alloc.allocate()) Small(i);
+			sum += ptrs[i]->c;
+		}
+		return sum;
+	});
+
+	Time("allocate, mapped", [&ptrs]() {
+		BlockAllocator<Small, MappedBlockSource> alloc(1024, 64, MappedBlockSource());
+		size_t sum = 0;
+		for(size_t i=0;i<kObjects;++i) {
+			ptrs[i] = new (alloc.allocate()) Small(i);
+			sum += ptrs[i]->c;
+		}
+		return sum;
+	});
+
+	Time("allocate, huge pages", [&ptrs]() {
+		BlockAllocator<Small, MappedBlockSource> alloc(1024, 64, MappedBlockSource(size_t(1) << 32, true));
+		size_t sum = 0;
+		for(size_t i=0;i<kObjects;++i) {
+			ptrs[i] = new (alloc.allocate()) Small(i);
+			sum += ptrs[i]->c;
+		}
+		return sum;
+	});
+
+	{
+		BlockAllocator<Small> alloc(1024, 64);
+		for(size_t i=0;i<kObjects;++i) {
+			ptrs[i] = new (alloc.allocate()) Small(i);
+		}
+		Time("deallocate, reallocate", [&ptrs, &alloc]() {
+			size_t sum = 0;
+			for(size_t i=0;i<kObjects;++i) {
+				alloc.deallocate(ptrs[i]);
+			}
+			for(size_t i=0;i<kObjects;++i) {
+				ptrs[i] = new (alloc.allocate()) Small(i);
+				sum += ptrs[i]->c;
+			}
+			return sum;
+		});
+	}
+
+	{
+		BlockAllocator<Small> alloc(1024, 64);
+		Time("mark, rewind", [&alloc]() {
+			size_t sum = 0;
+			auto m = alloc.mark();
+			for(size_t i=0;i<kObjects;++i) {
+				sum += (new (alloc.allocate()) Small(i))->c;
+			}
+			alloc.rewind(m);
+			return sum;
+		});
+	}
+
+	{
+		BlockAllocator<Small> alloc(1024, 64);
+		Time("reset", [&alloc]() {
+			size_t sum = 0;
+			for(size_t i=0;i<kObjects;++i) {
+				sum += (new (alloc.allocate()) Small(i))->c;
+			}
+			alloc.reset();
+			return sum;
+		});
+	}
+
+	return 0;
+}
@@ -83,5 +83,183 @@ TEST(BlockAllocatorTest, Ctor) {
 	EXPECT_EQ(tests, 0);
 }
 
+TEST(BlockAllocatorTest, Deallocate) {
+	BlockAllocator<int> test(4, 8);
+	std::vector<int*> ptrs;
+	for(int i=0;i<20;++i) {
+		ptrs.push_back(new (test.allocate()) int(i));
+	}
+	EXPECT_EQ(20u, test.size());
+
+	test.deallocate(ptrs[3]);
+	test.deallocate(ptrs[17]);
+	EXPECT_EQ(18u, test.size());
+	EXPECT_EQ(2u, test.num_free());
+
+	int sum = 0;
+	size_t n = 0;
+	test.for_each([&sum, &n](int* p) {
+		sum += *p;
+		++n;
+	});
+	EXPECT_EQ(18u, n);
+	EXPECT_EQ((19*20/2) - 3 - 17, sum);
+
+	// Reused before allocating more
+	int* reused = test.allocate();
+	EXPECT_TRUE((reused == ptrs[3]) || (reused == ptrs[17]));
+	EXPECT_EQ(1u, test.num_free());
+}
+
+TEST(BlockAllocatorTest, MarkRewind) {
+	BlockAllocator<int> test(4, 8);
+	std::vector<int*> ptrs;
+	for(int i=0;i<6;++i) {
+		ptrs.push_back(new (test.allocate()) int(i));
+	}
+	test.deallocate(ptrs[1]);
+
+	auto outer = test.mark();
+	// Not reused under a mark, as a rewind could drop it
+	int* after_outer = new (test.allocate()) int(6);
+	EXPECT_NE(ptrs[1], after_outer);
+	test.deallocate(ptrs[2]);
+
+	auto inner = test.mark();
+	for(int i=0;i<20;++i) {
+		new (test.allocate()) int(100+i);
+	}
+	EXPECT_EQ(25u, test.size());
+	test.rewind(inner);
+	EXPECT_EQ(5u, test.size());
+
+	// Allocation restarts where the mark was
+	EXPECT_EQ(after_outer+1, test.allocate());
+
+	test.deallocate(after_outer);
+	test.rewind(outer);
+	EXPECT_EQ(4u, test.size());
+	// Both from before the mark stay deallocated, the rest is gone
+	EXPECT_EQ(2u, test.num_free());
+
+	int sum = 0;
+	test.for_each([&sum](int* p) {
+		sum += *p;
+	});
+	EXPECT_EQ(0+3+4+5, sum);
+
+	auto committed = test.mark();
+	int* kept = new (test.allocate()) int(7);
+	test.commit(committed);
+	EXPECT_EQ(5u, test.size());
+	EXPECT_EQ(7, *kept);
+
+	// Without a mark the free list is used again
+	int* reused = test.allocate();
+	EXPECT_TRUE((reused == ptrs[1]) || (reused == ptrs[2]));
+}
+
+TEST(BlockAllocatorTest, RewindResetDestroy) {
+	static int tests = 0;
+
+	struct CountedTest {
+		CountedTest() {
+			++tests;
+		}
+		~CountedTest() {
+			--tests;
+		}
+		CountedTest(CountedTest const&o) = delete;
+		CountedTest(CountedTest &&o) = delete;
+	};
+
+	{
+		BlockAllocator<CountedTest> test(2, 8);
+		for(int i=0;i<3;++i) {
+			new (test.allocate()) CountedTest;
+		}
+
+		auto m = test.mark();
+		CountedTest* dead = nullptr;
+		for(int i=0;i<10;++i) {
+			dead = new (test.allocate()) CountedTest;
+		}
+		test.deallocate(dead);
+		EXPECT_EQ(12, tests);
+		test.rewind(m);
+		EXPECT_EQ(3, tests);
+
+		test.reset();
+		EXPECT_EQ(0, tests);
+		EXPECT_EQ(0u, test.size());
+		EXPECT_EQ(0u, test.num_free());
+
+		// Reuses the blocks from before, from the start
+		CountedTest* first = new (test.allocate()) CountedTest;
+		EXPECT_EQ(test.get_first(), first);
+
+		// Across several blocks, for the destructor
+		for(int i=0;i<40;++i) {
+			new (test.allocate()) CountedTest;
+		}
+		EXPECT_EQ(41, tests);
+	}
+	EXPECT_EQ(0, tests);
+}
+
+TEST(BlockAllocatorTest, Stats) {
+	BlockAllocator<int> test(4, 16);
+	std::vector<int*> ptrs;
+	for(int i=0;i<10;++i) {
+		ptrs.push_back(new (test.allocate()) int(i));
+	}
+	// Blocks of 4 and 8
+	auto stats = test.stats();
+	EXPECT_EQ(12*sizeof(int), stats.committed);
+	EXPECT_EQ(test.source().committed_bytes(), stats.committed);
+	EXPECT_EQ(10*sizeof(int), stats.used);
+	EXPECT_EQ(0u, stats.wasted);
+
+	test.deallocate(ptrs[0]);
+	stats = test.stats();
+	EXPECT_EQ(9*sizeof(int), stats.used);
+	EXPECT_EQ(sizeof(int), stats.wasted);
+}
+
+TEST(BlockAllocatorTest, MappedSource) {
+	const size_t kReserve = 1 << 20;
+	BlockAllocator<double, MappedBlockSource> test(64, 64, MappedBlockSource(kReserve));
+	EXPECT_EQ(kReserve, test.source().reserved_bytes());
+
+	std::vector<double*> ptrs;
+	for(int i=0;i<1000;++i) {
+		ptrs.push_back(new (test.allocate()) double(i));
+	}
+	// Blocks follow each other
+	for(size_t i=1;i<ptrs.size();++i) {
+		ASSERT_EQ(ptrs[i-1]+1, ptrs[i]);
+	}
+	// Committed a page at a time as the blocks reached them
+	EXPECT_LT(test.stats().committed, test.source().committed_bytes());
+	EXPECT_LT(test.source().committed_bytes(), kReserve);
+
+	// Past the reservation
+	for(int i=1000;i<300000;++i) {
+		ptrs.push_back(new (test.allocate()) double(i));
+	}
+	EXPECT_LT(kReserve, test.source().committed_bytes());
+	for(size_t i=0;i<ptrs.size();++i) {
+		ASSERT_EQ(double(i), *ptrs[i]);
+	}
+}
+
+TEST(BlockAllocatorTest, HugePageSource) {
+	BlockAllocator<int, MappedBlockSource> test(1024, 8, MappedBlockSource(size_t(1) << 30, true));
+	int* first = new (test.allocate()) int(1);
+	EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(first) % MappedBlockSource::kHugePageSize);
+	EXPECT_EQ(MappedBlockSource::kHugePageSize, test.source().committed_bytes());
+	EXPECT_EQ(1, *first);
+}
+
 }  // namespace
 
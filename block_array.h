@@ -0,0 +1,244 @@
+
+#ifndef BLOCK_ARRAY_H
+#define BLOCK_ARRAY_H
+
+#include "block_source.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// An array which grows without moving its elements, indexed by 32-bit handles
+// - Block k holds 2^(kFirstBits+k) elements, so the block and offset of an
+//   index come from its highest set bit, and the directory of blocks is fixed
+// - Blocks are allocated from Source as the array reaches them, and kept by clear()
+template<typename T, unsigned kFirstBits = 6, typename Source = AlignedBlockSource>
+struct BlockArray {
+	typedef uint32_t Handle;
+
+	static constexpr unsigned kNumBlocks = 32 - kFirstBits + 1;
+
+	explicit BlockArray(Source&& source = Source())
+	  : source_(std::move(source)), size_(0), n_blocks_(0) {
+		std::fill(blocks_, blocks_ + kNumBlocks, nullptr);
+	}
+
+	~BlockArray() {
+		clear();
+		for(unsigned bi=0;bi<n_blocks_;++bi) {
+			source_.Free(blocks_[bi], BlockBytes(bi));
+		}
+	}
+
+	BlockArray(BlockArray const&) = delete;
+	BlockArray& operator=(BlockArray const&) = delete;
+
+	T& operator[](Handle i) {
+		assert(i < size_);
+		const uint64_t j = uint64_t(i) + kFirst;
+		const unsigned top = 63 - __builtin_clzll(j);
+		return blocks_[top - kFirstBits][j - (uint64_t(1) << top)];
+	}
+
+	T const&operator[](Handle i)const {
+		return const_cast<BlockArray&>(*this)[i];
+	}
+
+	// The handle of an element from its address
+	// Searches the blocks from the last, which holds half of the elements
+	Handle handle_of(T const* p)const {
+		const uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+		for(unsigned bi=n_blocks_;bi-- > 0;) {
+			const uintptr_t first = reinterpret_cast<uintptr_t>(blocks_[bi]);
+			if((addr >= first) && (addr < (first + BlockBytes(bi)))) {
+				const Handle i = Handle(Capacity(bi) + (addr - first) / sizeof(T));
+				assert(i < size_);
+				return i;
+			}
+		}
+		assert(false);
+		return UINT32_MAX;
+	}
+
+	template<typename... Args>
+	Handle emplace_back(Args&&... args) {
+		assert(size_ < UINT32_MAX);
+		const Handle i = size_;
+		if(size_ == Capacity(n_blocks_)) {
+			blocks_[n_blocks_] = static_cast<T*>(source_.Allocate(BlockBytes(n_blocks_), kAlignment));
+			++n_blocks_;
+		}
+		// size_ first, for operator[]'s assert
+		++size_;
+		new (&(*this)[i]) T(std::forward<Args>(args)...);
+		return i;
+	}
+
+	Handle push_back(T const&val) {
+		return emplace_back(val);
+	}
+
+	T& back() {
+		assert(size_ > 0);
+		return (*this)[size_ - 1];
+	}
+
+	size_t size()const {
+		return size_;
+	}
+
+	// Destroys every element, keeping the blocks
+	void clear() {
+		if(!std::is_trivially_destructible<T>::value) {
+			for(uint64_t i=0;i<size_;++i) {
+				(*this)[Handle(i)].~T();
+			}
+		}
+		size_ = 0;
+	}
+
+	Source const&source()const {
+		return source_;
+	}
+
+	void swap(BlockArray& o) {
+		source_.swap(o.source_);
+		std::swap(size_, o.size_);
+		std::swap(n_blocks_, o.n_blocks_);
+		std::swap_ranges(blocks_, blocks_ + kNumBlocks, o.blocks_);
+	}
+
+  private:
+
+	static constexpr uint64_t kFirst = uint64_t(1) << kFirstBits;
+	static constexpr size_t kAlignment = (alignof(T) > sizeof(void*)) ? alignof(T) : sizeof(void*);
+
+	// Elements in the first n_blocks blocks
+	static uint64_t Capacity(unsigned n_blocks) {
+		return (kFirst << n_blocks) - kFirst;
+	}
+
+	static size_t BlockBytes(unsigned bi) {
+		return sizeof(T) * (kFirst << bi);
+	}
+
+	Source source_;
+	uint64_t size_;
+	unsigned n_blocks_;
+	T* blocks_[kNumBlocks];
+};
+
+// Objects in a BlockArray, which can be deallocated one by one
+// - Handles and pointers stay valid until their object is deallocated
+// - Deallocated handles are reused by allocate() first
+// - The first object allocated after reset() has handle 0
+template<typename T, unsigned kFirstBits = 6, typename Source = AlignedBlockSource>
+struct BlockPool {
+	typedef uint32_t Handle;
+
+	explicit BlockPool(Source&& source = Source())
+	  : slots_(std::move(source)) {
+	}
+
+	~BlockPool() {
+		DestroyAll();
+	}
+
+	BlockPool(BlockPool const&) = delete;
+	BlockPool& operator=(BlockPool const&) = delete;
+
+	template<typename... Args>
+	Handle allocate(Args&&... args) {
+		Handle h;
+		if(free_.size()) {
+			h = free_.back();
+			free_.pop_back();
+		} else {
+			h = slots_.emplace_back();
+		}
+		new (&slots_[h]) T(std::forward<Args>(args)...);
+		return h;
+	}
+
+	// Destroys the object and keeps its slot for the next allocate()
+	void deallocate(Handle h) {
+		get(h)->~T();
+		free_.push_back(h);
+	}
+
+	T* get(Handle h)const {
+		return reinterpret_cast<T*>(const_cast<Slot*>(&slots_[h]));
+	}
+
+	Handle handle_of(T const* p)const {
+		return slots_.handle_of(reinterpret_cast<Slot const*>(p));
+	}
+
+	// The number of objects allocated and not deallocated
+	size_t size()const {
+		return slots_.size() - free_.size();
+	}
+
+	size_t num_free()const {
+		return free_.size();
+	}
+
+	// Destroys everything, keeping the blocks
+	void reset() {
+		DestroyAll();
+		free_.clear();
+		slots_.clear();
+	}
+
+	// Calls f(T*) on each object allocated and not deallocated, by handle
+	template<typename F>
+	void for_each(F f)const {
+		std::vector<Handle> &free_sorted = free_sorted_;
+		free_sorted.assign(free_.begin(), free_.end());
+		std::sort(free_sorted.begin(), free_sorted.end());
+
+		auto next_free = free_sorted.begin();
+		for(uint64_t i=0;i<slots_.size();++i) {
+			if((next_free != free_sorted.end()) && (*next_free == i)) {
+				++next_free;
+				continue;
+			}
+			f(get(Handle(i)));
+		}
+	}
+
+	void swap(BlockPool& o) {
+		slots_.swap(o.slots_);
+		free_.swap(o.free_);
+		free_sorted_.swap(o.free_sorted_);
+	}
+
+	Source const&source()const {
+		return slots_.source();
+	}
+
+  private:
+
+	// Raw storage, constructed and destroyed by the pool
+	struct Slot {
+		alignas(T) unsigned char bytes[sizeof(T)];
+	};
+
+	void DestroyAll() {
+		if(!std::is_trivially_destructible<T>::value) {
+			for_each([](T* p) {
+				p->~T();
+			});
+		}
+	}
+
+	BlockArray<Slot, kFirstBits, Source> slots_;
+	std::vector<Handle> free_;
+	// for_each()'s, kept to not allocate each time
+	mutable std::vector<Handle> free_sorted_;
+};
+
+#endif//BLOCK_ARRAY_H
@@ -0,0 +1,147 @@
+
+
+#include "gtest/gtest.h"
+#include "block_array.h"
+
+#include <vector>
+
+namespace {
+
+TEST(BlockArrayTest, Simple) {
+	BlockArray<int, 2> test;
+	std::vector<int*> ptrs;
+	for(int i=0;i<1000;++i) {
+		EXPECT_EQ(uint32_t(i), test.push_back(i*3));
+		ptrs.push_back(&test.back());
+	}
+	EXPECT_EQ(1000u, test.size());
+
+	// Growing never moved anything
+	for(int i=0;i<1000;++i) {
+		ASSERT_EQ(ptrs[i], &test[i]);
+		ASSERT_EQ(i*3, test[i]);
+	}
+
+	// Within a block elements are contiguous, blocks of 4, 8, 16...
+	EXPECT_EQ(&test[0]+3, &test[3]);
+	EXPECT_EQ(&test[4]+7, &test[11]);
+	EXPECT_EQ(&test[12]+15, &test[27]);
+}
+
+TEST(BlockArrayTest, Random) {
+	srand(4321);
+	BlockArray<std::pair<int, int> > test;
+	std::vector<std::pair<int, int> > ref;
+	for(int i=0;i<100000;++i) {
+		const int val = rand();
+		test.emplace_back(val, i);
+		ref.emplace_back(val, i);
+		if(0 == (i%100)) {
+			const uint32_t check = rand() % ref.size();
+			ASSERT_EQ(ref[check], test[check]);
+		}
+	}
+	for(uint32_t i=0;i<ref.size();++i) {
+		ASSERT_EQ(ref[i], test[i]);
+	}
+}
+
+TEST(BlockArrayTest, ClearAndDestroy) {
+	static int tests = 0;
+
+	struct CountedTest {
+		CountedTest(int v) : v(v) {
+			++tests;
+		}
+		~CountedTest() {
+			--tests;
+		}
+		CountedTest(CountedTest const&o) = delete;
+		CountedTest(CountedTest &&o) = delete;
+		int v;
+	};
+
+	{
+		BlockArray<CountedTest, 3> test;
+		for(int i=0;i<100;++i) {
+			test.emplace_back(i);
+		}
+		EXPECT_EQ(100, tests);
+		CountedTest* first = &test[0];
+		const size_t committed = test.source().committed_bytes();
+
+		test.clear();
+		EXPECT_EQ(0, tests);
+		EXPECT_EQ(0u, test.size());
+
+		// Same blocks again
+		test.emplace_back(5);
+		EXPECT_EQ(first, &test[0]);
+		for(int i=0;i<50;++i) {
+			test.emplace_back(i);
+		}
+		EXPECT_EQ(committed, test.source().committed_bytes());
+		EXPECT_EQ(51, tests);
+	}
+	EXPECT_EQ(0, tests);
+}
+
+TEST(BlockArrayTest, HandleOf) {
+	BlockArray<int, 2> test;
+	for(int i=0;i<1000;++i) {
+		test.push_back(i);
+	}
+	for(uint32_t i=0;i<1000;++i) {
+		ASSERT_EQ(i, test.handle_of(&test[i]));
+	}
+}
+
+TEST(BlockPoolTest, ReuseAndForEach) {
+	static int tests = 0;
+
+	struct CountedTest {
+		CountedTest(int v) : v(v) {
+			++tests;
+		}
+		~CountedTest() {
+			--tests;
+		}
+		int v;
+	};
+
+	{
+		BlockPool<CountedTest, 2> test;
+		for(int i=0;i<20;++i) {
+			EXPECT_EQ(uint32_t(i), test.allocate(i));
+		}
+		test.deallocate(3);
+		test.deallocate(17);
+		EXPECT_EQ(18, tests);
+		EXPECT_EQ(18u, test.size());
+		EXPECT_EQ(2u, test.num_free());
+
+		std::vector<int> seen;
+		test.for_each([&seen](CountedTest* p) {
+			seen.push_back(p->v);
+		});
+		ASSERT_EQ(18u, seen.size());
+		EXPECT_EQ(2, seen[2]);
+		EXPECT_EQ(4, seen[3]);
+		EXPECT_EQ(19, seen.back());
+
+		// Freed slots first, then new ones
+		EXPECT_EQ(17u, test.allocate(100));
+		EXPECT_EQ(3u, test.allocate(101));
+		EXPECT_EQ(20u, test.allocate(102));
+		EXPECT_EQ(101, test.get(3)->v);
+		EXPECT_EQ(3u, test.handle_of(test.get(3)));
+
+		test.reset();
+		EXPECT_EQ(0, tests);
+		EXPECT_EQ(0u, test.allocate(5));
+		EXPECT_EQ(1, tests);
+	}
+	EXPECT_EQ(0, tests);
+}
+
+}  // namespace
@@ -0,0 +1,179 @@
+
+#ifndef BLOCK_SOURCE_H
+#define BLOCK_SOURCE_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Where BlockAllocator gets its blocks
+// A source has Allocate(bytes, alignment), and Free(p, bytes) for each block
+//  when the allocator is destroyed. committed_bytes() is what it holds from the system.
+
+// Each block from aligned_alloc
+struct AlignedBlockSource {
+	AlignedBlockSource() : committed_(0) {}
+
+	void* Allocate(size_t bytes, size_t alignment) {
+		void* p = ::aligned_alloc(alignment, bytes);
+		if(!p) {
+			throw std::bad_alloc();
+		}
+		committed_ += bytes;
+		return p;
+	}
+
+	void Free(void* p, size_t bytes) {
+		::free(p);
+		committed_ -= bytes;
+	}
+
+	size_t committed_bytes()const {
+		return committed_;
+	}
+
+	void swap(AlignedBlockSource& o) {
+		std::swap(committed_, o.committed_);
+	}
+
+  private:
+	size_t committed_;
+};
+
+// Blocks one after another in a range of address space reserved up front
+// - The range is made accessible as blocks reach it, so untouched parts cost
+//   no memory, and consecutive blocks are neighbours in memory
+// - With huge_pages the range is 2MB aligned and committed 2MB at a time, and
+//   transparent huge pages are asked for, so large inputs take fewer TLB misses
+// - Blocks past the reservation come from aligned_alloc
+// - Blocks are only released all together, when the source is destroyed
+struct MappedBlockSource {
+	static constexpr size_t kHugePageSize = size_t(1) << 21;
+
+	explicit MappedBlockSource(size_t reserve_bytes = size_t(1) << 32, bool huge_pages = false)
+	  : base_(nullptr), mapped_(nullptr), mapped_bytes_(0), reserved_(0),
+	  	used_(0), committed_(0), overflow_committed_(0), huge_pages_(huge_pages),
+	  	granule_(huge_pages ? kHugePageSize : size_t(::sysconf(_SC_PAGESIZE))) {
+		reserve_bytes = RoundUp(reserve_bytes, granule_);
+		// Room to align the start to a huge page
+		if(reserve_bytes == 0) {
+			return;
+		}
+		mapped_bytes_ = reserve_bytes + (huge_pages ? kHugePageSize : 0);
+		void* mapped = ::mmap(nullptr, mapped_bytes_, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(mapped == MAP_FAILED) {
+			// Everything overflows to aligned_alloc
+			mapped_bytes_ = 0;
+			return;
+		}
+		mapped_ = static_cast<char*>(mapped);
+		base_ = reinterpret_cast<char*>(RoundUp(reinterpret_cast<uintptr_t>(mapped_), granule_));
+		reserved_ = reserve_bytes;
+	}
+
+	MappedBlockSource(MappedBlockSource&& o)
+	  : MappedBlockSource(0, false) {
+		swap(o);
+	}
+
+	MappedBlockSource(MappedBlockSource const&) = delete;
+	MappedBlockSource& operator=(MappedBlockSource const&) = delete;
+
+	~MappedBlockSource() {
+		if(mapped_) {
+			::munmap(mapped_, mapped_bytes_);
+		}
+	}
+
+	void* Allocate(size_t bytes, size_t alignment) {
+		const size_t start = RoundUp(used_, alignment);
+		if(!base_ || (start + bytes) > reserved_) {
+			void* p = ::aligned_alloc(alignment, bytes);
+			if(!p) {
+				throw std::bad_alloc();
+			}
+			overflow_committed_ += bytes;
+			return p;
+		}
+
+		if((start + bytes) > committed_) {
+			const size_t new_committed = std::min(reserved_, RoundUp(start + bytes, granule_));
+			if(::mprotect(base_ + committed_, new_committed - committed_, PROT_READ | PROT_WRITE) != 0) {
+				throw std::bad_alloc();
+			}
+#ifdef MADV_HUGEPAGE
+			if(huge_pages_) {
+				// Only a hint: without THP the pages are just small
+				::madvise(base_ + committed_, new_committed - committed_, MADV_HUGEPAGE);
+			}
+#endif
+			committed_ = new_committed;
+		}
+		used_ = start + bytes;
+		return base_ + start;
+	}
+
+	void Free(void* p, size_t bytes) {
+		char* const c = static_cast<char*>(p);
+		if(!base_ || (c < base_) || (c >= (base_ + reserved_))) {
+			::free(p);
+			overflow_committed_ -= bytes;
+		}
+	}
+
+	// Address space set aside
+	size_t reserved_bytes()const {
+		return reserved_;
+	}
+
+	// Made accessible, including blocks which overflowed the reservation
+	size_t committed_bytes()const {
+		return committed_ + overflow_committed_;
+	}
+
+	// Handed out as blocks from the reservation, with alignment padding
+	size_t used_bytes()const {
+		return used_;
+	}
+
+	void swap(MappedBlockSource& o) {
+		std::swap(base_, o.base_);
+		std::swap(mapped_, o.mapped_);
+		std::swap(mapped_bytes_, o.mapped_bytes_);
+		std::swap(reserved_, o.reserved_);
+		std::swap(used_, o.used_);
+		std::swap(committed_, o.committed_);
+		std::swap(overflow_committed_, o.overflow_committed_);
+		std::swap(huge_pages_, o.huge_pages_);
+		std::swap(granule_, o.granule_);
+	}
+
+  private:
+
+	static size_t RoundUp(size_t n, size_t to) {
+		return ((n + to - 1) / to) * to;
+	}
+
+	// The first granule boundary in the mapping
+	char* base_;
+	char* mapped_;
+	size_t mapped_bytes_;
+	size_t reserved_;
+	// Offsets from base_
+	size_t used_;
+	size_t committed_;
+	size_t overflow_committed_;
+	bool huge_pages_;
+	// Committed this many bytes at a time
+	size_t granule_;
+};
+
+#endif//BLOCK_SOURCE_H
@@ -1,6 +1,6 @@
 set -e
 echo Convert grammar..
-./convert_grammar.py ./cpp.grammar ./cpp_lex.l ./grammar.h
+./convert_grammar.py ./cpp.grammar ./cpp_lex.l ./grammar.h ./lex_dfa.h
 echo Lex..
 lex cpp_lex.l
 echo Compile..
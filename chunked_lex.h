@@ -0,0 +1,164 @@
+
+#ifndef CHUNKED_LEX_H
+#define CHUNKED_LEX_H
+
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include "dfa_lexer.h"
+#include "thread_pool.h"
+
+namespace parser {
+
+// Parallel lexing of one large buffer with DfaLexer.
+//
+// The buffer is cut into chunks just after a newline, and every chunk is
+//  lexed on its own as if a token started there, keeping the tokens which
+//  start inside it. A chunk's own line count gives the line numbers of the
+//  ones before it, so chunks don't need to wait for each other.
+// The guess that a token starts at a chunk's first byte is wrong when a
+//  match runs over the cut, like a comment spanning lines. The chunks are
+//  then checked in order: from where the previous chunk really stopped,
+//  tokens are lexed again until one starts where the chunk also has one.
+//  From there on both lex the same, and the rest of the chunk is used.
+//
+// Record needs type, offset, length and lineno fields, like LexedRecord.
+// offset is from begin for every token, length is 0 for tokens without text.
+
+// Offsets of the cuts, 0 and end - begin included. Each cut is just after
+//  the first newline at least chunk_len bytes past the one before.
+inline std::vector<size_t> SplitAtNewlines(char const* begin, char const* end,
+										   size_t chunk_len) {
+	std::vector<size_t> ret;
+	ret.push_back(0);
+	const size_t size = end - begin;
+	for(size_t at=chunk_len;at<size;) {
+		void const* newline = ::memchr(begin + at, '\n', size - at);
+		if(!newline) {
+			break;
+		}
+		const size_t cut = static_cast<char const*>(newline) - begin + 1;
+		if(cut >= size) {
+			break;
+		}
+		ret.push_back(cut);
+		at = cut + chunk_len;
+	}
+	ret.push_back(size);
+	return ret;
+}
+
+namespace chunked_lex {
+
+template<typename Record>
+struct LexedChunk {
+	std::vector<Record> tokens;
+	// In the chunk, token line numbers count from 1 at its start
+	int newlines;
+	// Where lexing stopped, at or past the chunk's end
+	size_t stop;
+};
+
+template<typename Record>
+void Append(DfaLexer const&lexer, int rule, char const* begin, std::vector<Record> &tokens) {
+	Record rec;
+	rec.type = sDfaRules[rule].token_type;
+	rec.offset = lexer.text() - begin;
+	rec.length = sDfaRules[rule].with_text ? lexer.length() : 0;
+	rec.lineno = lexer.lineno();
+	tokens.push_back(rec);
+}
+
+}  // namespace chunked_lex
+
+// Lexes [begin, end) in chunks between cuts, into the same tokens and line
+//  numbers as one DfaLexer over all of it. Cuts can be anywhere, but ones
+//  from SplitAtNewlines() rarely need lexing again.
+template<typename Record>
+void LexChunks(char const* begin, char const* end, std::vector<size_t> const&cuts,
+			   WorkStealingPool &pool, std::vector<Record> &tokens) {
+	assert(cuts.size() >= 2);
+	assert((cuts.front() == 0) && (cuts.back() == size_t(end - begin)));
+	const unsigned n_chunks = cuts.size() - 1;
+
+	std::vector<chunked_lex::LexedChunk<Record> > chunks(n_chunks);
+	pool.ParallelFor(n_chunks, [&](unsigned ci) {
+		chunked_lex::LexedChunk<Record> &chunk = chunks[ci];
+		char const* limit = begin + cuts[ci+1];
+		DfaLexer lexer(begin + cuts[ci], end);
+		for(int rule = lexer.NextRule(limit);rule >= 0;rule = lexer.NextRule(limit)) {
+			chunked_lex::Append(lexer, rule, begin, chunk.tokens);
+		}
+		chunk.stop = lexer.pos() - begin;
+		chunk.newlines = dfa_lexer::CountNewlines(begin + cuts[ci], limit);
+	});
+
+	// Lines before each cut
+	std::vector<int> lines_before(n_chunks, 0);
+	for(unsigned ci=1;ci<n_chunks;++ci) {
+		lines_before[ci] = lines_before[ci-1] + chunks[ci-1].newlines;
+	}
+
+	size_t n_tokens = 0;
+	for(auto const&chunk : chunks) {
+		n_tokens += chunk.tokens.size();
+	}
+	tokens.clear();
+	tokens.reserve(n_tokens);
+
+	// Where the tokens so far end, and the next one is looked for
+	size_t stop = 0;
+	for(unsigned ci=0;ci<n_chunks;++ci) {
+		chunked_lex::LexedChunk<Record> const&chunk = chunks[ci];
+
+		unsigned first = 0;
+		if(stop != cuts[ci]) {
+			// A match ran over the cut, lex again from where it ended
+			assert(stop > cuts[ci]);
+			unsigned line_chunk = ci;
+			while(cuts[line_chunk+1] < stop) {
+				++line_chunk;
+			}
+			DfaLexer lexer(begin + stop, end, 1 + lines_before[line_chunk] +
+				dfa_lexer::CountNewlines(begin + cuts[line_chunk], begin + stop));
+			char const* limit = begin + cuts[ci+1];
+			first = chunk.tokens.size();
+			unsigned ti = 0;
+			for(int rule = lexer.NextRule(limit);rule >= 0;rule = lexer.NextRule(limit)) {
+				const size_t offset = lexer.text() - begin;
+				while((ti < chunk.tokens.size()) && (chunk.tokens[ti].offset < offset)) {
+					++ti;
+				}
+				if((ti < chunk.tokens.size()) && (chunk.tokens[ti].offset == offset)) {
+					// Back in step with the chunk
+					first = ti;
+					break;
+				}
+				chunked_lex::Append(lexer, rule, begin, tokens);
+			}
+			if(first == chunk.tokens.size()) {
+				stop = lexer.pos() - begin;
+				continue;
+			}
+		}
+
+		for(unsigned ti=first;ti<chunk.tokens.size();++ti) {
+			tokens.push_back(chunk.tokens[ti]);
+			tokens.back().lineno += lines_before[ci];
+		}
+		stop = chunk.stop;
+	}
+}
+
+// LexChunks() cut at newlines about every chunk_len bytes
+template<typename Record>
+void LexChunked(char const* begin, char const* end, size_t chunk_len,
+				WorkStealingPool &pool, std::vector<Record> &tokens) {
+	LexChunks(begin, end, SplitAtNewlines(begin, end, chunk_len), pool, tokens);
+}
+
+}  // namespace parser
+
+#endif//CHUNKED_LEX_H
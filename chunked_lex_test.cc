@@ -0,0 +1,104 @@
+
+
+#include "gtest/gtest.h"
+#include "chunked_lex.h"
+#include "rules.h"
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Record {
+	parser::TokenType type;
+	size_t offset;
+	size_t length;
+	int lineno;
+
+	bool operator==(Record const&o)const {
+		return (type == o.type) && (offset == o.offset) && (length == o.length) &&
+			(lineno == o.lineno);
+	}
+};
+
+std::vector<Record> LexSerial(std::string const&input) {
+	std::vector<Record> ret;
+	parser::DfaLexer lexer(input.data(), input.data() + input.size());
+	for(int rule = lexer.NextRule();rule >= 0;rule = lexer.NextRule()) {
+		parser::chunked_lex::Append(lexer, rule, input.data(), ret);
+	}
+	return ret;
+}
+
+std::vector<Record> LexCut(std::string const&input, std::vector<size_t> const&cuts,
+						   WorkStealingPool &pool) {
+	std::vector<Record> ret;
+	parser::LexChunks(input.data(), input.data() + input.size(), cuts, pool, ret);
+	return ret;
+}
+
+TEST(ChunkedLexTest, SplitAtNewlines) {
+	const std::string input = "true\nfalse, 1\n\n2\n3";
+	const char* begin = input.data();
+	const char* end = begin + input.size();
+	EXPECT_EQ(std::vector<size_t>({0, 5, 14, 17, 18}), parser::SplitAtNewlines(begin, end, 1));
+	EXPECT_EQ(std::vector<size_t>({0, 14, 18}), parser::SplitAtNewlines(begin, end, 6));
+	EXPECT_EQ(std::vector<size_t>({0, 18}), parser::SplitAtNewlines(begin, end, 100));
+	EXPECT_EQ(std::vector<size_t>({0, 0}), parser::SplitAtNewlines(begin, begin, 1));
+}
+
+TEST(ChunkedLexTest, AtNewlines) {
+	WorkStealingPool pool(4);
+	std::string input;
+	for(int i=0;i<200;++i) {
+		input += "true, " + std::to_string(i * 7919) + " -false\n" + std::string(i % 3, '\n');
+	}
+	const std::vector<Record> serial = LexSerial(input);
+	for(size_t chunk_len : {1, 7, 64, 1000, 100000}) {
+		std::vector<Record> chunked;
+		parser::LexChunked(input.data(), input.data() + input.size(), chunk_len, pool, chunked);
+		EXPECT_EQ(serial, chunked) << chunk_len;
+	}
+}
+
+TEST(ChunkedLexTest, CutsInTokens) {
+	// Cuts inside tokens and runs have to be lexed again
+	WorkStealingPool pool(3);
+	const std::string input = "truefalse 123456789  \n\n  true1234";
+	const std::vector<Record> serial = LexSerial(input);
+	for(size_t cut=0;cut<=input.size();++cut) {
+		EXPECT_EQ(serial, LexCut(input, {0, cut, input.size()}, pool)) << cut;
+	}
+	std::vector<size_t> every_byte;
+	for(size_t cut=0;cut<=input.size();++cut) {
+		every_byte.push_back(cut);
+	}
+	EXPECT_EQ(serial, LexCut(input, every_byte, pool));
+}
+
+TEST(ChunkedLexTest, SameAsSerial) {
+	WorkStealingPool pool(4);
+	const std::vector<std::string> pieces = {
+		"true", "false", "tru", "fals", ",", "-", "+", "1", "0",
+		"1234567890123456789", " ", "  ", "\t", "\n", "\n\n", std::string(20, ' '),
+		"x", "?", std::string(1, '\0')
+	};
+	srand(2025);
+	for(int ti=0;ti<500;++ti) {
+		std::string input;
+		for(int pi=rand()%60;pi>0;--pi) {
+			input += pieces[rand() % pieces.size()];
+		}
+		std::vector<size_t> cuts = {0};
+		while(cuts.back() < input.size()) {
+			cuts.push_back(std::min(input.size(), cuts.back() + 1 + rand() % 12));
+		}
+		if(cuts.size() == 1) {
+			cuts.push_back(0);
+		}
+		ASSERT_EQ(LexSerial(input), LexCut(input, cuts, pool)) << input;
+	}
+}
+
+}  // namespace
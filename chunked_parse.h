@@ -0,0 +1,335 @@
+
+#ifndef CHUNKED_PARSE_H
+#define CHUNKED_PARSE_H
+
+#include <functional>
+#include <vector>
+
+#include "parser.h"
+#include "item_cache.h"
+#include "thread_pool.h"
+
+namespace parser {
+
+// Speculative parallel parsing of files that are a top-level list of
+//  independent items, like Verilog modules or C++ function definitions.
+//
+// The grammar declares where items end with a line like
+//   %sync top_base MODULE ENDMODULE
+// An item is guessed to end at the close token which brings the open/close
+//  depth back to 0. Each guessed item is parsed from the item rule on its
+//  own, in parallel, and the results are stitched into one top_list tree.
+// A chunk which doesn't parse to exactly one complete candidate is merged
+//  with its neighbours and parsed again on the calling thread. If that fails
+//  too, the caller falls back to parsing the whole file serially.
+
+// Returns true to keep a candidate after each token
+typedef std::function<bool(Candidate const&)> CandidateFilter;
+
+struct TokenRange {
+	unsigned first;
+	unsigned last;
+};
+
+// The rules needed to stitch items back together:
+//   top: top_list
+//   top_list: top_base             (list_base)
+//   top_list: top_list top_base    (list_ext)
+struct ChunkedGrammar {
+	ChunkedGrammar()
+	  : item(0), open(0), close(0),
+	  	top_rule(0), list_base(0), list_ext(0) {
+	}
+
+	Token item;
+	TokenType open;
+	TokenType close;
+
+	Rule const*top_rule;
+	Rule const*list_base;
+	Rule const*list_ext;
+
+	bool Init(Rule const&top) {
+		if((sSyncRules.size() == 0) || (top.pattern.size() != 1)) {
+			return false;
+		}
+		vector<string> const&sync = sSyncRules[0];
+		assert(sync.size() == 3);
+
+		item = GetTokenInstName(sync[0].c_str(), "");
+		open = GetTokenTypeId(sync[1].c_str());
+		close = GetTokenTypeId(sync[2].c_str());
+		if(!IsRuleTokenName(item) || !open || !close) {
+			fprintf(stderr, "Bad %%sync rule for %s\n", sync[0].c_str());
+			return false;
+		}
+
+		const Token list = top.pattern[0];
+		if(!IsRuleTokenName(list)) {
+			return false;
+		}
+		for(Rule const&rule : GetRulesForTokenName(list)) {
+			if((rule.pattern.size() == 1) && (rule.pattern[0] == item)) {
+				list_base = &rule;
+			} else if((rule.pattern.size() == 2) && (rule.pattern[0] == list) &&
+					  (rule.pattern[1] == item)) {
+				list_ext = &rule;
+			}
+		}
+		top_rule = &top;
+		return list_base && list_ext;
+	}
+
+	vector<TokenRange> Split(vector<LexedRecord> const&tokens)const {
+		vector<TokenRange> ret;
+		unsigned first = 0;
+		int depth = 0;
+		for(unsigned ti=0;ti<tokens.size();++ti) {
+			const TokenType type = tokens[ti].type;
+			if(type == open) {
+				++depth;
+			} else if(type == close) {
+				--depth;
+				if(depth == 0) {
+					ret.push_back(TokenRange{first, ti+1});
+					first = ti+1;
+				}
+			}
+		}
+		if(first < tokens.size()) {
+			if(ret.size() > 0) {
+				ret.back().last = tokens.size();
+			} else {
+				ret.push_back(TokenRange{first, (unsigned)tokens.size()});
+			}
+		}
+		return ret;
+	}
+};
+
+// Parses tokens[range] from fresh nodes of root_rules, returning the complete candidates.
+// The session's lexed_tokens must already hold the tokens.
+CandidateVector ParseRange(vector<Rule> const&root_rules,
+						   vector<LexedRecord> const&tokens,
+						   TokenRange range,
+						   CandidateFilter const&keep) {
+	CandidateVector candidates;
+	for(Rule const&rule : root_rules) {
+		Candidate cand;
+		cand.add_node(Node(rule, NodeId_Null));
+		candidates.push_back(cand);
+	}
+
+	CandidateVector unfiltered;
+	for(unsigned ti=range.first;ti<range.last;++ti) {
+		if(!ConsumeToken(tokens[ti], ti, candidates) || (candidates.size() == 0)) {
+			break;
+		}
+
+		unfiltered.swap(candidates);
+		candidates.clear();
+		for(Candidate const&cand : unfiltered) {
+			if((cand.top_completed == NodeId_Null) || keep(cand)) {
+				candidates.push_back(cand);
+			}
+		}
+	}
+
+	CandidateVector completed;
+	for(Candidate const&cand : candidates) {
+		if(cand.is_complete()) {
+			completed.push_back(cand);
+		}
+	}
+	return completed;
+}
+
+// Parses the longest single item starting at tokens[first].
+// Returns the index after the item, or first if no item completes or a
+//  candidate fails validation.
+unsigned ParseLongestItem(vector<Rule> const&item_rules,
+						  vector<LexedRecord> const&tokens,
+						  unsigned first,
+						  CandidateFilter const&keep,
+						  Candidate &item) {
+	CandidateVector candidates;
+	for(Rule const&rule : item_rules) {
+		Candidate cand;
+		cand.add_node(Node(rule, NodeId_Null));
+		candidates.push_back(cand);
+	}
+
+	unsigned end = first;
+	CandidateVector unfiltered;
+	for(unsigned ti=first;(ti<tokens.size()) && (candidates.size() > 0);++ti) {
+		if(!ConsumeToken(tokens[ti], ti, candidates)) {
+			// Broken candidates, nothing this far can be trusted
+			return first;
+		}
+
+		unfiltered.swap(candidates);
+		candidates.clear();
+		unsigned n_complete = 0;
+		unsigned complete_index = 0;
+		for(Candidate const&cand : unfiltered) {
+			if((cand.top_completed == NodeId_Null) || keep(cand)) {
+				candidates.push_back(cand);
+				if(cand.is_complete()) {
+					complete_index = candidates.size() - 1;
+					++n_complete;
+				}
+			}
+		}
+		// An ambiguous longer item doesn't replace the last unambiguous one
+		if(n_complete == 1) {
+			item = candidates[complete_index];
+			end = ti+1;
+		}
+	}
+	return end;
+}
+
+// Builds top { top_list { ... top_list { item } item ... } } from parsed items
+Candidate StitchItems(ChunkedGrammar const&grammar, vector<Candidate> const&items) {
+	Candidate ret;
+	ret.add_node(Node(*grammar.top_rule, NodeId_Null));
+
+	NodeId list_nid = NodeId_Null;
+	for(Candidate const&item : items) {
+		const bool first = (list_nid == NodeId_Null);
+		const NodeId new_list_nid = ret.add_node(
+			Node(first ? *grammar.list_base : *grammar.list_ext, NodeId_Top));
+		const NodeId item_nid = ret.graft(item, new_list_nid);
+
+		if(!first) {
+			ret.nodes_by_id = ret.nodes_by_id.update(list_nid, [&](Node node) {
+				node.parent = new_list_nid;
+				return node;
+			});
+		}
+		ret.nodes_by_id = ret.nodes_by_id.update(new_list_nid, [&](Node node) {
+			if(!first) {
+				node.parsed_tokens.push_back(list_nid);
+			}
+			node.parsed_tokens.push_back(item_nid);
+			return node;
+		});
+		list_nid = new_list_nid;
+	}
+
+	ret.nodes_by_id = ret.nodes_by_id.update(NodeId_Top, [&](Node node) {
+		node.parsed_tokens.push_back(list_nid);
+		return node;
+	});
+	ret.work_id = NodeId_Top;
+	ret.top_completed = NodeId_Null;
+	return ret;
+}
+
+// Returns false if the file couldn't be parsed as a list of items, in which
+//  case the caller should parse it serially.
+// Chunks are parsed on pool, which the caller keeps for every file.
+// cache is optional. Chunks found there aren't parsed, and every item
+//  parsed here is added to it.
+bool ParseChunked(Rule const&top_rule,
+				  vector<LexedRecord> const&tokens,
+				  WorkStealingPool &pool,
+				  CandidateFilter const&keep,
+				  ItemCache *cache,
+				  Candidate &output) {
+	ChunkedGrammar grammar;
+	if(!grammar.Init(top_rule)) {
+		fprintf(stderr, "Grammar has no usable %%sync rule, parsing serially\n");
+		return false;
+	}
+
+	vector<TokenRange> chunks = grammar.Split(tokens);
+	if(chunks.size() == 0) {
+		return false;
+	}
+
+	for(unsigned ti=0;ti<tokens.size();++ti) {
+		RecordLexedToken(tokens[ti], ti);
+	}
+
+	vector<Rule> const&item_rules = GetRulesForTokenName(grammar.item);
+
+	vector<CandidateVector> results(chunks.size());
+	vector<unsigned> to_parse;
+	for(unsigned ci=0;ci<chunks.size();++ci) {
+		Candidate item;
+		if(cache && cache->Lookup(tokens, chunks[ci].first, chunks[ci].last, item)) {
+			results[ci].push_back(item);
+		} else {
+			to_parse.push_back(ci);
+		}
+	}
+	{
+		ParseSession &session = CurrentSession();
+		pool.ParallelFor(to_parse.size(), [&](unsigned pi) {
+			ParseSession::Scope scope(session);
+			const unsigned ci = to_parse[pi];
+			results[ci] = ParseRange(item_rules, tokens, chunks[ci], keep);
+		});
+	}
+
+	// Anything but one complete parse means the boundary guess was wrong
+	vector<Candidate> items;
+	vector<TokenRange> item_ranges;
+	unsigned n_fallbacks = 0;
+	unsigned ci = 0;
+	while(ci < chunks.size()) {
+		if(results[ci].size() == 1) {
+			items.push_back(results[ci][0]);
+			item_ranges.push_back(chunks[ci]);
+			++ci;
+			continue;
+		}
+
+		++n_fallbacks;
+
+		// The previous item may have been cut short too, like an item
+		//  followed by an optional token
+		unsigned pos = chunks[ci].first;
+		if(items.size() > 0) {
+			pos = item_ranges.back().first;
+			items.pop_back();
+			item_ranges.pop_back();
+		}
+
+		// Parse serially, item by item, until back on a guessed boundary
+		do {
+			Candidate item;
+			const unsigned end = ParseLongestItem(item_rules, tokens, pos, keep, item);
+			if(end == pos) {
+				fprintf(stderr, "No item parses at token %i, parsing serially\n", (int)pos);
+				return false;
+			}
+			items.push_back(item);
+			item_ranges.push_back(TokenRange{pos, end});
+			pos = end;
+
+			while((ci < chunks.size()) && (chunks[ci].first < pos)) {
+				++ci;
+			}
+		} while((pos < tokens.size()) &&
+				!((ci < chunks.size()) && (chunks[ci].first == pos) && (results[ci].size() == 1)));
+	}
+
+	if(cache) {
+		for(unsigned ii=0;ii<items.size();++ii) {
+			TokenRange const&range = item_ranges[ii];
+			cache->Insert(tokens, range.first, range.last, items[ii]);
+		}
+	}
+
+	fprintf(stderr, "Parsed %i chunks as %i items, %i fallbacks\n",
+		(int)chunks.size(), (int)items.size(), (int)n_fallbacks);
+
+	output = StitchItems(grammar, items);
+	return output.is_complete();
+}
+
+}  // namespace parser
+
+#endif//CHUNKED_PARSE_H
@@ -0,0 +1,156 @@
+
+
+#include "gtest/gtest.h"
+#include "parser.h"
+#include "chunked_parse.h"
+#include "flex_scanner.h"
+#include "item_cache.h"
+#include "thread_pool.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace parser;
+
+namespace {
+
+void SetupOnce() {
+	static bool done = false;
+	if(!done) {
+		SetupParser();
+		done = true;
+	}
+}
+
+vector<LexedRecord> Lex(std::string const&input) {
+	vector<LexedRecord> tokens;
+	FILE* in = ::fmemopen(const_cast<char*>(input.data()), input.size(), "rb");
+	{
+		FlexScanner scanner(in);
+		for(Token tok = scanner.Next();tok != 0;tok = scanner.Next()) {
+			tokens.push_back(LexedRecord::Interned(tok, scanner.lineno()));
+		}
+	}
+	fclose(in);
+	return tokens;
+}
+
+bool KeepAll(Candidate const&) {
+	return true;
+}
+
+TEST(ChunkedParseTest, LongestItem) {
+	SetupOnce();
+	ParseSession session;
+	ParseSession::Scope scope(session);
+
+	vector<Rule> const&expr_rules = GetRulesForTokenName(GetTokenInstName("expr", ""));
+	const vector<LexedRecord> tokens = Lex("1 - 2 false");
+	Candidate item;
+	EXPECT_EQ(3u, ParseLongestItem(expr_rules, tokens, 0, KeepAll, item));
+
+	CandidateVector expected = ParseRange(expr_rules, tokens, TokenRange{0, 3}, KeepAll);
+	ASSERT_EQ(1u, expected.size());
+	EXPECT_EQ(expected[0].ToString(), item.ToString());
+}
+
+TEST(ChunkedParseTest, LongestItemStopsBeforeAmbiguousTail) {
+	SetupOnce();
+	ParseSession session;
+	ParseSession::Scope scope(session);
+
+	// "1 - 2" parses one way, "1 - 2 +3" two ways
+	vector<Rule> const&expr_rules = GetRulesForTokenName(GetTokenInstName("expr", ""));
+	const vector<LexedRecord> tokens = Lex("1 - 2 +3");
+	ASSERT_EQ(2u, ParseRange(expr_rules, tokens,
+		TokenRange{0, (unsigned)tokens.size()}, KeepAll).size());
+
+	Candidate item;
+	EXPECT_EQ(3u, ParseLongestItem(expr_rules, tokens, 0, KeepAll, item));
+
+	CandidateVector expected = ParseRange(expr_rules, tokens, TokenRange{0, 3}, KeepAll);
+	ASSERT_EQ(1u, expected.size());
+	EXPECT_EQ(expected[0].ToString(), item.ToString());
+}
+
+// The only complete parse of tokens from the file rule, parsed serially
+std::string ParseSerially(vector<LexedRecord> const&tokens) {
+	for(unsigned ti=0;ti<tokens.size();++ti) {
+		RecordLexedToken(tokens[ti], ti);
+	}
+	vector<Rule> const&file_rules = GetRulesForTokenName(GetTokenInstName("file", ""));
+	CandidateVector completed = ParseRange(file_rules, tokens,
+		TokenRange{0, (unsigned)tokens.size()}, KeepAll);
+	EXPECT_EQ(1u, completed.size());
+	return completed.size() ? completed[0].ToString() : std::string();
+}
+
+Rule const&FileRule() {
+	return GetRulesForTokenName(GetTokenInstName("file", ""))[0];
+}
+
+TEST(ChunkedParseTest, StitchedItemsMatchSerial) {
+	SetupOnce();
+	ParseSession session;
+	ParseSession::Scope scope(session);
+
+	const vector<LexedRecord> tokens = Lex(
+		"begin 1 2 end begin 3 end begin 4 5 6 end begin 7 end");
+	WorkStealingPool pool(4);
+	Candidate stitched;
+	ASSERT_TRUE(ParseChunked(FileRule(), tokens, pool, KeepAll, nullptr, stitched));
+	EXPECT_EQ(ParseSerially(tokens), stitched.ToString());
+}
+
+TEST(ChunkedParseTest, WrongBoundaryFallsBack) {
+	SetupOnce();
+	ParseSession session;
+	ParseSession::Scope scope(session);
+
+	// The first item ends at its SEMI, not at its END, so the second chunk
+	//  is "; begin 2 end" and doesn't parse
+	const vector<LexedRecord> tokens = Lex(
+		"begin 1 end ; begin 2 end begin 3 4 end ;");
+	WorkStealingPool pool(4);
+	ItemCache cache(16);
+	Candidate stitched;
+	ASSERT_TRUE(ParseChunked(FileRule(), tokens, pool, KeepAll, &cache, stitched));
+	EXPECT_EQ(ParseSerially(tokens), stitched.ToString());
+
+	// The items were cached on their real boundaries
+	Candidate item;
+	EXPECT_TRUE(cache.Lookup(tokens, 0, 4, item));
+	EXPECT_TRUE(cache.Lookup(tokens, 4, 7, item));
+	EXPECT_FALSE(cache.Lookup(tokens, 3, 7, item));
+}
+
+TEST(ChunkedParseTest, CachedItemsMatchSerial) {
+	SetupOnce();
+	// Lookups happen before any item is inserted, so the repeated item
+	//  misses the first time
+	const std::string input = "begin 1 2 end begin 3 end begin 1 2 end";
+	WorkStealingPool pool(4);
+	ItemCache cache(16);
+	{
+		ParseSession session;
+		ParseSession::Scope scope(session);
+		Candidate stitched;
+		ASSERT_TRUE(ParseChunked(FileRule(), Lex(input), pool, KeepAll, &cache, stitched));
+	}
+	EXPECT_EQ(0u, cache.hits());
+	EXPECT_EQ(2u, cache.size());
+
+	// Every chunk is found in the cache, from a session which didn't
+	//  parse them
+	ParseSession session;
+	ParseSession::Scope scope(session);
+	const vector<LexedRecord> tokens = Lex(input);
+	const unsigned long long hits = cache.hits();
+	Candidate stitched;
+	ASSERT_TRUE(ParseChunked(FileRule(), tokens, pool, KeepAll, &cache, stitched));
+	EXPECT_EQ(hits + 3, cache.hits());
+	EXPECT_EQ(ParseSerially(tokens), stitched.ToString());
+}
+
+}  // namespace
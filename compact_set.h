@@ -0,0 +1,226 @@
+
+#ifndef COMPACT_SET_H
+#define COMPACT_SET_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Arrays for CompactSets with more than one element, by power of two capacity
+// Such sets are rare, so the arrays are kept per thread for reuse rather than freed
+template<typename T>
+struct CompactSetPool {
+	static T* Allocate(unsigned size_class) {
+		std::vector<T*> &free_list = FreeLists().by_class[size_class];
+		if(free_list.size()) {
+			T* ret = free_list.back();
+			free_list.pop_back();
+			return ret;
+		}
+		return static_cast<T*>(::operator new(sizeof(T) << size_class));
+	}
+
+	static void Free(T* p, unsigned size_class) {
+		FreeLists().by_class[size_class].push_back(p);
+	}
+
+	// Smallest power of two capacity holding n > 1 elements
+	static unsigned SizeClass(uint32_t n) {
+		assert(n > 1);
+		unsigned size_class = 1;
+		while((uint32_t(1) << size_class) < n) {
+			++size_class;
+		}
+		return size_class;
+	}
+
+private:
+	struct Lists {
+		~Lists() {
+			for(std::vector<T*> const&free_list : by_class) {
+				for(T* p : free_list) {
+					::operator delete(p);
+				}
+			}
+		}
+		std::vector<T*> by_class[32];
+	};
+
+	static Lists& FreeLists() {
+		static thread_local Lists lists;
+		return lists;
+	}
+};
+
+// A sorted set of trivially copyable values, usually of zero or one element
+// - kInline elements are stored inline: one pointer, or two 32-bit values in
+//   the same space. More go to an array from CompactSetPool.
+// - 4 byte packing makes it 12 bytes for pointers, so a 32-bit field before it
+//   in an 8-aligned struct fills the space padding would take
+// - Iterators are pointers, and are invalidated by insert() and erase()
+#pragma pack(push, 4)
+template<typename T>
+struct CompactSet {
+	static_assert(std::is_trivially_copyable<T>::value, "CompactSet copies with memcpy");
+
+	typedef CompactSetPool<T> Pool;
+	typedef T const* iterator;
+
+	CompactSet() : size_(0), many_(0) {}
+
+	CompactSet(CompactSet const&o) : size_(o.size_), many_(0) {
+		if(size_ <= kInline) {
+			memcpy(inline_, o.inline_, size_ * sizeof(T));
+			return;
+		}
+		many_ = Pool::Allocate(Pool::SizeClass(size_));
+		memcpy(many_, o.many_, size_ * sizeof(T));
+	}
+
+	CompactSet(CompactSet&& o) : size_(o.size_), many_(0) {
+		memcpy(inline_, o.inline_, kStorageSize);
+		o.size_ = 0;
+	}
+
+	CompactSet& operator=(CompactSet o) {
+		swap(o);
+		return *this;
+	}
+
+	~CompactSet() {
+		clear();
+	}
+
+	void swap(CompactSet& o) {
+		std::swap(size_, o.size_);
+		// Whichever of the union is in use
+		unsigned char storage[kStorageSize];
+		memcpy(storage, inline_, kStorageSize);
+		memcpy(inline_, o.inline_, kStorageSize);
+		memcpy(o.inline_, storage, kStorageSize);
+	}
+
+	bool contains(T const&val)const {
+		if(size_ == 1) {
+			return inline_[0] == val;
+		}
+		return std::binary_search(begin(), end(), val);
+	}
+
+	void insert(T const&val) {
+		if(size_ == 0) {
+			inline_[0] = val;
+			size_ = 1;
+			return;
+		}
+		if(contains(val)) {
+			return;
+		}
+		if(size_ < kInline) {
+			InsertAt(inline_, val);
+			return;
+		}
+		if(size_ == kInline) {
+			T* const many = Pool::Allocate(Pool::SizeClass(kInline+1));
+			memcpy(many, inline_, kInline * sizeof(T));
+			many_ = many;
+			InsertAt(many_, val);
+			return;
+		}
+
+		const unsigned size_class = Pool::SizeClass(size_);
+		if(size_ == (uint32_t(1) << size_class)) {
+			T* const grown = Pool::Allocate(size_class+1);
+			memcpy(grown, many_, size_ * sizeof(T));
+			Pool::Free(many_, size_class);
+			many_ = grown;
+		}
+		InsertAt(many_, val);
+	}
+
+	void erase(T const&val) {
+		if(size_ <= kInline) {
+			T* const pos = std::lower_bound(inline_, inline_ + size_, val);
+			if((pos != (inline_ + size_)) && (*pos == val)) {
+				memmove(pos, pos + 1, (inline_ + size_ - pos - 1) * sizeof(T));
+				--size_;
+			}
+			return;
+		}
+
+		T* const pos = std::lower_bound(many_, many_ + size_, val);
+		if((pos == (many_ + size_)) || !(*pos == val)) {
+			return;
+		}
+
+		const unsigned size_class = Pool::SizeClass(size_);
+		memmove(pos, pos + 1, (many_ + size_ - pos - 1) * sizeof(T));
+		--size_;
+
+		if(size_ == kInline) {
+			T* const many = many_;
+			memcpy(inline_, many, kInline * sizeof(T));
+			Pool::Free(many, size_class);
+			return;
+		}
+
+		// Shrink to the smallest capacity, which insert() relies on
+		const unsigned new_size_class = Pool::SizeClass(size_);
+		if(new_size_class < size_class) {
+			T* const shrunk = Pool::Allocate(new_size_class);
+			memcpy(shrunk, many_, size_ * sizeof(T));
+			Pool::Free(many_, size_class);
+			many_ = shrunk;
+		}
+	}
+
+	void clear() {
+		if(size_ > kInline) {
+			Pool::Free(many_, Pool::SizeClass(size_));
+		}
+		size_ = 0;
+	}
+
+	size_t size()const {
+		return size_;
+	}
+
+	// Of the array holding more than fit inline
+	size_t heap_bytes()const {
+		return (size_ > kInline) ? (sizeof(T) << Pool::SizeClass(size_)) : 0;
+	}
+
+	iterator begin()const {
+		return (size_ > kInline) ? many_ : inline_;
+	}
+
+	iterator end()const {
+		return begin() + size_;
+	}
+
+private:
+
+	static constexpr size_t kStorageSize = (sizeof(T) > sizeof(T*)) ? sizeof(T) : sizeof(T*);
+	static constexpr uint32_t kInline = kStorageSize / sizeof(T);
+
+	// Into elements, which has room for one more
+	void InsertAt(T* elements, T const&val) {
+		T* const pos = std::upper_bound(elements, elements + size_, val);
+		memmove(pos + 1, pos, (elements + size_ - pos) * sizeof(T));
+		*pos = val;
+		++size_;
+	}
+
+	uint32_t size_;
+	union {
+		T inline_[kInline];
+		T* many_;
+	};
+};
+#pragma pack(pop)
+
+#endif//COMPACT_SET_H
@@ -0,0 +1,144 @@
+
+
+#include "gtest/gtest.h"
+#include "compact_set.h"
+#include "absl/container/flat_hash_set.h"
+
+#include <algorithm>
+
+namespace {
+
+template<typename T>
+bool CheckSetsEqual(CompactSet<T> const&test,
+					absl::flat_hash_set<T> const&ref) {
+	std::vector<T> values_from_test(test.begin(), test.end());
+
+	std::vector<T> values_from_ref(ref.begin(), ref.end());
+	std::sort(values_from_ref.begin(), values_from_ref.end());
+
+	// Iterates in order
+	return values_from_test == values_from_ref;
+}
+
+TEST(CompactSetTest, Size) {
+	EXPECT_EQ(12u, sizeof(CompactSet<int*>));
+
+	struct alignas(8) Slot {
+		unsigned idx;
+		CompactSet<int*> set;
+	};
+	EXPECT_EQ(16u, sizeof(Slot));
+}
+
+TEST(CompactSetTest, TwoInline) {
+	EXPECT_EQ(12u, sizeof(CompactSet<uint32_t>));
+
+	CompactSet<uint32_t> set;
+	auto is_inline = [&set]() {
+		char const* first = reinterpret_cast<char const*>(set.begin());
+		char const* self = reinterpret_cast<char const*>(&set);
+		return (first >= self) && (first < (self + sizeof(set)));
+	};
+	set.insert(9);
+	set.insert(4);
+	EXPECT_TRUE(is_inline());
+	EXPECT_EQ(0u, set.heap_bytes());
+	EXPECT_EQ(4u, *set.begin());
+
+	set.insert(6);
+	EXPECT_FALSE(is_inline());
+	EXPECT_EQ(16u, set.heap_bytes());
+	EXPECT_EQ(6u, set.begin()[1]);
+
+	set.erase(4);
+	EXPECT_TRUE(is_inline());
+	EXPECT_EQ(2u, set.size());
+	EXPECT_EQ(6u, *set.begin());
+	EXPECT_TRUE(set.contains(9));
+
+	// Only one pointer fits
+	CompactSet<int*> pointers;
+	int vals[2];
+	pointers.insert(&vals[0]);
+	pointers.insert(&vals[1]);
+	EXPECT_EQ(16u, pointers.heap_bytes());
+}
+
+TEST(CompactSetTest, Simple) {
+	CompactSet<int> test;
+
+	ASSERT_FALSE(test.contains(3));
+	test.insert(3);
+	ASSERT_TRUE(test.contains(3));
+	ASSERT_EQ(1u, test.size());
+
+	test.insert(1);
+	test.insert(2);
+	ASSERT_EQ(3u, test.size());
+	ASSERT_EQ(1, *test.begin());
+
+	test.erase(3);
+	ASSERT_FALSE(test.contains(3));
+	test.erase(1);
+	ASSERT_TRUE(test.contains(2));
+	ASSERT_EQ(1u, test.size());
+
+	test.clear();
+	ASSERT_FALSE(test.contains(2));
+	ASSERT_EQ(0u, test.size());
+}
+
+TEST(CompactSetTest, CopyMoveAssign) {
+	CompactSet<int> test;
+	for(int i=0;i<5;++i) {
+		test.insert(i);
+	}
+
+	CompactSet<int> copied(test);
+	ASSERT_EQ(5u, copied.size());
+	ASSERT_TRUE(copied.contains(4));
+
+	CompactSet<int> moved(std::move(copied));
+	ASSERT_EQ(5u, moved.size());
+	ASSERT_EQ(0u, copied.size());
+
+	CompactSet<int> one;
+	one.insert(7);
+	moved = one;
+	ASSERT_EQ(1u, moved.size());
+	ASSERT_TRUE(moved.contains(7));
+
+	one = test;
+	ASSERT_EQ(5u, one.size());
+	ASSERT_FALSE(one.contains(7));
+}
+
+TEST(CompactSetTest, Random) {
+	const int kMaxVal = 100;
+	srand(5555);
+	for(int ti=0;ti<200;++ti) {
+		CompactSet<int> test;
+		absl::flat_hash_set<int> ref;
+		for(int ci=0;ci<200;++ci) {
+			// Grow for the first half, then shrink
+			if(0==(rand()%((ci < 100) ? 2 : 4))) {
+				const int val = rand()%kMaxVal;
+				test.insert(val);
+				ref.insert(val);
+			}
+			if(0==(rand()%((ci < 100) ? 4 : 2))) {
+				const int val = rand()%kMaxVal;
+				test.erase(val);
+				ref.erase(val);
+			}
+			{
+				const int val = rand()%kMaxVal;
+				ASSERT_EQ(ref.contains(val), test.contains(val));
+			}
+			ASSERT_EQ(ref.size(), test.size());
+			ASSERT_TRUE(CheckSetsEqual(test, ref));
+		}
+	}
+}
+
+}  // namespace
@@ -0,0 +1,145 @@
+
+
+// The traces print every candidate after each token
+#define PROFILING 1
+
+#include "gtest/gtest.h"
+#include "parser.h"
+#include "flex_scanner.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace parser;
+
+namespace {
+
+void SetupOnce() {
+	static bool done = false;
+	if(!done) {
+		SetupParser();
+		done = true;
+	}
+}
+
+vector<LexedRecord> Lex(std::string const&input) {
+	vector<LexedRecord> tokens;
+	FILE* in = ::fmemopen(const_cast<char*>(input.data()), input.size(), "rb");
+	{
+		FlexScanner scanner(in);
+		for(Token tok = scanner.Next();tok != 0;tok = scanner.Next()) {
+			tokens.push_back(LexedRecord::Interned(tok, scanner.lineno()));
+		}
+	}
+	fclose(in);
+	return tokens;
+}
+
+// n_copies of the start of a parse, which step in lockstep
+void StartParse(CandidateVector &candidates, unsigned n_copies) {
+	vector<Rule> const&top_rules = GetRulesForTokenName(GetTokenInstName("top", ""));
+	Candidate top_cand;
+	top_cand.add_node(Node(top_rules[0], NodeId_Null));
+	candidates.erase(candidates.begin(), candidates.end());
+	candidates.insert(candidates.end(), n_copies, top_cand);
+}
+
+// Capacities of the frontier and of ConsumeToken()'s scratch, which only
+//  change when one of them allocates.
+// The frontier and prev_candidates swap storage every token, so the pair
+//  is kept in order.
+std::vector<size_t> BufferCapacities(CandidateVector const&candidates) {
+	std::vector<size_t> ret;
+	ConsumeScratch const&scratch = sConsumeScratch;
+	ret.push_back(std::min(candidates.capacity(), scratch.prev_candidates.capacity()));
+	ret.push_back(std::max(candidates.capacity(), scratch.prev_candidates.capacity()));
+	ret.push_back(scratch.runs.capacity());
+	for(ConsumeBuffers const&run : scratch.runs) {
+		ret.push_back(run.consumed.capacity());
+		ret.push_back(run.branched_down.capacity());
+		ret.push_back(run.branched_up.capacity());
+	}
+	return ret;
+}
+
+// The node maps are immer's, which allocate on every update by design.
+// Everything ConsumeToken() allocates besides them is in these buffers,
+//  and the child arrays, which come from the session's arena blocks.
+TEST(ConsumeAllocTest, WarmFrontierBuffersDontGrow) {
+	SetupOnce();
+	ParseSession session;
+	ParseSession::Scope scope(session);
+
+	// Ambiguous, so the frontier outgrows its inline storage
+	const vector<LexedRecord> tokens = Lex("1 - 2 +3 - 4 +5 - 6 +7 - 8");
+
+	CandidateVector candidates;
+	StartParse(candidates, 1);
+	size_t widest = 0;
+	for(unsigned ti=0;ti<tokens.size();++ti) {
+		ASSERT_TRUE(ConsumeToken(tokens[ti], ti, candidates));
+		widest = std::max<size_t>(widest, candidates.size());
+	}
+	ASSERT_LT(sCandidateInlineCount, widest);
+
+	// The same frontiers again, in the storage the first pass left
+	StartParse(candidates, 1);
+	unsigned n_allocating = 0;
+	for(unsigned ti=0;ti<tokens.size();++ti) {
+		const std::vector<size_t> before = BufferCapacities(candidates);
+		ASSERT_TRUE(ConsumeToken(tokens[ti], ti, candidates));
+		if(BufferCapacities(candidates) != before) {
+			++n_allocating;
+		}
+	}
+	EXPECT_EQ(0u, n_allocating);
+	EXPECT_EQ(widest, candidates.size());
+}
+
+// A long parse allocates nothing past its first tokens
+TEST(ConsumeAllocTest, SteadyStateBuffersDontGrow) {
+	SetupOnce();
+	ParseSession session;
+	ParseSession::Scope scope(session);
+
+	// A sum 8001 tokens long, "1 +2 +2 ... +2", which keeps one candidate
+	//  per copy of the start and a shallow tree. From enough copies the
+	//  frontier stays past its inline storage all the way.
+	std::string input = "1";
+	for(int i=0;i<4000;++i) {
+		input += " +2";
+	}
+	const vector<LexedRecord> tokens = Lex(input);
+	ASSERT_EQ(8001u, tokens.size());
+	const unsigned n_copies = 2*sCandidateInlineCount;
+	const unsigned n_warm_up = 100;
+
+	CandidateVector candidates;
+	StartParse(candidates, n_copies);
+	size_t narrowest = candidates.size();
+	for(unsigned ti=0;ti<n_warm_up;++ti) {
+		ASSERT_TRUE(ConsumeToken(tokens[ti], ti, candidates));
+	}
+
+	unsigned n_allocating = 0;
+	for(unsigned ti=n_warm_up;ti<tokens.size();++ti) {
+		const std::vector<size_t> before = BufferCapacities(candidates);
+		ASSERT_TRUE(ConsumeToken(tokens[ti], ti, candidates));
+		if(BufferCapacities(candidates) != before) {
+			++n_allocating;
+		}
+		narrowest = std::min<size_t>(narrowest, candidates.size());
+	}
+	EXPECT_EQ(0u, n_allocating);
+	EXPECT_LT(sCandidateInlineCount, narrowest);
+
+	unsigned n_complete = 0;
+	for(Candidate const&cand : candidates) {
+		n_complete += cand.is_complete() ? 1 : 0;
+	}
+	EXPECT_EQ(n_copies, n_complete);
+}
+
+}  // namespace
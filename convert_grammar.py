@@ -6,15 +6,19 @@ import tempfile
 import os
 import subprocess
 
+import lex_dfa
+
 def main():
 
 	if len(sys.argv) < 4:
-		print("Usage: convert_grammar in lex_out grammar_out")
+		print("Usage: convert_grammar in lex_out grammar_out [lex_dfa_out]")
 		sys.exit(1)
 
 	in_path = sys.argv[1]
 	lex_out_path = sys.argv[2]
 	header_out_path = sys.argv[3]
+	# Tables for dfa_lexer.h
+	lex_dfa_out_path = sys.argv[4] if len(sys.argv) > 4 else None
 
 	lines = None
 	with open(in_path) as f:
@@ -45,26 +49,51 @@ def main():
 	grammar_lines = lines[grammar_divider_index+1:]
 
 	grammar_lines = list(filter(lambda s: not s.startswith("#"), grammar_lines))
+
+	# %sync item_token open_token close_token
+	sync_lines = list(filter(lambda s: s.startswith("%sync"), grammar_lines))
+	grammar_lines = list(filter(lambda s: not s.startswith("%"), grammar_lines))
 	
+	# Lexer token names, numbered in order of first use from 1, 0 is NULL
+	lex_tokens = []
+	token_action = re.compile("LexGetTokenInstName\\(\\\"([A-Z_]+[A-Z_0-9_]*)\\\"")
+	for line in lex_lines:
+		# LexGetTokenInstName("VOID", "")
+		match = token_action.search(line)
+		if match != None and match.group(1) not in lex_tokens:
+			lex_tokens.append(match.group(1))
+	token_ids = dict((name, i + 1) for i, name in enumerate(lex_tokens))
+
+	# The actions return ids rather than names, so the scanner hands tokens
+	#  over without looking the type up by name
+	def NumberAction(line):
+		return token_action.sub(
+			lambda m: "LexGetTokenInstId({id} /* {name} */".format(id=token_ids[m.group(1)], name=m.group(1)),
+			line)
+	flex_lines = [
+		"%{",
+		"#ifdef __cplusplus",
+		"extern \"C\"",
+		"#endif",
+		"unsigned LexGetTokenInstId(unsigned type, const char*content);",
+		"%}",
+		# State in a yyscan_t rather than globals, so files can be lexed
+		#  on several threads at once, see flex_scanner.h
+		"%option reentrant"] + list(map(NumberAction, lex_lines))
+
 	# Output lex file
 	tmp_fd, tmp_path = tempfile.mkstemp()
 	try:
 		with os.fdopen(tmp_fd, 'w') as tmp:
-			tmp.write("\n".join(lex_lines))
+			tmp.write("\n".join(flex_lines))
 
 		subprocess.call(["lex", "-o", lex_out_path, tmp_path])
 	finally:
 		os.remove(tmp_path)
 
+	if lex_dfa_out_path:
+		lex_dfa.WriteLexDfa(lex_lines, lex_dfa_out_path, token_ids)
 
-	# Extract lexer token names (set)
-	lex_tokens = set()
-
-	for line in lex_lines:
-		# LexGetTokenInstName("VOID", "")
-		match = re.search("LexGetTokenInstName\\(\\\"([A-Z_]+[A-Z_0-9_]*)\\\"", line)
-		if match != None:
-			lex_tokens.add(match.group(1))
 
 	# Write include file
 	with open(header_out_path, "w") as f:
@@ -76,6 +105,16 @@ const vector<string> sLexicalTokenTypes = {
 		f.write("""
 };
 
+""")
+		# Same ids as the lex actions, the index in sLexicalTokenTypes
+		f.write("""
+enum LexicalTokenType {
+	TokenType_NULL = 0,
+	""")
+		f.write(",\n\t".join(map(lambda s: "TokenType_{name} = {id}".format(name=s, id=token_ids[s]), lex_tokens)))
+		f.write("""
+};
+
 """)
 		# TODO: Write rules
 		f.write("""
@@ -101,6 +140,22 @@ const vector<RawRule> sRules = {
 		f.write("""
 };
 
+""")
+		# Sync tokens for splitting a top-level list into independent items
+		f.write("""
+const vector<vector<string> > sSyncRules = {
+	""")
+		def FormatSyncFromLine(line):
+			columns = list(filter(lambda s: len(s) != 0, re.split(r"[ \t]+", line)))
+			if len(columns) != 4:
+				print("Expected %sync item_token open_token close_token: " + line)
+				sys.exit(1)
+			return "{" + ", ".join(map(lambda s: "\"" + s + "\"", columns[1:])) + "}"
+		f.write(",\n\t".join(map(FormatSyncFromLine, sync_lines)))
+
+		f.write("""
+};
+
 """)
 
 
@@ -0,0 +1,309 @@
+
+#ifndef DFA_LEXER_H
+#define DFA_LEXER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// A lexer backend run from tables which convert_grammar.py builds from the
+//  /LEX/ section, instead of the flex scanner.
+// Lexes the same tokens as yylex() with the same yylineno, over a buffer
+//  in memory rather than through stdio. Runs of whitespace, and the bytes
+//  a state loops on like identifier and digit runs, are scanned 16 at a time.
+
+namespace parser {
+
+typedef unsigned TokenType;
+typedef unsigned Token;
+extern "C" Token LexGetTokenInstId(TokenType type, const char*content);
+
+struct DfaRule {
+	// The id from grammar.h, 0 when the match is skipped
+	TokenType token_type;
+	bool with_text;
+	bool has_newlines;
+};
+
+// Up to 4 byte ranges lo[i] to hi[i], inclusive
+struct DfaRanges {
+	unsigned char n;
+	unsigned char lo[4];
+	unsigned char hi[4];
+};
+
+// kDfaNumClasses, kDfaNumStates, sDfaByteClass, sDfaNext, sDfaAccept,
+//  sDfaRules, sDfaLoops, sDfaSkip
+#include "lex_dfa.h"
+
+// A file mapped read only
+class MappedFile {
+  public:
+	MappedFile() : data_(nullptr), size_(0) {}
+
+	MappedFile(MappedFile const&) = delete;
+	MappedFile& operator=(MappedFile const&) = delete;
+
+	~MappedFile() {
+		Close();
+	}
+
+	bool Open(const char*path) {
+		Close();
+		const int fd = ::open(path, O_RDONLY);
+		if(fd < 0) {
+			return false;
+		}
+		struct stat st;
+		if(::fstat(fd, &st) != 0) {
+			::close(fd);
+			return false;
+		}
+		size_ = st.st_size;
+		if(size_ > 0) {
+			void* mapped = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(mapped == MAP_FAILED) {
+				size_ = 0;
+				::close(fd);
+				return false;
+			}
+			data_ = static_cast<char const*>(mapped);
+			// Read front to back
+			::madvise(mapped, size_, MADV_SEQUENTIAL);
+		}
+		::close(fd);
+		return true;
+	}
+
+	void Close() {
+		if(data_) {
+			::munmap(const_cast<char*>(data_), size_);
+		}
+		data_ = nullptr;
+		size_ = 0;
+	}
+
+	char const* begin()const {
+		return data_;
+	}
+
+	char const* end()const {
+		return data_ + size_;
+	}
+
+	size_t size()const {
+		return size_;
+	}
+
+  private:
+	char const* data_;
+	size_t size_;
+};
+
+namespace dfa_lexer {
+
+#if defined(__SSE2__)
+// Bit i set where byte i of x is in ranges
+inline unsigned InRanges(__m128i x, DfaRanges const&ranges) {
+	__m128i in = _mm_setzero_si128();
+	for(unsigned ri=0;ri<ranges.n;++ri) {
+		// x - lo wraps around for bytes below lo
+		const __m128i offset = _mm_sub_epi8(x, _mm_set1_epi8(char(ranges.lo[ri])));
+		const __m128i width = _mm_set1_epi8(char(ranges.hi[ri] - ranges.lo[ri]));
+		in = _mm_or_si128(in, _mm_cmpeq_epi8(_mm_min_epu8(offset, width), offset));
+	}
+	return unsigned(_mm_movemask_epi8(in));
+}
+#endif
+
+inline bool InRanges(unsigned char c, DfaRanges const&ranges) {
+	for(unsigned ri=0;ri<ranges.n;++ri) {
+		if((c >= ranges.lo[ri]) && (c <= ranges.hi[ri])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Past the run of bytes in ranges from p, adding the newlines in it to *lines
+inline char const* SkipRanges(char const* p, char const* end,
+							  DfaRanges const&ranges, int *lines) {
+	// Most runs are empty or one byte
+	for(int si=0;si<2;++si) {
+		if((p == end) || !InRanges((unsigned char)*p, ranges)) {
+			return p;
+		}
+		if(lines && (*p == '\n')) {
+			++*lines;
+		}
+		++p;
+	}
+#if defined(__SSE2__)
+	const __m128i newline = _mm_set1_epi8('\n');
+	while((end - p) >= 16) {
+		const __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+		const unsigned out = ~InRanges(x, ranges) & 0xffff;
+		const unsigned run = out ? unsigned(__builtin_ctz(out)) : 16;
+		if(lines) {
+			const unsigned newlines = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(x, newline)));
+			*lines += __builtin_popcount(newlines & ((1u << run) - 1));
+		}
+		p += run;
+		if(out) {
+			return p;
+		}
+	}
+#endif
+	for(;(p != end) && InRanges((unsigned char)*p, ranges);++p) {
+		if(lines && (*p == '\n')) {
+			++*lines;
+		}
+	}
+	return p;
+}
+
+inline int CountNewlines(char const* p, char const* end) {
+	int lines = 0;
+#if defined(__SSE2__)
+	const __m128i newline = _mm_set1_epi8('\n');
+	for(;(end - p) >= 16;p += 16) {
+		const __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+		lines += __builtin_popcount(unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(x, newline))));
+	}
+#endif
+	for(;p != end;++p) {
+		lines += (*p == '\n');
+	}
+	return lines;
+}
+
+}  // namespace dfa_lexer
+
+// Lexes [begin, end), which has to outlive it.
+// lineno is yylineno at begin, for starting part way into a file.
+class DfaLexer {
+  public:
+	DfaLexer(char const* begin, char const* end, int lineno = 1)
+	  : p_(begin), end_(end), lineno_(lineno), text_(begin), length_(0) {}
+
+	// The next token, 0 at the end like yylex()
+	Token Next() {
+		const int rule = NextRule();
+		if(rule < 0) {
+			return 0;
+		}
+		DfaRule const&r = sDfaRules[rule];
+		if(!r.with_text) {
+			return LexGetTokenInstId(r.token_type, "");
+		}
+		text_buf_.assign(text_, length_);
+		return LexGetTokenInstId(r.token_type, text_buf_.c_str());
+	}
+
+	// The sDfaRules index of the next token, -1 at the end.
+	// Leaves the token's text in place, at text() and length(), for callers
+	//  which intern it only if they need to.
+	int NextRule() {
+		return NextRule(end_);
+	}
+
+	// Only tokens starting before limit, for lexing a file in pieces.
+	// Stops with pos() at the first token start, or skipped match, from limit
+	//  on. Matches still run on past limit, up to end.
+	int NextRule(char const* limit) {
+		for(;;) {
+			p_ = dfa_lexer::SkipRanges(p_, end_, sDfaSkip, &lineno_);
+			if(p_ >= limit) {
+				return -1;
+			}
+
+			int rule = -1;
+			char const* match_end = Match(p_, &rule);
+			if(rule < 0) {
+				// flex echoes a byte no rule matches
+				lineno_ += (*p_ == '\n');
+				++p_;
+				continue;
+			}
+
+			DfaRule const&r = sDfaRules[rule];
+			if(r.has_newlines) {
+				lineno_ += dfa_lexer::CountNewlines(p_, match_end);
+			}
+			text_ = p_;
+			length_ = match_end - p_;
+			p_ = match_end;
+			if(r.token_type) {
+				return rule;
+			}
+		}
+	}
+
+	// yylineno after the last token
+	int lineno()const {
+		return lineno_;
+	}
+
+	// yytext and yyleng of the last match, not 0 terminated
+	char const* text()const {
+		return text_;
+	}
+
+	size_t length()const {
+		return length_;
+	}
+
+	// Where the next token starts looking
+	char const* pos()const {
+		return p_;
+	}
+
+  private:
+
+	// End of the longest match from p, setting *rule to the earliest rule
+	//  with a match that long, or -1 with no match
+	char const* Match(char const* p, int *rule)const {
+		char const* match_end = p;
+		unsigned state = 1;
+		for(;;) {
+			DfaRanges const&loop = sDfaLoops[state];
+			if(loop.n) {
+				p = dfa_lexer::SkipRanges(p, end_, loop, nullptr);
+			}
+			if(sDfaAccept[state] >= 0) {
+				*rule = sDfaAccept[state];
+				match_end = p;
+			}
+			if(p == end_) {
+				return match_end;
+			}
+			state = sDfaNext[state][sDfaByteClass[(unsigned char)*p]];
+			if(state == 0) {
+				return match_end;
+			}
+			++p;
+		}
+	}
+
+	char const* p_;
+	char const* end_;
+	int lineno_;
+	char const* text_;
+	size_t length_;
+	// text_ 0 terminated, for LexGetTokenInstId
+	std::string text_buf_;
+};
+
+}  // namespace parser
+
+#endif//DFA_LEXER_H
@@ -0,0 +1,103 @@
+
+#include "dfa_lexer.h"
+#include "chunked_lex.h"
+#include "flex_scanner.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// Times the flex scanner against DfaLexer on a file read repeat times over
+//  into memory, in tokens per second.
+// Both lex the grammar the tree was built with, so build it from
+//  verilog.grammar to time Verilog input.
+// flex reads the buffer through stdio with fmemopen(), the way it reads
+//  a file, and DfaLexer reads it in place, as it does mmap'd.
+// With threads, LexChunked() is timed too.
+
+namespace {
+
+const int kRounds = 5;
+
+struct Record {
+	parser::TokenType type;
+	uint32_t offset;
+	uint32_t length;
+	int lineno;
+};
+
+template<typename F>
+void Time(char const* name, size_t bytes, F f) {
+	// Once to warm up the token ids
+	f();
+	auto start = std::chrono::steady_clock::now();
+	size_t tokens = 0;
+	for(int ri=0;ri<kRounds;++ri) {
+		tokens += f();
+	}
+	auto end = std::chrono::steady_clock::now();
+	const double s = std::chrono::duration<double>(end - start).count();
+	printf("%-10s %10zu tokens  %8.2f Mtokens/s  %8.2f MB/s\n", name, tokens / kRounds,
+		(tokens / s) * 1e-6, ((double(bytes) * kRounds) / s) * 1e-6);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+	if(argc < 2) {
+		fprintf(stderr, "Usage: dfa_lexer_bench file [repeat [threads]]\n");
+		return 1;
+	}
+	const int repeat = (argc > 2) ? std::max(1, atoi(argv[2])) : 1;
+	const int n_threads = (argc > 3) ? std::max(1, atoi(argv[3])) : 1;
+
+	parser::MappedFile file;
+	if(!file.Open(argv[1])) {
+		fprintf(stderr, "Couldn't open input file: %s\n", argv[1]);
+		return 1;
+	}
+	std::string input;
+	input.reserve(file.size() * repeat);
+	for(int ri=0;ri<repeat;++ri) {
+		input.append(file.begin(), file.end());
+		// Ends between tokens when the file doesn't end in a newline
+		input += '\n';
+	}
+	printf("%s x%i, %.2f MB\n", argv[1], repeat, input.size() * 1e-6);
+
+	Time("flex", input.size(), [&input]() {
+		FILE* in = ::fmemopen(&input[0], input.size(), "rb");
+		size_t n = 0;
+		{
+			parser::FlexScanner scanner(in);
+			while(scanner.Next()) {
+				++n;
+			}
+		}
+		fclose(in);
+		return n;
+	});
+
+	Time("dfa", input.size(), [&input]() {
+		parser::DfaLexer lexer(input.data(), input.data() + input.size());
+		size_t n = 0;
+		while(lexer.Next()) {
+			++n;
+		}
+		return n;
+	});
+
+	if(n_threads > 1) {
+		WorkStealingPool pool(n_threads);
+		std::vector<Record> tokens;
+		const size_t chunk_len = std::max(size_t(1) << 16, input.size() / (4 * n_threads));
+		Time("dfa chunks", input.size(), [&]() {
+			parser::LexChunked(input.data(), input.data() + input.size(), chunk_len, pool, tokens);
+			return tokens.size();
+		});
+	}
+	return 0;
+}
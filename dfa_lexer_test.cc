@@ -0,0 +1,98 @@
+
+
+#include "gtest/gtest.h"
+#include "dfa_lexer.h"
+#include "flex_scanner.h"
+#include "rules.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+typedef std::vector<std::pair<parser::Token, int> > TokenLines;
+
+TokenLines LexWithFlex(std::string const&input) {
+	// fmemopen() doesn't take an empty buffer
+	FILE* in = input.empty() ? ::fopen("/dev/null", "rb")
+		: ::fmemopen(const_cast<char*>(input.data()), input.size(), "rb");
+	TokenLines ret;
+	{
+		parser::FlexScanner scanner(in);
+		for(parser::Token tok = scanner.Next();tok != 0;tok = scanner.Next()) {
+			ret.emplace_back(tok, scanner.lineno());
+		}
+	}
+	fclose(in);
+	return ret;
+}
+
+TokenLines LexWithDfa(std::string const&input) {
+	parser::DfaLexer lexer(input.data(), input.data() + input.size());
+	TokenLines ret;
+	for(parser::Token tok = lexer.Next();tok != 0;tok = lexer.Next()) {
+		ret.emplace_back(tok, lexer.lineno());
+	}
+	return ret;
+}
+
+TEST(DfaLexerTest, Simple) {
+	const TokenLines tokens = LexWithDfa("true, false-12 +3");
+	ASSERT_EQ(7u, tokens.size());
+	EXPECT_EQ(parser::GetTokenInstName("TRUE"), tokens[0].first);
+	EXPECT_EQ(parser::GetTokenInstName("COMMA"), tokens[1].first);
+	EXPECT_EQ(parser::GetTokenInstName("FALSE"), tokens[2].first);
+	EXPECT_EQ(parser::GetTokenInstName("DASH"), tokens[3].first);
+	EXPECT_EQ(parser::GetTokenInstName("NUM", "12"), tokens[4].first);
+	EXPECT_EQ(parser::GetTokenInstName("PLUS"), tokens[5].first);
+	EXPECT_EQ(parser::GetTokenInstName("NUM", "3"), tokens[6].first);
+	EXPECT_EQ(LexWithFlex("true, false-12 +3"), tokens);
+}
+
+TEST(DfaLexerTest, LinesAndLongRuns) {
+	// Runs longer than one SIMD register, ending at and off its edges
+	std::string input;
+	for(int i=0;i<40;++i) {
+		input += std::string(i, ' ') + std::string(i + 1, '7') + "\n\t" + std::string(i % 17, '\n') + ",";
+	}
+	const TokenLines tokens = LexWithDfa(input);
+	ASSERT_EQ(80u, tokens.size());
+	EXPECT_EQ(parser::GetTokenInstName("NUM", "7777"), tokens[6].first);
+	EXPECT_EQ(1, tokens[0].second);
+	EXPECT_EQ(2, tokens[1].second);
+	EXPECT_EQ(LexWithFlex(input), tokens);
+}
+
+TEST(DfaLexerTest, Spans) {
+	const std::string input = "true 12\n, 345";
+	parser::DfaLexer lexer(input.data(), input.data() + input.size());
+	std::vector<std::string> spans;
+	for(int rule = lexer.NextRule();rule >= 0;rule = lexer.NextRule()) {
+		spans.push_back(std::string(parser::GetTokenTypeName(parser::sDfaRules[rule].token_type)) +
+			" " + std::string(lexer.text(), lexer.length()));
+	}
+	EXPECT_EQ(std::vector<std::string>({"TRUE true", "NUM 12", "COMMA ,", "NUM 345"}), spans);
+	EXPECT_EQ(2, lexer.lineno());
+}
+
+TEST(DfaLexerTest, SameAsFlex) {
+	// Bytes no rule matches are skipped, flex echoes them
+	const std::vector<std::string> pieces = {
+		"true", "false", "tru", "fals", "truefalse", ",", "-", "+", "1", "0",
+		"1234567890123456789", " ", "  ", "\t", "\n", "\n\n", std::string(20, ' '),
+		"x", "?", "\r", std::string(1, '\0'), "\xff"
+	};
+	srand(2024);
+	for(int ti=0;ti<2000;++ti) {
+		std::string input;
+		for(int pi=rand()%40;pi>0;--pi) {
+			input += pieces[rand() % pieces.size()];
+		}
+		ASSERT_EQ(LexWithFlex(input), LexWithDfa(input)) << input;
+	}
+}
+
+}  // namespace
@@ -0,0 +1,55 @@
+
+#ifndef FLEX_SCANNER_H
+#define FLEX_SCANNER_H
+
+#include <cstdio>
+
+// The scanners convert_grammar.py generates are reentrant (%option
+//  reentrant), with the input and line count in a yyscan_t rather than in
+//  globals. The token actions intern through LexGetTokenInstId(), into
+//  whatever the lexing thread's interning goes to.
+extern "C" {
+typedef void* yyscan_t;
+int yylex_init(yyscan_t *scanner);
+int yylex(yyscan_t scanner);
+void yyset_in(FILE *in, yyscan_t scanner);
+int yyget_lineno(yyscan_t scanner);
+int yylex_destroy(yyscan_t scanner);
+}
+
+namespace parser {
+
+// One flex scanner over a FILE, so several can lex at once on different
+//  threads
+class FlexScanner {
+  public:
+	// in is read from where it is, and closed by the caller once done
+	explicit FlexScanner(FILE *in) : scanner_(0) {
+		yylex_init(&scanner_);
+		yyset_in(in, scanner_);
+	}
+
+	~FlexScanner() {
+		yylex_destroy(scanner_);
+	}
+
+	FlexScanner(FlexScanner const&) = delete;
+	FlexScanner& operator=(FlexScanner const&) = delete;
+
+	// The next token, 0 at the end
+	unsigned Next() {
+		return yylex(scanner_);
+	}
+
+	// Line of the last token, from 1
+	int lineno()const {
+		return yyget_lineno(scanner_);
+	}
+
+  private:
+	yyscan_t scanner_;
+};
+
+}  // namespace parser
+
+#endif//FLEX_SCANNER_H
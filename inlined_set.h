@@ -5,10 +5,115 @@
 #include "absl/container/flat_hash_set.h"
 
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <iterator>
+#include <memory>
+#include <type_traits>
+#include <utility>
 
-// When >NInline elements, the set allocates
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Pointers and 4 or 8 byte integers, at most 8 of them inline: the local
+//  storage is unsorted and searched with SIMD compares
 template<typename T, int NInline>
+constexpr bool kInlinedSetUnsorted =
+	(std::is_pointer<T>::value || std::is_integral<T>::value) &&
+	((sizeof(T) == 4) || (sizeof(T) == 8)) && (NInline <= 8);
+
+// The local storage of InlinedSet, of which the first n are in the set
+// Kept sorted and binary searched
+template<typename T, int NInline, bool kUnsorted>
+struct InlinedSetLocal {
+	// Index of val, or -1
+	int find(T const&val, unsigned n)const {
+		T const* found = std::lower_bound(values, values + n, val);
+		if((found == (values + n)) || (val < *found)) {
+			return -1;
+		}
+		return found - values;
+	}
+
+	// val isn't in the set and n < NInline
+	void insert(T const&val, unsigned n) {
+		T* pos = std::upper_bound(values, values + n, val);
+		std::move_backward(pos, values + n, values + n + 1);
+		*pos = val;
+	}
+
+	void erase(unsigned index, unsigned n) {
+		std::move(values + index + 1, values + n, values + index);
+	}
+
+	T values[NInline];
+};
+
+template<typename T, int NInline>
+struct InlinedSetLocal<T, NInline, true> {
+	// Whole 16 byte registers, the slots past NInline are never in the set
+	static constexpr unsigned kPerRegister = 16 / sizeof(T);
+	static constexpr unsigned kSlots = ((NInline + kPerRegister - 1) / kPerRegister) * kPerRegister;
+
+	typedef typename std::conditional<sizeof(T) == 4, uint32_t, uint64_t>::type Bits;
+
+	// Zeroed so the compares never read uninitialized slots
+	InlinedSetLocal() : values() {}
+
+	int find(T const&val, unsigned n)const {
+		const unsigned found = Matches(val, n) & ((1u << n) - 1);
+		return found ? __builtin_ctz(found) : -1;
+	}
+
+	void insert(T const&val, unsigned n) {
+		values[n] = val;
+	}
+
+	// Swap-remove, order doesn't matter
+	void erase(unsigned index, unsigned n) {
+		values[index] = values[n-1];
+	}
+
+	T values[kSlots];
+
+  private:
+
+	static Bits ToBits(T const&val) {
+		Bits bits;
+		memcpy(&bits, &val, sizeof(T));
+		return bits;
+	}
+
+	// Bit i set where slot i holds val, for at least the first n slots
+	unsigned Matches(T const&val, unsigned n)const {
+		unsigned matches = 0;
+#if defined(__SSE2__)
+		// Only the registers holding the first n, which is usually one
+		for(unsigned i=0;i<n;i+=kPerRegister) {
+			const __m128i slots = _mm_loadu_si128(reinterpret_cast<__m128i const*>(values + i));
+			if(sizeof(T) == 4) {
+				const __m128i eq = _mm_cmpeq_epi32(slots, _mm_set1_epi32(int(ToBits(val))));
+				matches |= unsigned(_mm_movemask_ps(_mm_castsi128_ps(eq))) << i;
+			} else {
+				// SSE2 compares 32 bits at a time, both halves have to match
+				__m128i eq = _mm_cmpeq_epi32(slots, _mm_set1_epi64x((long long)ToBits(val)));
+				eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+				matches |= unsigned(_mm_movemask_pd(_mm_castsi128_pd(eq))) << i;
+			}
+		}
+#else
+		for(unsigned i=0;i<n;++i) {
+			matches |= unsigned(values[i] == val) << i;
+		}
+#endif
+		return matches;
+	}
+};
+
+// When >NInline elements, the set allocates
+// kUnsorted is only there to compare the two kinds of local storage
+template<typename T, int NInline, bool kUnsorted = kInlinedSetUnsorted<T, NInline> >
 struct InlinedSet {
 
 	struct iterator 
@@ -31,7 +136,7 @@ struct InlinedSet {
 
 	    reference operator*() const {
 	    	if(local_idx_ < it_set_->n_in_local_) {
-	    		return it_set_->local_storage_[local_idx_];
+	    		return it_set_->local_.values[local_idx_];
 	    	}
 	    	return *more_it_;
 	    }
@@ -71,37 +176,58 @@ private:
 	InlinedSet() : n_in_local_(0) {}
 
 	InlinedSet(InlinedSet const&o)
-		: 	n_in_local_(o.n_in_local_) {
+		: 	n_in_local_(o.n_in_local_),
+			local_(o.local_) {
 		if(o.more_storage_) {
 			more_storage_.reset(new absl::flat_hash_set<T>(*o.more_storage_));
 		}
-		for(int i=0;i<NInline;++i) {
-			local_storage_[i] = o.local_storage_[i];
-		}
 	}
 
 	InlinedSet(InlinedSet&& o)
 		: 	n_in_local_(o.n_in_local_), 
-			more_storage_(std::move(o.more_storage_)) {
-		for(int i=0;i<NInline;++i) {
-			local_storage_[i] = std::move(o.local_storage_[i]);
-		}
-
+			more_storage_(std::move(o.more_storage_)),
+			local_(std::move(o.local_)) {
 		o.n_in_local_ = 0;
 		o.more_storage_.reset(0);
 	}
 
-	bool contains(T const&val)const {
-		const auto p = std::equal_range(local_storage_, local_storage_ + n_in_local_, val);
-		if(p.first == p.second) {
-			return more_storage_ ? more_storage_->contains(val) : false;
+	// Keeps more_storage_, like clear()
+	InlinedSet& operator=(InlinedSet const&o) {
+		if(this == &o) {
+			return *this;
 		}
+		clear();
+		n_in_local_ = o.n_in_local_;
+		local_ = o.local_;
+		if(o.more_storage_ && !o.more_storage_->empty()) {
+			if(!more_storage_) {
+				more_storage_.reset(new absl::flat_hash_set<T>);
+			}
+			more_storage_->insert(o.more_storage_->begin(), o.more_storage_->end());
+		}
+		return *this;
+	}
+
+	InlinedSet& operator=(InlinedSet&& o) {
+		InlinedSet(std::move(o)).swap(*this);
+		return *this;
+	}
+
+	void swap(InlinedSet &o) {
+		std::swap(n_in_local_, o.n_in_local_);
+		std::swap(local_, o.local_);
+		more_storage_.swap(o.more_storage_);
+	}
 
-		auto pit = p.first;
-		++pit;
-		assert(pit == p.second);
+	friend void swap(InlinedSet &a, InlinedSet &b) {
+		a.swap(b);
+	}
 
-		return true;
+	bool contains(T const&val)const {
+		if(local_.find(val, n_in_local_) >= 0) {
+			return true;
+		}
+		return more_storage_ ? more_storage_->contains(val) : false;
 	}
 
 	void insert(T const&val) {
@@ -109,9 +235,8 @@ private:
 			return;
 		}
 		if(n_in_local_ < NInline) {
-			local_storage_[n_in_local_] = val;
+			local_.insert(val, n_in_local_);
 			n_in_local_++;
-			std::sort(local_storage_, local_storage_ + n_in_local_);
 		} else {
 			if(!more_storage_) {
 				more_storage_.reset(new absl::flat_hash_set<T>);
@@ -120,36 +245,45 @@ private:
 		}
 	}
 
-	void erase(T const&val) {
-		if(!contains(val)) {
-			return;
+	template<typename It>
+	void insert(It first, It last) {
+		for(;first != last;++first) {
+			insert(*first);
 		}
+	}
 
-		const auto p = std::equal_range(local_storage_, local_storage_ + n_in_local_, val);
-
-		if(p.first == p.second) {
-			assert(more_storage_);
-			more_storage_->erase(val);
+	// Takes all of o's elements, leaving it empty
+	void merge(InlinedSet&& o) {
+		if((size() == 0) && !more_storage_) {
+			swap(o);
 			return;
 		}
+		insert(o.begin(), o.end());
+		o.clear();
+	}
 
-		const unsigned index = p.first - local_storage_;
-
-		const unsigned n_after = NInline - index - 1;
-
-		if(n_after > 0) {
-			memmove(&local_storage_[index], &local_storage_[index+1], n_after * sizeof(T));
+	void erase(T const&val) {
+		const int index = local_.find(val, n_in_local_);
+		if(index < 0) {
+			if(more_storage_) {
+				more_storage_->erase(val);
+			}
+			return;
 		}
 
+		local_.erase(index, n_in_local_);
 		--n_in_local_;
 	}
 
+	// Keeps more_storage_, so refilling the set doesn't allocate it again
 	void clear() {
 		for(size_t i=0;i<n_in_local_;++i) {
-			local_storage_[i].~T();
+			local_.values[i].~T();
 		}
 		n_in_local_ = 0;
-		more_storage_.release();
+		if(more_storage_) {
+			more_storage_->clear();
+		}
 	}
 
 	size_t size()const {
@@ -175,7 +309,7 @@ private:
 
 	unsigned int n_in_local_;
 	std::unique_ptr<absl::flat_hash_set<T> > more_storage_;
-	T local_storage_[NInline];
+	InlinedSetLocal<T, NInline, kUnsorted> local_;
 };
 
 
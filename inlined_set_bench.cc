@@ -0,0 +1,129 @@
+
+
+#include "inlined_set.h"
+#include "absl/container/flat_hash_set.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Times pointer sets of the sizes SyntaxTree has: work_ptrs_ holds 1-3
+//  nodes for most tokens, with a tail into the tens on ambiguous input.
+// The slots of a ParsedSlot are CompactSets, but hold similar counts.
+// Each round fills a set, looks up every member and as many misses,
+//  then erases them all, the way the work ptrs turn over each token.
+// Then times a whole generation of the work ptrs, moved out of the set
+//  and reinserted vs swapped with a buffer which keeps its spill storage.
+
+namespace {
+
+struct Node {
+	char pad[64];
+};
+
+const int kRounds = 200000;
+
+template<typename Set>
+size_t Round(Set &set, std::vector<Node*> const&in, std::vector<Node*> const&out) {
+	size_t found = 0;
+	for(Node* n : in) {
+		set.insert(n);
+	}
+	for(size_t i=0;i<in.size();++i) {
+		found += set.contains(in[i]);
+		found += set.contains(out[i]);
+	}
+	for(Node* n : in) {
+		set.erase(n);
+	}
+	return found;
+}
+
+template<typename Set>
+void Time(char const* name, size_t n, std::vector<Node> &nodes) {
+	// Addresses out of order, as nodes come off the free list
+	std::vector<Node*> in;
+	std::vector<Node*> out;
+	for(size_t i=0;i<2*n;++i) {
+		Node* p = &nodes[(i * 7919) % nodes.size()];
+		((i % 2) ? out : in).push_back(p);
+	}
+
+	Set set;
+	auto start = std::chrono::steady_clock::now();
+	size_t check = 0;
+	for(int ri=0;ri<kRounds;++ri) {
+		check += Round(set, in, out);
+	}
+	auto end = std::chrono::steady_clock::now();
+	const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+	// insert + 2 contains + erase per element
+	printf("%-28s n=%-3zu %6.2f ns/op  (%zu)\n", name, n,
+		ns / (double(kRounds) * n * 4), check);
+}
+
+// One token's turnover of the work ptrs: the last generation is moved
+//  out and each of its members inserted into the next
+size_t MoveOutGeneration(InlinedSet<Node*, 4> &cur, InlinedSet<Node*, 4> &,
+						 std::vector<Node*> const&next) {
+	const auto prev = std::move(cur);
+	size_t i = 0;
+	for(auto it = prev.begin();it != prev.end();++it, ++i) {
+		cur.insert(next[i]);
+	}
+	return cur.size();
+}
+
+// The same, swapping with a kept buffer so the spill storage is reused
+size_t SwapGeneration(InlinedSet<Node*, 4> &cur, InlinedSet<Node*, 4> &prev,
+					  std::vector<Node*> const&next) {
+	prev.clear();
+	prev.swap(cur);
+	size_t i = 0;
+	for(auto it = prev.begin();it != prev.end();++it, ++i) {
+		cur.insert(next[i]);
+	}
+	return cur.size();
+}
+
+template<typename Generation>
+void TimeGenerations(char const* name, Generation generation, size_t n, std::vector<Node> &nodes) {
+	std::vector<Node*> gens[2];
+	for(size_t i=0;i<2*n;++i) {
+		gens[i%2].push_back(&nodes[(i * 7919) % nodes.size()]);
+	}
+
+	InlinedSet<Node*, 4> cur;
+	InlinedSet<Node*, 4> prev;
+	cur.insert(gens[0].begin(), gens[0].end());
+	auto start = std::chrono::steady_clock::now();
+	size_t check = 0;
+	for(int ri=0;ri<kRounds;++ri) {
+		check += generation(cur, prev, gens[(ri + 1) % 2]);
+	}
+	auto end = std::chrono::steady_clock::now();
+	const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+	printf("%-28s n=%-3zu %6.2f ns/generation  (%zu)\n", name, n,
+		ns / double(kRounds), check);
+}
+
+}  // namespace
+
+int main() {
+	std::vector<Node> nodes(1 << 12);
+	for(size_t n : {1, 2, 3, 4, 6, 8, 16}) {
+		Time<InlinedSet<Node*, 4, false> >("InlinedSet<4> sorted", n, nodes);
+		Time<InlinedSet<Node*, 4> >("InlinedSet<4> unsorted", n, nodes);
+		Time<InlinedSet<Node*, 8, false> >("InlinedSet<8> sorted", n, nodes);
+		Time<InlinedSet<Node*, 8> >("InlinedSet<8> unsorted", n, nodes);
+		Time<absl::flat_hash_set<Node*> >("absl::flat_hash_set", n, nodes);
+		printf("\n");
+	}
+	for(size_t n : {2, 4, 8, 16}) {
+		TimeGenerations("move out, reinsert", MoveOutGeneration, n, nodes);
+		TimeGenerations("swap with kept buffer", SwapGeneration, n, nodes);
+		printf("\n");
+	}
+	return 0;
+}
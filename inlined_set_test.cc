@@ -8,8 +8,8 @@
 
 namespace {
 
-template<typename T, int NInline>
-bool CheckSetsEqual(InlinedSet<T, NInline> &test,
+template<typename T, int NInline, bool kUnsorted>
+bool CheckSetsEqual(InlinedSet<T, NInline, kUnsorted> &test,
 					absl::flat_hash_set<T> &ref) {
 	std::vector<T> values_from_test;
 	for(T v : test) {
@@ -29,34 +29,34 @@ bool CheckSetsEqual(InlinedSet<T, NInline> &test,
 
 struct InlinedSetTest : public ::testing::Test {
 
-	template<int nInline>
+	template<int nInline, typename T = int, bool kUnsorted = kInlinedSetUnsorted<T, nInline> >
 	void TestRandom() {
 		const int kMaxVal = 100;
 		srand(5555);	
 		for(int ti=0;ti<200;++ti) {
-			InlinedSet<int, nInline> test;
-			absl::flat_hash_set<int> ref;
+			InlinedSet<T, nInline, kUnsorted> test;
+			absl::flat_hash_set<T> ref;
 			for(int ci=0;ci<200;++ci) {
 
 				// Stay relatively close to 0, 
 				//  since that's where the custom function is
 				if(0==(rand()%3)) {
-					const int val = rand()%kMaxVal;
+					const T val = rand()%kMaxVal;
 					test.insert(val);
 					ref.insert(val);
 				}
 				if(0==(rand()%2)) {
-					const int val = rand()%kMaxVal;
+					const T val = rand()%kMaxVal;
 					test.erase(val);
 					ref.erase(val);
 				}
 				{
 					// Check random
-					const int val = rand()%kMaxVal;
+					const T val = rand()%kMaxVal;
 					ASSERT_EQ(ref.contains(val), test.contains(val));
 				}
 
-				const bool sets_equal = CheckSetsEqual<int, nInline>(test, ref);
+				const bool sets_equal = CheckSetsEqual(test, ref);
 				ASSERT_TRUE(sets_equal);
 			}
 		}
@@ -210,6 +210,141 @@ TEST_F(InlinedSetTest, RandomTest) {
 	TestRandom<2>();
 	TestRandom<3>();
 	TestRandom<4>();
+	TestRandom<8>();
+	TestRandom<3, long long>();
+	TestRandom<8, long long>();
+}
+
+TEST_F(InlinedSetTest, RandomTestSorted) {
+	TestRandom<1, int, false>();
+	TestRandom<3, int, false>();
+	TestRandom<4, int, false>();
+	TestRandom<12>();
+}
+
+TEST_F(InlinedSetTest, UnsortedPointers) {
+	static_assert(kInlinedSetUnsorted<int*, 4>, "pointers are compared unsorted");
+	static_assert(!kInlinedSetUnsorted<int*, 9>, "more than 8 stay sorted");
+	static_assert(!kInlinedSetUnsorted<float, 4>, "only pointers and integers");
+
+	int values[6];
+	InlinedSet<int*, 3> test;
+	for(int* p = values;p != values + 6;++p) {
+		test.insert(p);
+	}
+	EXPECT_EQ(6u, test.size());
+
+	// Takes the last local one's place, a slot past the end still holds it
+	test.erase(&values[0]);
+	EXPECT_FALSE(test.contains(&values[0]));
+	EXPECT_TRUE(test.contains(&values[2]));
+	test.erase(&values[2]);
+	EXPECT_FALSE(test.contains(&values[2]));
+	EXPECT_TRUE(test.contains(&values[1]));
+	EXPECT_TRUE(test.contains(&values[5]));
+	EXPECT_EQ(4u, test.size());
+
+	// Refills the local slots before the spilled ones
+	test.insert(&values[0]);
+	EXPECT_TRUE(test.contains(&values[0]));
+	EXPECT_EQ(5u, test.size());
+
+	std::vector<int*> from_test(test.begin(), test.end());
+	std::sort(from_test.begin(), from_test.end());
+	const std::vector<int*> expected = {&values[0], &values[1], &values[3], &values[4], &values[5]};
+	EXPECT_EQ(expected, from_test);
+}
+
+TEST_F(InlinedSetTest, BulkInsert) {
+	const std::vector<int> values = {5, 3, 5, 9, 1, 3, 7, 2};
+	InlinedSet<int, 3> test;
+	test.insert(values.begin(), values.end());
+	EXPECT_EQ(6u, test.size());
+
+	absl::flat_hash_set<int> ref(values.begin(), values.end());
+	EXPECT_TRUE(CheckSetsEqual(test, ref));
+}
+
+TEST_F(InlinedSetTest, Merge) {
+	InlinedSet<int, 2> test;
+	InlinedSet<int, 2> other;
+	absl::flat_hash_set<int> ref;
+	for(int v : {1, 2, 3, 4}) {
+		other.insert(v);
+		ref.insert(v);
+	}
+
+	// Into an empty set, takes other's storage
+	test.merge(std::move(other));
+	EXPECT_EQ(0u, other.size());
+	EXPECT_TRUE(CheckSetsEqual(test, ref));
+
+	for(int v : {3, 4, 5, 6}) {
+		other.insert(v);
+		ref.insert(v);
+	}
+	test.merge(std::move(other));
+	EXPECT_EQ(0u, other.size());
+	EXPECT_FALSE(other.contains(5));
+	EXPECT_TRUE(CheckSetsEqual(test, ref));
+}
+
+TEST_F(InlinedSetTest, SwapAndAssign) {
+	InlinedSet<float, 2> a;
+	InlinedSet<float, 2> b;
+	for(float v : {1.0f, 2.0f, 3.0f}) {
+		a.insert(v);
+	}
+	b.insert(4.0f);
+
+	swap(a, b);
+	EXPECT_EQ(1u, a.size());
+	EXPECT_TRUE(a.contains(4.0f));
+	EXPECT_EQ(3u, b.size());
+	EXPECT_TRUE(b.contains(3.0f));
+
+	a = b;
+	EXPECT_EQ(3u, a.size());
+	EXPECT_FALSE(a.contains(4.0f));
+	EXPECT_TRUE(a.contains(1.0f));
+	EXPECT_TRUE(a.contains(3.0f));
+
+	b.clear();
+	a = std::move(b);
+	EXPECT_EQ(0u, a.size());
+	EXPECT_FALSE(a.contains(3.0f));
+}
+
+TEST_F(InlinedSetTest, DoubleBuffered) {
+	// Each generation maps the last one's values, the way work ptrs do
+	srand(4321);
+	InlinedSet<int*, 4> cur;
+	InlinedSet<int*, 4> prev;
+	absl::flat_hash_set<int*> ref;
+	int values[64];
+	for(int gi=0;gi<500;++gi) {
+		prev.clear();
+		prev.swap(cur);
+		ASSERT_EQ(0u, cur.size());
+
+		absl::flat_hash_set<int*> next_ref;
+		for(int* p : prev) {
+			ASSERT_TRUE(ref.contains(p));
+			if(rand()%4) {
+				int* const to = &values[(p - values + 1 + rand()%3) % 64];
+				cur.insert(to);
+				next_ref.insert(to);
+			}
+		}
+		for(int ni=rand()%(1 + (gi%16));ni>0;--ni) {
+			int* const to = &values[rand()%64];
+			cur.insert(to);
+			next_ref.insert(to);
+		}
+		ASSERT_EQ(ref.size(), prev.size());
+		ref.swap(next_ref);
+		ASSERT_TRUE(CheckSetsEqual(cur, ref));
+	}
 }
 
 }  // namespace
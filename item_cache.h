@@ -0,0 +1,420 @@
+
+#ifndef ITEM_CACHE_H
+#define ITEM_CACHE_H
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+
+#include "parser.h"
+
+namespace parser {
+
+// Finished parses of top-level items, keyed by a hash of the item's token
+//  types and contents.
+// Preprocessed inputs repeat the same header-derived items in every
+//  translation unit, so a batch of files can splice in earlier subtrees
+//  instead of parsing them again.
+// Entries keep the item's tokens, so a hash collision is a miss rather than
+//  the wrong subtree.
+// Cached subtrees are copied out of the session's child arrays, with token
+//  indices rebased to 0. Keys only depend on token text, so a cache outlives
+//  the sessions it was filled from, and one saved by one process can be
+//  loaded by another built from the same grammar.
+// The cache holds at most max_items, dropping the least recently used.
+struct ItemCache {
+	explicit ItemCache(size_t max_items)
+	  : max_items_(max_items), hits_(0), misses_(0) {
+	}
+
+	// On a hit, item is the cached parse of tokens[first, last), with its
+	//  child arrays in the current session
+	bool Lookup(vector<LexedRecord> const&tokens, unsigned first, unsigned last,
+				Candidate &item) {
+		auto found = entries_.find(HashItem(tokens, first, last));
+		if((found == entries_.end()) || !SameTokens(*found->second, tokens, first, last)) {
+			++misses_;
+			return false;
+		}
+		++hits_;
+		lru_.splice(lru_.begin(), lru_, found->second);
+
+		Entry const&entry = *found->second;
+		item = Candidate();
+		for(CachedNode const&cached : entry.nodes) {
+			Node node(*cached.rule, cached.parent);
+			rebased_.clear();
+			for(unsigned hi=cached.first_handle;hi<(cached.first_handle+cached.n_handles);++hi) {
+				const Node::ParsedToken parsed(entry.handles[hi]);
+				rebased_.push_back(parsed.is_sub() ? parsed.handle :
+					Node::ParsedToken::Lexed(parsed.token_index() + first).handle);
+			}
+			node.parsed_tokens.assign(rebased_.data(), rebased_.size());
+			item.add_node(node);
+		}
+		return true;
+	}
+
+	// Caches item as the parse of tokens[first, last)
+	void Insert(vector<LexedRecord> const&tokens, unsigned first, unsigned last,
+				Candidate const&item) {
+		Entry entry;
+		entry.key = HashItem(tokens, first, last);
+		if(entries_.contains(entry.key)) {
+			return;
+		}
+
+		entry.n_tokens = last - first;
+		for(unsigned ti=first;ti<last;++ti) {
+			AppendLexedKey(entry.tokens, tokens[ti]);
+		}
+		for(unsigned nid=NodeId_Top;nid<item.next_node_id;++nid) {
+			Node const&node = item.get_node(NodeId(nid));
+			entry.nodes.push_back(CachedNode{node.rule, node.parent,
+				(uint32_t)entry.handles.size(), node.parsed_tokens.size()});
+			for(Node::ParsedToken parsed : node.parsed_tokens) {
+				entry.handles.push_back(parsed.is_sub() ? parsed.handle :
+					Node::ParsedToken::Lexed(parsed.token_index() - first).handle);
+			}
+		}
+		Add(std::move(entry));
+	}
+
+	size_t size()const {
+		return lru_.size();
+	}
+
+	unsigned long long hits()const {
+		return hits_;
+	}
+
+	void PrintStats()const {
+		const unsigned long long lookups = hits_ + misses_;
+		fprintf(stderr, "Item cache: %llu hits / %llu lookups (%.1f%%), %i items\n",
+			hits_, lookups, lookups ? (100.0 * hits_ / lookups) : 0.0, (int)size());
+	}
+
+	// Identifies the rules a cache was saved with, as entries refer to them
+	//  by name and rely on their patterns
+	static uint64_t GrammarFingerprint() {
+		uint64_t h = sFnvOffset;
+		for(auto const&value : sRulesByRuleName) {
+			Rule const&rule = value.second;
+			h = HashString(h, GetRuleName(rule.name));
+			h = HashString(h, GetTokenInstTypeName(rule.token_name));
+			for(Token tok : rule.pattern) {
+				h = HashString(h, GetTokenInstTypeName(tok));
+			}
+		}
+		return h;
+	}
+
+	// Text format, a header line and then one item per line:
+	//   item_cache version fingerprint
+	//   n_tokens {type length text}... n_nodes {rule_name parent n_parsed handle...}...
+	bool Save(const char*path)const {
+		std::ofstream out(path);
+		if(!out.good()) {
+			return false;
+		}
+		out << "item_cache " << sFileVersion << " " << GrammarFingerprint() << "\n";
+		// Oldest first, so loading keeps the recency order
+		for(auto it = lru_.rbegin();it != lru_.rend();++it) {
+			out << it->n_tokens;
+			const char*pos = it->tokens.data();
+			for(unsigned ti=0;ti<it->n_tokens;++ti) {
+				TokenType type;
+				uint32_t length;
+				memcpy(&type, pos, sizeof(type));
+				memcpy(&length, pos + sizeof(type), sizeof(length));
+				pos += sizeof(type) + sizeof(length);
+				out << " " << GetTokenTypeName(type) << " " << length << " ";
+				out.write(pos, length);
+				pos += length;
+			}
+
+			out << " " << it->nodes.size();
+			for(CachedNode const&cached : it->nodes) {
+				out << " " << GetRuleName(cached.rule->name) << " " << cached.parent
+					<< " " << cached.n_handles;
+				for(unsigned hi=cached.first_handle;hi<(cached.first_handle+cached.n_handles);++hi) {
+					out << " " << it->handles[hi];
+				}
+			}
+			out << "\n";
+		}
+		return out.good();
+	}
+
+	// Entries which don't fit the grammar are skipped. Returns false if the
+	//  file can't be read, or was saved with another grammar.
+	bool Load(const char*path) {
+		std::ifstream in(path);
+		if(!in.good()) {
+			return false;
+		}
+
+		string magic;
+		unsigned version;
+		uint64_t fingerprint;
+		if(!(in >> magic >> version >> fingerprint) || (magic != "item_cache") ||
+		   (version != sFileVersion)) {
+			fprintf(stderr, "Item cache %s: not an item cache\n", path);
+			return false;
+		}
+		if(fingerprint != GrammarFingerprint()) {
+			fprintf(stderr, "Item cache %s: saved with another grammar\n", path);
+			return false;
+		}
+
+		map<string, Rule const*> rules_by_name;
+		for(auto const&value : sRulesByRuleName) {
+			rules_by_name[GetRuleName(value.first)] = &value.second;
+		}
+
+		Entry entry;
+		vector<TokenType> types;
+		string text;
+		unsigned n_rejected = 0;
+		while(in >> entry.n_tokens) {
+			entry.key = sFnvOffset;
+			entry.tokens.clear();
+			entry.nodes.clear();
+			entry.handles.clear();
+			types.clear();
+			bool valid = true;
+
+			for(unsigned ti=0;ti<entry.n_tokens;++ti) {
+				string type_name;
+				uint32_t length;
+				if(!(in >> type_name >> length) || (in.get() != ' ')) {
+					return false;
+				}
+				text.resize(length);
+				if(!in.read(&text[0], length)) {
+					return false;
+				}
+				const TokenType type = GetTokenTypeId(type_name.c_str());
+				valid = valid && TokenTypeIsLexical(type);
+				types.push_back(type);
+				AppendLexedKey(entry.tokens, type, text.data(), length);
+				entry.key = (entry.key ^ HashString(HashString(sFnvOffset, type_name.c_str()),
+					text.data(), length)) * sFnvPrime;
+			}
+
+			unsigned n_nodes;
+			if(!(in >> n_nodes)) {
+				return false;
+			}
+			for(unsigned ni=0;ni<n_nodes;++ni) {
+				string rule_name;
+				unsigned parent, n_parsed;
+				if(!(in >> rule_name >> parent >> n_parsed)) {
+					return false;
+				}
+				auto found = rules_by_name.find(rule_name);
+				valid = valid && (found != rules_by_name.end());
+				entry.nodes.push_back(CachedNode{valid ? found->second : 0, NodeId(parent),
+					(uint32_t)entry.handles.size(), n_parsed});
+				for(unsigned pi=0;pi<n_parsed;++pi) {
+					uint32_t handle;
+					if(!(in >> handle)) {
+						return false;
+					}
+					entry.handles.push_back(handle);
+				}
+			}
+
+			if(!valid || !IsValid(entry, types)) {
+				++n_rejected;
+				continue;
+			}
+			if(!entries_.contains(entry.key)) {
+				Add(std::move(entry));
+			}
+		}
+		if(n_rejected) {
+			fprintf(stderr, "Item cache %s: rejected %i bad items\n", path, (int)n_rejected);
+		}
+		return in.eof();
+	}
+
+  private:
+	static const uint64_t sFnvOffset = 14695981039346656037ull;
+	static const uint64_t sFnvPrime = 1099511628211ull;
+	static const unsigned sFileVersion = 2;
+
+	static uint64_t HashString(uint64_t h, const char*s, size_t len) {
+		for(size_t si=0;si<len;++si) {
+			h = (h ^ (unsigned char)s[si]) * sFnvPrime;
+		}
+		// Separator, so "ab"+"c" and "a"+"bc" differ
+		return (h ^ 0xff) * sFnvPrime;
+	}
+
+	static uint64_t HashString(uint64_t h, const char*s) {
+		return HashString(h, s, strlen(s));
+	}
+
+	uint64_t HashItem(vector<LexedRecord> const&tokens, unsigned first, unsigned last) {
+		uint64_t h = sFnvOffset;
+		for(unsigned ti=first;ti<last;++ti) {
+			h = (h ^ HashLexed(tokens[ti])) * sFnvPrime;
+		}
+		return h;
+	}
+
+	// Hashes the text in place rather than interning it, to the same
+	//  value HashToken() gives the interned token
+	uint64_t HashLexed(LexedRecord const&lexed) {
+		if(lexed.interned) {
+			return HashToken(lexed.interned);
+		}
+		return HashString(HashString(sFnvOffset, GetTokenTypeName(lexed.type)),
+			CurrentSession().lexed_text + lexed.offset, lexed.length);
+	}
+
+	uint64_t HashToken(Token tok) {
+		// Ids past the shared tokens mean something else in each session
+		if(tok > sSharedTokens.size()) {
+			return HashString(HashString(sFnvOffset, GetTokenInstTypeName(tok)),
+				GetTokenInstContent(tok));
+		}
+		if(tok >= token_hashes_.size()) {
+			token_hashes_.resize(tok+1, 0);
+		}
+		if(token_hashes_[tok] == 0) {
+			token_hashes_[tok] = HashString(
+				HashString(sFnvOffset, GetTokenInstTypeName(tok)),
+				GetTokenInstContent(tok));
+		}
+		return token_hashes_[tok];
+	}
+
+	// A cached item's nodes in id order from NodeId_Top, with their child
+	//  handles in one array
+	struct CachedNode {
+		Rule const*rule;
+		NodeId parent;
+		uint32_t first_handle;
+		uint32_t n_handles;
+	};
+
+	// Copied out of the session's child arrays, so the entry outlives it.
+	// Lexed handles are rebased to 0.
+	struct Entry {
+		uint64_t key;
+		unsigned n_tokens;
+		// See AppendLexedKey()
+		string tokens;
+		vector<CachedNode> nodes;
+		vector<uint32_t> handles;
+	};
+
+	bool SameTokens(Entry const&entry, vector<LexedRecord> const&tokens,
+					unsigned first, unsigned last) {
+		if(entry.n_tokens != (last - first)) {
+			return false;
+		}
+		tokens_key_.clear();
+		for(unsigned ti=first;ti<last;++ti) {
+			AppendLexedKey(tokens_key_, tokens[ti]);
+		}
+		return tokens_key_ == entry.tokens;
+	}
+
+	// Whether a loaded entry is a complete item of the grammar's rules over
+	//  its tokens: the root is a %sync item, every pattern is filled, and
+	//  each child is in exactly one slot, of the parent it points back at
+	static bool IsValid(Entry const&entry, vector<TokenType> const&types) {
+		const unsigned n_nodes = entry.nodes.size();
+		if(n_nodes == 0) {
+			return false;
+		}
+		auto node_index = [n_nodes](NodeId nid) {
+			return ((nid >= NodeId_Top) && (nid < (NodeId_Top + n_nodes))) ?
+				int(nid - NodeId_Top) : -1;
+		};
+		if((entry.nodes[0].parent != NodeId_Null) || !IsItemRule(*entry.nodes[0].rule)) {
+			return false;
+		}
+
+		vector<unsigned> n_slots(n_nodes, 0);
+		for(unsigned ni=0;ni<n_nodes;++ni) {
+			CachedNode const&cached = entry.nodes[ni];
+			if((ni > 0) && ((node_index(cached.parent) < 0) ||
+							(node_index(cached.parent) == (int)ni))) {
+				return false;
+			}
+			if(cached.n_handles != cached.rule->pattern.size()) {
+				return false;
+			}
+			for(unsigned pi=0;pi<cached.n_handles;++pi) {
+				const Node::ParsedToken parsed(entry.handles[cached.first_handle + pi]);
+				const Token expected = cached.rule->pattern[pi];
+				if(parsed.is_sub()) {
+					const int sub = node_index(parsed.sub());
+					if((sub <= 0) ||
+					   (entry.nodes[sub].parent != NodeId(NodeId_Top + ni)) ||
+					   (entry.nodes[sub].rule->token_name != expected)) {
+						return false;
+					}
+					++n_slots[sub];
+				} else if((parsed.token_index() >= entry.n_tokens) ||
+						  (types[parsed.token_index()] != GetTokenInstType(expected))) {
+					return false;
+				}
+			}
+		}
+		for(unsigned ni=1;ni<n_nodes;++ni) {
+			if(n_slots[ni] != 1) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Whether rule parses the item token of one of the grammar's %sync rules
+	static bool IsItemRule(Rule const&rule) {
+		for(vector<string> const&sync : sSyncRules) {
+			if(rule.token_name == GetTokenInstName(sync[0].c_str(), "")) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void Add(Entry &&entry) {
+		lru_.push_front(std::move(entry));
+		entries_[lru_.front().key] = lru_.begin();
+
+		while(lru_.size() > max_items_) {
+			entries_.erase(lru_.back().key);
+			lru_.pop_back();
+		}
+	}
+
+	size_t max_items_;
+	std::list<Entry> lru_;
+	absl::flat_hash_map<uint64_t, std::list<Entry>::iterator> entries_;
+
+	// Token ids are per process, so keys are built from token text.
+	// Only the shared tokens' hashes are kept.
+	vector<uint64_t> token_hashes_;
+
+	// Scratch for Lookup()
+	vector<uint32_t> rebased_;
+	string tokens_key_;
+
+	unsigned long long hits_;
+	unsigned long long misses_;
+};
+
+}  // namespace parser
+
+#endif//ITEM_CACHE_H
@@ -0,0 +1,208 @@
+
+
+#include "gtest/gtest.h"
+#include "parser.h"
+#include "chunked_parse.h"
+#include "flex_scanner.h"
+#include "item_cache.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace parser;
+
+namespace {
+
+void SetupOnce() {
+	static bool done = false;
+	if(!done) {
+		SetupParser();
+		done = true;
+	}
+}
+
+vector<LexedRecord> Lex(std::string const&input) {
+	vector<LexedRecord> tokens;
+	FILE* in = ::fmemopen(const_cast<char*>(input.data()), input.size(), "rb");
+	{
+		FlexScanner scanner(in);
+		for(Token tok = scanner.Next();tok != 0;tok = scanner.Next()) {
+			tokens.push_back(LexedRecord::Interned(tok, scanner.lineno()));
+		}
+	}
+	fclose(in);
+	return tokens;
+}
+
+// The only complete parse of tokens as a %sync item
+Candidate ParseItem(vector<LexedRecord> const&tokens) {
+	vector<Rule> const&block_rules = GetRulesForTokenName(GetTokenInstName("block", ""));
+	CandidateVector completed = ParseRange(block_rules, tokens,
+		TokenRange{0, (unsigned)tokens.size()}, [](Candidate const&) { return true; });
+	EXPECT_EQ(1u, completed.size());
+	return completed.size() ? completed[0] : Candidate();
+}
+
+std::string ReadFile(const char*path) {
+	std::ifstream in(path);
+	std::stringstream ret;
+	ret << in.rdbuf();
+	return ret.str();
+}
+
+void WriteFile(const char*path, std::string const&contents) {
+	std::ofstream out(path);
+	out << contents;
+}
+
+const char* kInput = "begin 12 3 end ;";
+
+TEST(ItemCacheTest, HitNeedsSameTokens) {
+	SetupOnce();
+	ParseSession session;
+	ParseSession::Scope scope(session);
+
+	const vector<LexedRecord> tokens = Lex(kInput);
+	const Candidate item = ParseItem(tokens);
+	ItemCache cache(16);
+	cache.Insert(tokens, 0, tokens.size(), item);
+
+	Candidate found;
+	ASSERT_TRUE(cache.Lookup(tokens, 0, tokens.size(), found));
+	EXPECT_EQ(item.ToString(), found.ToString());
+
+	// Same length and types, other text
+	EXPECT_FALSE(cache.Lookup(Lex("begin 12 4 end ;"), 0, tokens.size(), found));
+	EXPECT_FALSE(cache.Lookup(tokens, 0, tokens.size()-1, found));
+}
+
+TEST(ItemCacheTest, SaveAndLoad) {
+	SetupOnce();
+	const char* path = "item_cache_test_save.txt";
+	std::string item_string;
+	{
+		ParseSession session;
+		ParseSession::Scope scope(session);
+		const vector<LexedRecord> tokens = Lex(kInput);
+		const Candidate item = ParseItem(tokens);
+		item_string = item.ToString();
+		ItemCache cache(16);
+		cache.Insert(tokens, 0, tokens.size(), item);
+		ASSERT_TRUE(cache.Save(path));
+	}
+
+	// In a later session, which doesn't have the saved item's child arrays
+	ParseSession session;
+	ParseSession::Scope scope(session);
+	ItemCache loaded(16);
+	ASSERT_TRUE(loaded.Load(path));
+	EXPECT_EQ(1u, loaded.size());
+
+	const vector<LexedRecord> tokens = Lex(kInput);
+	for(unsigned ti=0;ti<tokens.size();++ti) {
+		RecordLexedToken(tokens[ti], ti);
+	}
+	Candidate found;
+	ASSERT_TRUE(loaded.Lookup(tokens, 0, tokens.size(), found));
+	EXPECT_EQ(item_string, found.ToString());
+	remove(path);
+}
+
+TEST(ItemCacheTest, LoadRejectsNonItems) {
+	SetupOnce();
+	const char* path = "item_cache_test_non_item.txt";
+	{
+		// A complete parse, but of a body rather than a %sync item
+		ParseSession session;
+		ParseSession::Scope scope(session);
+		const vector<LexedRecord> tokens = Lex("12 3");
+		vector<Rule> const&body_rules = GetRulesForTokenName(GetTokenInstName("body", ""));
+		CandidateVector completed = ParseRange(body_rules, tokens,
+			TokenRange{0, (unsigned)tokens.size()}, [](Candidate const&) { return true; });
+		ASSERT_EQ(1u, completed.size());
+		ItemCache cache(16);
+		cache.Insert(tokens, 0, tokens.size(), completed[0]);
+		ASSERT_TRUE(cache.Save(path));
+	}
+
+	ItemCache loaded(16);
+	EXPECT_TRUE(loaded.Load(path));
+	EXPECT_EQ(0u, loaded.size());
+	remove(path);
+}
+
+TEST(ItemCacheTest, LoadRejectsBadItems) {
+	SetupOnce();
+	const char* path = "item_cache_test_load.txt";
+	{
+		ParseSession session;
+		ParseSession::Scope scope(session);
+		const vector<LexedRecord> tokens = Lex(kInput);
+		ItemCache cache(16);
+		cache.Insert(tokens, 0, tokens.size(), ParseItem(tokens));
+		ASSERT_TRUE(cache.Save(path));
+	}
+	const std::string saved = ReadFile(path);
+	const size_t header_end = saved.find('\n') + 1;
+	const std::string header = saved.substr(0, header_end);
+	const std::string item = saved.substr(header_end);
+
+	// Another grammar
+	WriteFile(path, "item_cache 2 12345\n" + item);
+	ItemCache other_grammar(16);
+	EXPECT_FALSE(other_grammar.Load(path));
+	EXPECT_EQ(0u, other_grammar.size());
+
+	// A lexed handle past the item's tokens, which is skipped. The last
+	//  handle on the line is the final NUM.
+	std::string bad_handle = item;
+	bad_handle[bad_handle.rfind(' ') + 1] = '9';
+	WriteFile(path, header + bad_handle);
+	ItemCache loaded(16);
+	EXPECT_TRUE(loaded.Load(path));
+	EXPECT_EQ(0u, loaded.size());
+
+	// A sub under a node of the wrong parent
+	std::string bad_parent = item;
+	const size_t body_num = bad_parent.find(" body_num ");
+	ASSERT_NE(std::string::npos, body_num);
+	bad_parent[body_num + 10] = '1';
+	WriteFile(path, header + bad_parent);
+	ItemCache wrong_parent(16);
+	EXPECT_TRUE(wrong_parent.Load(path));
+	EXPECT_EQ(0u, wrong_parent.size());
+
+	// An item without its trailing SEMI, which block_semi needs
+	std::string incomplete = item;
+	const std::string root = " block_semi 0 4 0 2147483651 3 4 ";
+	const size_t root_pos = incomplete.find(root);
+	ASSERT_NE(std::string::npos, root_pos);
+	incomplete.replace(root_pos, root.size(), " block_semi 0 3 0 2147483651 3 ");
+	WriteFile(path, header + incomplete);
+	ItemCache not_complete(16);
+	EXPECT_TRUE(not_complete.Load(path));
+	EXPECT_EQ(0u, not_complete.size());
+
+	// A fourth node, under the root but in none of its slots
+	std::string orphan = item;
+	const size_t n_nodes = orphan.find(" 3 block_semi ");
+	ASSERT_NE(std::string::npos, n_nodes);
+	orphan[n_nodes + 1] = '4';
+	orphan.insert(orphan.find('\n'), " body_num 1 1 1");
+	WriteFile(path, header + orphan);
+	ItemCache not_linked(16);
+	EXPECT_TRUE(not_linked.Load(path));
+	EXPECT_EQ(0u, not_linked.size());
+
+	// Cut short
+	WriteFile(path, header + item.substr(0, item.size() / 2));
+	ItemCache truncated(16);
+	EXPECT_FALSE(truncated.Load(path));
+	EXPECT_EQ(0u, truncated.size());
+	remove(path);
+}
+
+}  // namespace
@@ -0,0 +1,573 @@
+#!/usr/bin/env python3
+
+# Builds the tables dfa_lexer.h runs from the /LEX/ section of a grammar.
+#
+# Handles the subset of flex the grammars use: definitions, quoted strings,
+#  character classes, ., {name}, {n,m}, grouping, |, *, + and ?
+# Actions are either skipped, maybe counting a line, or
+#  return LexGetTokenInstName("TYPE", "") / LexGetTokenInstName("TYPE", yytext)
+# Matching is flex's: the longest match, the earliest rule on ties.
+#
+# Anything else makes the header an #error, so only dfa_lexer.h users break
+#  on grammars which flex handles but this doesn't.
+
+import re
+import sys
+
+class LexDfaError(Exception):
+	pass
+
+ALL_BYTES = (1 << 256) - 1
+
+def ByteMask(*bytes_in):
+	mask = 0
+	for b in bytes_in:
+		mask |= 1 << b
+	return mask
+
+def RangeMask(lo, hi):
+	return ((1 << (hi + 1)) - 1) & ~((1 << lo) - 1)
+
+# ---- Patterns ----
+# Parsed to ('set', mask), ('cat', a, b), ('alt', a, b), ('star', a), ('eps',)
+
+ESCAPES = {"n": 10, "t": 9, "r": 13, "f": 12, "v": 11, "a": 7, "b": 8, "0": 0}
+
+class PatternParser:
+	def __init__(self, text, definitions, depth=0):
+		self.text = text
+		self.pos = 0
+		self.definitions = definitions
+		self.depth = depth
+
+	def Error(self, what):
+		raise LexDfaError("%s in pattern %s" % (what, self.text))
+
+	def Peek(self):
+		return self.text[self.pos] if self.pos < len(self.text) else None
+
+	def Take(self):
+		c = self.Peek()
+		if c is None:
+			self.Error("Unexpected end")
+		self.pos += 1
+		return c
+
+	def Parse(self):
+		node = self.Alternation()
+		if self.pos != len(self.text):
+			self.Error("Unexpected '%s'" % self.Peek())
+		return node
+
+	def Alternation(self):
+		node = self.Concatenation()
+		while self.Peek() == "|":
+			self.pos += 1
+			node = ("alt", node, self.Concatenation())
+		return node
+
+	def Concatenation(self):
+		node = ("eps",)
+		while self.Peek() not in (None, "|", ")"):
+			node = ("cat", node, self.Repetition())
+		return node
+
+	def Repetition(self):
+		node = self.Atom()
+		while True:
+			c = self.Peek()
+			if c == "*":
+				self.pos += 1
+				node = ("star", node)
+			elif c == "+":
+				self.pos += 1
+				node = ("cat", node, ("star", node))
+			elif c == "?":
+				self.pos += 1
+				node = ("alt", node, ("eps",))
+			elif c == "{" and re.match(r"\{\d", self.text[self.pos:]):
+				node = self.Counted(node)
+			else:
+				return node
+
+	def Counted(self, node):
+		match = re.match(r"\{(\d+)(,(\d*))?\}", self.text[self.pos:])
+		if match is None:
+			self.Error("Bad repetition")
+		self.pos += len(match.group(0))
+		lo = int(match.group(1))
+		ret = ("eps",)
+		for _ in range(lo):
+			ret = ("cat", ret, node)
+		if match.group(2) is None:
+			return ret
+		if match.group(3) == "":
+			return ("cat", ret, ("star", node))
+		hi = int(match.group(3))
+		if hi < lo:
+			self.Error("Bad repetition")
+		for _ in range(hi - lo):
+			ret = ("cat", ret, ("alt", node, ("eps",)))
+		return ret
+
+	def Escape(self):
+		c = self.Take()
+		if c == "x":
+			match = re.match(r"[0-9a-fA-F]{1,2}", self.text[self.pos:])
+			if match is None:
+				self.Error("Bad \\x escape")
+			self.pos += len(match.group(0))
+			return int(match.group(0), 16)
+		return ESCAPES.get(c, ord(c))
+
+	def Atom(self):
+		c = self.Take()
+		if c == "(":
+			node = self.Alternation()
+			if self.Take() != ")":
+				self.Error("Expected )")
+			return node
+		if c == "\"":
+			node = ("eps",)
+			while self.Peek() != "\"":
+				c = self.Take()
+				b = self.Escape() if c == "\\" else ord(c)
+				node = ("cat", node, ("set", ByteMask(b)))
+			self.pos += 1
+			return node
+		if c == "[":
+			return ("set", self.Class())
+		if c == ".":
+			return ("set", ALL_BYTES & ~ByteMask(10))
+		if c == "\\":
+			return ("set", ByteMask(self.Escape()))
+		if c == "{":
+			end = self.text.find("}", self.pos)
+			if end < 0:
+				self.Error("Expected }")
+			name = self.text[self.pos:end]
+			self.pos = end + 1
+			if name not in self.definitions:
+				self.Error("Undefined {%s}" % name)
+			if self.depth > 32:
+				self.Error("Recursive {%s}" % name)
+			return PatternParser(self.definitions[name], self.definitions, self.depth + 1).Parse()
+		if c in "^$/<":
+			self.Error("Unsupported '%s'" % c)
+		if c in ")*+?|":
+			self.Error("Unexpected '%s'" % c)
+		return ("set", ByteMask(ord(c)))
+
+	def Class(self):
+		mask = 0
+		negate = self.Peek() == "^"
+		if negate:
+			self.pos += 1
+		first = True
+		while first or self.Peek() != "]":
+			first = False
+			c = self.Take()
+			if c == "[" and self.Peek() == ":":
+				self.Error("Unsupported [: :] class")
+			lo = self.Escape() if c == "\\" else ord(c)
+			if self.Peek() == "-" and self.text[self.pos + 1:self.pos + 2] not in ("]", ""):
+				self.pos += 1
+				c = self.Take()
+				hi = self.Escape() if c == "\\" else ord(c)
+				if hi < lo:
+					self.Error("Bad range")
+				mask |= RangeMask(lo, hi)
+			else:
+				mask |= ByteMask(lo)
+		self.pos += 1
+		return (ALL_BYTES & ~mask) if negate else mask
+
+# ---- Lex section ----
+
+class Rule:
+	def __init__(self, pattern, token_type, with_text, counts_line):
+		self.pattern = pattern
+		# None when the match is skipped
+		self.token_type = token_type
+		self.with_text = with_text
+		self.counts_line = counts_line
+
+TOKEN_ACTION = re.compile(r"return\s+LexGetTokenInstName\(\s*\"([A-Za-z_][A-Za-z_0-9]*)\"\s*,\s*(yytext|\"\")\s*\)\s*;")
+LINE_ACTION = re.compile(r"yylineno\s*=\s*yylineno\s*\+\s*1\s*;|yylineno\s*\+\+\s*;|\+\+\s*yylineno\s*;")
+
+def ParseAction(action):
+	action = action.strip()
+	if action.startswith("{") and action.endswith("}"):
+		action = action[1:-1].strip()
+	match = TOKEN_ACTION.fullmatch(action)
+	if match:
+		return match.group(1), match.group(2) == "yytext", False
+	if action in ("", ";"):
+		return None, False, False
+	if LINE_ACTION.fullmatch(action):
+		return None, False, True
+	raise LexDfaError("Unsupported action %s" % action)
+
+def SplitRuleLine(line):
+	# The pattern ends at the first space outside quotes and classes
+	pos = 0
+	in_quotes = False
+	in_class = False
+	while pos < len(line):
+		c = line[pos]
+		if c == "\\":
+			pos += 2
+			continue
+		if in_quotes:
+			in_quotes = c != "\""
+		elif in_class:
+			in_class = c != "]"
+		elif c == "\"":
+			in_quotes = True
+		elif c == "[":
+			in_class = True
+			# A ] first in the class is literal
+			if line[pos + 1:pos + 2] == "^":
+				pos += 1
+			if line[pos + 1:pos + 2] == "]":
+				pos += 1
+		elif c in " \t":
+			break
+		pos += 1
+	return line[:pos], line[pos:]
+
+def ParseLexSection(lex_lines):
+	definitions = {}
+	options = set()
+	rules = []
+	section = 0
+	in_code = False
+	for line in lex_lines:
+		if line.strip() == "%%":
+			section += 1
+			continue
+		if section == 0:
+			if in_code:
+				in_code = line.strip() != "%}"
+			elif line.strip() == "%{":
+				in_code = True
+			elif line.startswith("%option"):
+				options.update(line.split()[1:])
+			elif line.startswith("%"):
+				raise LexDfaError("Unsupported %s" % line)
+			elif not line[0].isspace():
+				parts = line.split(None, 1)
+				if len(parts) != 2:
+					raise LexDfaError("Bad definition %s" % line)
+				definitions[parts[0]] = parts[1].strip()
+		elif section == 1:
+			if line[0].isspace():
+				raise LexDfaError("Unsupported indented rule line %s" % line)
+			pattern, action = SplitRuleLine(line)
+			if action.strip() == "|":
+				raise LexDfaError("Unsupported | action %s" % line)
+			token_type, with_text, counts_line = ParseAction(action)
+			node = PatternParser(pattern, definitions).Parse()
+			rules.append(Rule(node, token_type, with_text, counts_line))
+	if not rules:
+		raise LexDfaError("No rules")
+	return rules, options
+
+# ---- NFA ----
+
+class Nfa:
+	def __init__(self):
+		# Per state: [(mask, to)], [eps to], accepted rule or None
+		self.edges = []
+		self.eps = []
+		self.accept = []
+
+	def State(self):
+		self.edges.append([])
+		self.eps.append([])
+		self.accept.append(None)
+		return len(self.edges) - 1
+
+	# Returns (start, end) of a fragment for node
+	def Build(self, node):
+		kind = node[0]
+		if kind == "eps":
+			s = self.State()
+			return s, s
+		if kind == "set":
+			s, e = self.State(), self.State()
+			self.edges[s].append((node[1], e))
+			return s, e
+		if kind == "cat":
+			s1, e1 = self.Build(node[1])
+			s2, e2 = self.Build(node[2])
+			self.eps[e1].append(s2)
+			return s1, e2
+		if kind == "alt":
+			s, e = self.State(), self.State()
+			for sub in node[1:]:
+				ss, se = self.Build(sub)
+				self.eps[s].append(ss)
+				self.eps[se].append(e)
+			return s, e
+		if kind == "star":
+			s = self.State()
+			ss, se = self.Build(node[1])
+			self.eps[s].append(ss)
+			self.eps[se].append(s)
+			return s, s
+		raise LexDfaError("Bad node %s" % kind)
+
+	def Closure(self, states):
+		stack = list(states)
+		seen = set(states)
+		while stack:
+			for to in self.eps[stack.pop()]:
+				if to not in seen:
+					seen.add(to)
+					stack.append(to)
+		return frozenset(seen)
+
+# ---- DFA ----
+
+class Dfa:
+	def __init__(self, rules):
+		nfa = Nfa()
+		start = nfa.State()
+		for ri, rule in enumerate(rules):
+			s, e = nfa.Build(rule.pattern)
+			nfa.eps[start].append(s)
+			nfa.accept[e] = ri
+
+		# Bytes no pattern tells apart share a class
+		masks = sorted(set(mask for edges in nfa.edges for mask, _ in edges))
+		signatures = {}
+		self.byte_class = []
+		for b in range(256):
+			sig = tuple((mask >> b) & 1 for mask in masks)
+			self.byte_class.append(signatures.setdefault(sig, len(signatures)))
+		self.num_classes = len(signatures)
+		class_byte = [self.byte_class.index(c) for c in range(self.num_classes)]
+
+		# State 0 is dead, 1 the start
+		dead = frozenset()
+		first = nfa.Closure([start])
+		ids = {dead: 0, first: 1}
+		self.next = [[0] * self.num_classes, None]
+		self.accept = [-1, -1]
+		todo = [first]
+		while todo:
+			cur = todo.pop()
+			row = []
+			for c in range(self.num_classes):
+				b = class_byte[c]
+				to = set(t for s in cur for mask, t in nfa.edges[s] if (mask >> b) & 1)
+				to = nfa.Closure(to) if to else dead
+				if to not in ids:
+					ids[to] = len(self.next)
+					self.next.append(None)
+					self.accept.append(-1)
+					todo.append(to)
+				row.append(ids[to])
+			self.next[ids[cur]] = row
+			accepted = [nfa.accept[s] for s in cur if nfa.accept[s] is not None]
+			self.accept[ids[cur]] = min(accepted) if accepted else -1
+		self.Minimize()
+		self.num_states = len(self.next)
+
+	# Merges states which accept the same rules after the same bytes, so
+	#  a run like an identifier's stays in one state
+	def Minimize(self):
+		group = list(self.accept)
+		num_groups = 0
+		while True:
+			signatures = {}
+			new_group = []
+			for s, row in enumerate(self.next):
+				sig = (group[s], tuple(group[to] for to in row))
+				new_group.append(signatures.setdefault(sig, len(signatures)))
+			group = new_group
+			if len(signatures) == num_groups:
+				break
+			num_groups = len(signatures)
+
+		# Keeping 0 dead and 1 the start
+		ids = {group[0]: 0, group[1]: 1}
+		for s in range(len(self.next)):
+			if group[s] not in ids:
+				ids[group[s]] = len(ids)
+		next_states = [None] * len(ids)
+		accept = [-1] * len(ids)
+		for s, row in enumerate(self.next):
+			next_states[ids[group[s]]] = [ids[group[to]] for to in row]
+			accept[ids[group[s]]] = self.accept[s]
+		self.next = next_states
+		self.accept = accept
+
+	def Next(self, state, b):
+		return self.next[state][self.byte_class[b]]
+
+	def IsFinal(self, state):
+		return all(to == 0 for to in self.next[state])
+
+	# Bytes state stays in as byte ranges
+	def LoopRanges(self, state):
+		return ToRanges([b for b in range(256) if self.Next(state, b) == state])
+
+	# Rules with matches holding byte b
+	def RulesMatching(self, b):
+		ret = set()
+		for s in range(1, self.num_states):
+			to = self.Next(s, b)
+			if to:
+				ret.update(self.RulesFrom(to))
+		return ret
+
+	def RulesFrom(self, state):
+		seen = set([state])
+		stack = [state]
+		ret = set()
+		while stack:
+			s = stack.pop()
+			if self.accept[s] >= 0:
+				ret.add(self.accept[s])
+			for to in self.next[s]:
+				if to and to not in seen:
+					seen.add(to)
+					stack.append(to)
+		return ret
+
+def ToRanges(bytes_in):
+	ranges = []
+	for b in bytes_in:
+		if ranges and ranges[-1][1] == b - 1:
+			ranges[-1][1] = b
+		else:
+			ranges.append([b, b])
+	return ranges
+
+# ---- Output ----
+
+MAX_RANGES = 4
+
+def CheckLines(rules, dfa, options):
+	# dfa_lexer.h counts every newline it consumes.
+	# That's flex's count with %option yylineno, and without when a newline
+	#  is only ever matched by itself, by a rule counting the line.
+	if "yylineno" in options:
+		return
+	to = dfa.Next(1, 10)
+	if to == 0 or not dfa.IsFinal(to) or not rules[dfa.accept[to]].counts_line:
+		raise LexDfaError("A newline has to be matched alone, by a rule counting the line")
+	for s in range(2, dfa.num_states):
+		if dfa.Next(s, 10):
+			raise LexDfaError("Only a rule matching a newline alone can match newlines")
+	for b in range(256):
+		to = dfa.Next(1, b)
+		if b != 10 and to and dfa.accept[to] >= 0 and rules[dfa.accept[to]].counts_line:
+			raise LexDfaError("Lines are only counted on newlines")
+
+def RangesInit(ranges):
+	if len(ranges) > MAX_RANGES:
+		ranges = []
+	lo = ", ".join(str(r[0]) for r in ranges) or "0"
+	hi = ", ".join(str(r[1]) for r in ranges) or "0"
+	return "{%d, {%s}, {%s}}" % (len(ranges), lo, hi)
+
+def FormatRows(values, per_line=16):
+	rows = []
+	for i in range(0, len(values), per_line):
+		rows.append(", ".join(str(v) for v in values[i:i + per_line]))
+	return ",\n\t".join(rows)
+
+# token_ids maps token type names to their TokenType
+def LexDfaHeader(lex_lines, token_ids):
+	rules, options = ParseLexSection(lex_lines)
+	for rule in rules:
+		if rule.token_type and rule.token_type not in token_ids:
+			raise LexDfaError("No id for token type %s" % rule.token_type)
+	dfa = Dfa(rules)
+	CheckLines(rules, dfa, options)
+	if dfa.num_states > 0xffff:
+		raise LexDfaError("Too many states")
+
+	# Bytes matched alone by a skipped rule are skipped as runs before a token
+	skip = []
+	for b in range(256):
+		to = dfa.Next(1, b)
+		if to and dfa.IsFinal(to) and rules[dfa.accept[to]].token_type is None:
+			skip.append(b)
+
+	out = []
+	out.append("""
+// Generated from the /LEX/ section by convert_grammar.py, included by dfa_lexer.h
+
+const unsigned kDfaNumClasses = %d;
+const unsigned kDfaNumStates = %d;
+
+// Byte to equivalence class
+const unsigned char sDfaByteClass[256] = {
+	%s
+};
+""" % (dfa.num_classes, dfa.num_states, FormatRows(dfa.byte_class)))
+
+	out.append("""
+// Next state by state and byte class, state 0 is dead and 1 the start
+const unsigned short sDfaNext[kDfaNumStates][kDfaNumClasses] = {
+	%s
+};
+""" % ",\n\t".join("{" + ", ".join(str(to) for to in row) + "}" for row in dfa.next))
+
+	out.append("""
+// Rule matched by the longest match ending in a state, or -1
+const short sDfaAccept[kDfaNumStates] = {
+	%s
+};
+""" % FormatRows(dfa.accept))
+
+	with_newlines = dfa.RulesMatching(10)
+	def RuleInit(rule, ri):
+		token_type = "%d /* %s */" % (token_ids[rule.token_type], rule.token_type) if rule.token_type else "0"
+		has_newlines = ri in with_newlines
+		return "{%s, %s, %s}" % (token_type, "true" if rule.with_text else "false",
+			"true" if has_newlines else "false")
+	out.append("""
+// Token type (0 when skipped), whether with text, whether it can hold newlines
+const DfaRule sDfaRules[] = {
+	%s
+};
+""" % ",\n\t".join(RuleInit(rule, ri) for ri, rule in enumerate(rules)))
+
+	out.append("""
+// Byte ranges each state loops on
+const DfaRanges sDfaLoops[kDfaNumStates] = {
+	%s
+};
+
+// Bytes skipped before a token
+const DfaRanges sDfaSkip = %s;
+""" % (",\n\t".join(RangesInit(dfa.LoopRanges(s) if s else []) for s in range(dfa.num_states)),
+		RangesInit(ToRanges(skip))))
+	return "".join(out)
+
+def WriteLexDfa(lex_lines, out_path, token_ids):
+	try:
+		text = LexDfaHeader(lex_lines, token_ids)
+	except LexDfaError as e:
+		print("DFA lexer: " + str(e))
+		text = "\n#error \"convert_grammar.py: no DFA lexer for this grammar: %s\"\n" % str(e).replace("\\", "\\\\").replace("\"", "\\\"")
+	with open(out_path, "w") as f:
+		f.write(text)
+
+if __name__ == "__main__":
+	if len(sys.argv) < 3:
+		print("Usage: lex_dfa lex_lines_file out")
+		sys.exit(1)
+	with open(sys.argv[1]) as f:
+		lex_lines = [s for s in f.read().split("\n") if s]
+	# Numbered in order of first use, as convert_grammar.py does
+	token_ids = {}
+	for rule in ParseLexSection(lex_lines)[0]:
+		if rule.token_type and rule.token_type not in token_ids:
+			token_ids[rule.token_type] = len(token_ids) + 1
+	WriteLexDfa(lex_lines, sys.argv[2], token_ids)
@@ -116,6 +116,11 @@ extern "C" Token LexGetTokenInstName(const char*type_str, const char*content) {
 	return GetTokenInstName(type_str, content);
 }
 
+extern "C" Token LexGetTokenInstId(TokenType type, const char*content) {
+	assert((type > 0) && (type < sLexicalTokenTypes.size()));
+	return GetTokenInstName(sLexicalTokenTypes[type].c_str(), content);
+}
+
 const char*GetTokenTypeName(TokenType t) {
 	assert(t < sTokenTypes.size());
 	return sTokenTypes[t].c_str();
@@ -604,7 +609,9 @@ int main(int argc, const char **argv) {
 			input_path);
 	}
 
-	yyset_in(input);
+	yyscan_t scanner;
+	yylex_init(&scanner);
+	yyset_in(input, scanner);
 
 	fprintf(stderr, "--- Parsing starts ---\n");
 
@@ -613,7 +620,7 @@ int main(int argc, const char **argv) {
 	::atexit(on_exit);
 
 	while(true) {
-		Token tok = yylex();
+		Token tok = yylex(scanner);
 		if(tok == 0) {
 			break;
 		}
@@ -636,7 +643,7 @@ int main(int argc, const char **argv) {
 
 		if(candidates.size() == 0) {
 			// TODO: Report line number in preprocessed file
-			fprintf(stderr, "ERROR at line %i, token %s\n", yylineno, tok_type_name.c_str());
+			fprintf(stderr, "ERROR at line %i, token %s\n", yyget_lineno(scanner), tok_type_name.c_str());
 			exit(1);
 		}
 	}
@@ -24,6 +24,7 @@
 
 
 #include "parser.h"
+#include "flex_scanner.h"
 
 using namespace parser;
 
@@ -52,10 +53,10 @@ bool ViolatesOperatorRules(Candidate const&cand) {
 	assert(node.parsed_tokens.size() == node.rule->pattern.size());
 
 	for(Node::ParsedToken const&parsed : node.parsed_tokens) {
-		if(parsed.sub == NodeId_Null) {
+		if(!parsed.is_sub()) {
 			continue;
 		}
-		Node const&sub_node = cand.get_node(parsed.sub);
+		Node const&sub_node = cand.get_node(parsed.sub());
 		if(!NodeHasOperatorPriority(sub_node)) {
 			continue;
 		}
@@ -68,7 +69,7 @@ bool ViolatesOperatorRules(Candidate const&cand) {
 		// Last encloses (first has highest priority, ie left to right, top to bottom)
 		if((node.rule->priority == sub_node.rule->priority) && 
 			(cand.get_first_lexical_token_index(cand.top_completed) <
-				cand.get_first_lexical_token_index(parsed.sub))) {
+				cand.get_first_lexical_token_index(parsed.sub()))) {
 			return true;
 		}
 	}
@@ -118,7 +119,7 @@ struct CPPContext {
 		const RuleName this_rule = node.rule->name;
 
 		if(this_rule == templated_type) {
-			const NodeId first_sub = node.parsed_tokens[0].sub;
+			const NodeId first_sub = node.parsed_tokens[0].sub();
 			// TODO
 			CPPType sub_type;
 			return ParseType(cand, first_sub, sub_type);
@@ -127,7 +128,7 @@ struct CPPContext {
 			// TODO
 			return true;
 		} else if(this_rule == id_type) {
-			const Token id_tok = node.parsed_tokens[0].lexed;
+			const Token id_tok = node.parsed_tokens[0].lexed();
 			assert(TokenIsLexical(id_tok));
 			const string id = GetTokenInstContent(id_tok);
 			if(!decls.contains(id)) {
@@ -167,7 +168,7 @@ struct CPPContext {
 			if((this_rule == func_proto) || (this_rule == func_proto_templated)) {
 				const bool is_templated = (this_rule == func_proto_templated);
 				const unsigned index_id = is_templated ? 2 : 1;
-				const string id = GetTokenInstContent(node.parsed_tokens[index_id].lexed);
+				const string id = GetTokenInstContent(node.parsed_tokens[index_id].lexed());
 				if(!decls.contains(id)) {
 					fprintf(stderr, "---- new decl %s\n", id.c_str());
 					Decl new_decl;
@@ -182,7 +183,7 @@ struct CPPContext {
 			const RuleName cpp_cast_expr = GetRuleNameInefficiently("cpp_cast_expr");
 			if(this_rule == cpp_cast_expr) {
 				fprintf(stderr, "----- cpp cast\n");
-				const NodeId type_nid = node.parsed_tokens[0].sub;
+				const NodeId type_nid = node.parsed_tokens[0].sub();
 				CPPType to_type;
 				if(!ParseType(cand, type_nid, to_type)) {
 					return true;
@@ -190,14 +191,14 @@ struct CPPContext {
 			}
 			const RuleName id_expr = GetRuleNameInefficiently("id_expr");
 			if(this_rule == id_expr) {
-				const Token id_lexed = node.parsed_tokens[0].lexed;
+				const Token id_lexed = node.parsed_tokens[0].lexed();
 				assert(TokenIsLexical(id_lexed));
 				const string id = GetTokenInstContent(id_lexed);
 				fprintf(stderr, "--- id_expr %s\n", id.c_str());
 			}
 			const RuleName id_type = GetRuleNameInefficiently("id_type");
 			if(this_rule == id_type) {
-				const Token id_lexed = node.parsed_tokens[0].lexed;
+				const Token id_lexed = node.parsed_tokens[0].lexed();
 				assert(TokenIsLexical(id_lexed));
 				const string id = GetTokenInstContent(id_lexed);
 				fprintf(stderr, "--- id_type %s\n", id.c_str());
@@ -207,12 +208,12 @@ struct CPPContext {
 			if(this_rule == lt_expr) {
 				fprintf(stderr, "----- lt_expr %s\n", 
 						cand.ToString(nid).c_str());
-				const NodeId first_sub_nid = node.parsed_tokens[0].sub;
+				const NodeId first_sub_nid = node.parsed_tokens[0].sub();
 				Node const&first_sub_node = cand.get_node(first_sub_nid);
 		
 				const RuleName id_expr = GetRuleNameInefficiently("id_expr");
 				if(first_sub_node.rule->name == id_expr) {
-					const Token id_lexed = first_sub_node.parsed_tokens[0].lexed;
+					const Token id_lexed = first_sub_node.parsed_tokens[0].lexed();
 					assert(TokenIsLexical(id_lexed));
 					const string id = GetTokenInstContent(id_lexed);
 					fprintf(stderr, "  ----- id_expr id %s\n", id.c_str());
@@ -242,12 +243,14 @@ struct CPPContext {
 
 
 void on_exit() {
-	if(sStartTime == 0) {
+	ParseSession &session = CurrentSession();
+	if(session.start_time == 0) {
 		return;
 	}
 	const double end_time = doubletime();
-	fprintf(stderr, "Parsing time %fms\n", (end_time-sStartTime) * 1000.0);
-	sStartTime = 0;
+	fprintf(stderr, "Parsing time %fms\n", (end_time-session.start_time) * 1000.0);
+	fprintf(stderr, "Child arrays %i bytes\n", (int)session.child_arena->bytes_used());
+	session.start_time = 0;
 }
 
 
@@ -255,13 +258,6 @@ void on_exit() {
 // ---- / grammar specific ----
 
 
-extern "C" {
-extern int yylex (void);
-void yyset_in  ( FILE * _in_str  );
-extern int yylineno;
-};
-
-
 int main(int argc, const char **argv) {
 
 	SetupParser();
@@ -276,12 +272,29 @@ int main(int argc, const char **argv) {
 	assert(top_rules.size() == 1);
 
 	// Parse	
-	if(argc != 2) {
-		fprintf(stderr, "Usage: parse file\n");
+	const char*input_path = 0;
+	unsigned n_threads = 1;
+	for(int ai=1;ai<argc;++ai) {
+		if((strcmp(argv[ai], "-j") == 0) && ((ai+1) < argc)) {
+			n_threads = atoi(argv[++ai]);
+		} else if(!input_path) {
+			input_path = argv[ai];
+		} else {
+			input_path = 0;
+			break;
+		}
+	}
+
+	if(!input_path) {
+		fprintf(stderr, "Usage: parse [-j threads] file\n");
 		return 1;
 	}
 
-	const char*input_path = argv[1];
+	unique_ptr<WorkStealingPool> consume_pool;
+	if(n_threads > 1) {
+		consume_pool.reset(new WorkStealingPool(n_threads));
+	}
+	SetConsumePool(consume_pool.get());
 
 	FILE* input = ::fopen(input_path, "rb");
 
@@ -290,7 +303,7 @@ int main(int argc, const char **argv) {
 			input_path);
 	}
 
-	yyset_in(input);
+	FlexScanner scanner(input);
 
 	fprintf(stderr, "--- Parsing starts ---\n");
 
@@ -309,19 +322,19 @@ int main(int argc, const char **argv) {
 
 	CPPContext ctx;
 
-	sStartTime = doubletime();
+	CurrentSession().start_time = doubletime();
 
 	for(unsigned token_index=0;;++token_index) {
-		Token tok = yylex();
+		Token tok = scanner.Next();
 		if(tok == 0) {
 			break;
 		}
 
-		string tok_type_name = GetTokenInstTypeName(tok);
+		char const* tok_type_name = GetTokenInstTypeName(tok);
 
 #if !PROFILING
 		fprintf(stderr, "\n\n---- Next %s (line %i), candidates before %i\n",
-			TokenToString(tok).c_str(), yylineno, (int)candidates.size());
+			TokenToString(tok).c_str(), scanner.lineno(), (int)candidates.size());
 #endif
 
 #if !PROFILING
@@ -330,11 +343,14 @@ int main(int argc, const char **argv) {
 		CandidateVector dbg_candidates = candidates;
 #endif
 
-		ConsumeToken(tok, token_index, yylineno, candidates);
+		if(!ConsumeToken(tok, token_index, scanner.lineno(), candidates)) {
+			// An internal error, already reported
+			exit(1);
+		}
 
 		if(candidates.size() == 0) {
 			// TODO: Report line number in preprocessed file
-			fprintf(stderr, "ERROR at line %i, token %s\n", yylineno, tok_type_name.c_str());
+			fprintf(stderr, "ERROR at line %i, token %s\n", scanner.lineno(), tok_type_name);
 
 #if DEBUG
 			fprintf(stderr, "\nFinal candidates (%i):\n", (int)dbg_candidates.size());
@@ -343,14 +359,19 @@ int main(int argc, const char **argv) {
 			exit(1);
 		}
 
-		absl::InlinedVector unfiltered = candidates;
-		candidates.clear();
-		for(Candidate const&cand : unfiltered) {
+		// Filtered in place, a copy of the frontier would allocate each token
+		unsigned n_kept = 0;
+		for(unsigned ci=0;ci<candidates.size();++ci) {
+			Candidate const&cand = candidates[ci];
 			if((cand.top_completed == NodeId_Null) || 
 				((!ViolatesOperatorRules(cand)) && (!ctx.ViolatesContextRules(cand, cand.top_completed)))) {
-				candidates.push_back(cand);
+				if(n_kept != ci) {
+					candidates[n_kept] = cand;
+				}
+				++n_kept;
 			}
 		}
+		candidates.resize(n_kept);
 	}
 
 	on_exit();
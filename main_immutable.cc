@@ -10,10 +10,18 @@
 #include <list>
 #include <map>
 #include <set>
+#include <thread>
 
 #include <sys/time.h>
 
 #include "parser.h"
+#include "dfa_lexer.h"
+#include "flex_scanner.h"
+#include "chunked_lex.h"
+#include "chunked_parse.h"
+#include "item_cache.h"
+#include "prefix_cache.h"
+#include "spsc_ring.h"
 
 using namespace parser;
 
@@ -48,10 +56,10 @@ bool ViolatesOperatorRules(Candidate const&cand) {
 	assert(node.parsed_tokens.size() == node.rule->pattern.size());
 
 	for(Node::ParsedToken const&parsed : node.parsed_tokens) {
-		if(parsed.sub == NodeId_Null) {
+		if(!parsed.is_sub()) {
 			continue;
 		}
-		Node const&sub_node = cand.get_node(parsed.sub);
+		Node const&sub_node = cand.get_node(parsed.sub());
 		if(!NodeHasOperatorPriority(sub_node)) {
 			continue;
 		}
@@ -64,7 +72,7 @@ bool ViolatesOperatorRules(Candidate const&cand) {
 		// Last encloses (first has highest priority, ie left to right, top to bottom)
 		if((node.rule->priority == sub_node.rule->priority) && 
 			(cand.get_first_lexical_token_index(cand.top_completed) <
-				cand.get_first_lexical_token_index(parsed.sub))) {
+				cand.get_first_lexical_token_index(parsed.sub()))) {
 			return true;
 		}
 	}
@@ -73,60 +81,100 @@ bool ViolatesOperatorRules(Candidate const&cand) {
 
 
 void on_exit() {
-	if(sStartTime == 0) {
+	ParseSession &session = CurrentSession();
+	if(session.start_time == 0) {
 		return;
 	}
 	const double end_time = doubletime();
-	fprintf(stderr, "Parsing time %fms\n", (end_time-sStartTime) * 1000.0);
-	sStartTime = 0;
+	fprintf(stderr, "Parsing time %fms\n", (end_time-session.start_time) * 1000.0);
+	fprintf(stderr, "Child arrays %i bytes\n", (int)session.child_arena->bytes_used());
+	session.start_time = 0;
 }
 
 // ---- / grammar specific ----
 
 
-extern "C" {
-extern int yylex (void);
-void yyset_in  ( FILE * _in_str  );
-extern int yylineno;
-};
+// Lex with DfaLexer over the mapped file instead of the flex scanner
+bool sUseDfaLexer = false;
+// More than 1 lexes chunks of the file in parallel, with the DFA lexer
+unsigned sLexThreads = 1;
+// Smallest chunk worth a task when lexing in parallel
+static const size_t sLexChunkMin = 1 << 16;
 
+// Maps the file to lex in place
+bool MapInputFile(const char*input_path, MappedFile &input) {
+	if(!input.Open(input_path)) {
+		fprintf(stderr, "Couldn't open input file: %s\n",
+			input_path);
+		return false;
+	}
+	if(input.size() > UINT32_MAX) {
+		fprintf(stderr, "Input file too large: %s\n", input_path);
+		return false;
+	}
 
-int main(int argc, const char **argv) {
-
-	SetupParser();
+	fprintf(stderr, "--- Parsing %s ---\n", input_path);
+	return true;
+}
 
+// Tokens are left as spans of input, which has to outlive the parse
+bool LexFileDfa(const char*input_path, MappedFile &input, vector<LexedRecord> &tokens) {
+	if(!MapInputFile(input_path, input)) {
+		return false;
+	}
 
-	const Token top_token = GetTokenTypeId("top");
-	if(!top_token) {
-		fprintf(stderr, "No top rules found!\n");
-		return 1;
+	CurrentSession().lexed_text = input.begin();
+	if(sLexThreads > 1) {
+		WorkStealingPool pool(sLexThreads);
+		// A few chunks per thread, so one slow chunk doesn't hold up the rest
+		const size_t chunk_len = std::max(sLexChunkMin, input.size() / (4 * sLexThreads));
+		LexChunked(input.begin(), input.end(), chunk_len, pool, tokens);
+		return true;
 	}
-	vector<Rule> const&top_rules = GetRulesForTokenName(GetTokenInstName("top", ""));
-	assert(top_rules.size() == 1);
 
-	// Parse	
-	if(argc != 2) {
-		fprintf(stderr, "Usage: parse file\n");
-		return 1;
+	tokens.clear();
+	DfaLexer lexer(input.begin(), input.end());
+	for(int rule = lexer.NextRule();rule >= 0;rule = lexer.NextRule()) {
+		LexedRecord rec;
+		rec.type = sDfaRules[rule].token_type;
+		assert(TokenTypeIsLexical(rec.type));
+		rec.offset = lexer.text() - input.begin();
+		if(sDfaRules[rule].with_text) {
+			rec.length = lexer.length();
+		}
+		rec.lineno = lexer.lineno();
+		tokens.push_back(rec);
 	}
+	return true;
+}
 
-	const char*input_path = argv[1];
+bool LexFile(const char*input_path, MappedFile &mapped, vector<LexedRecord> &tokens) {
+	if(sUseDfaLexer) {
+		return LexFileDfa(input_path, mapped, tokens);
+	}
 
 	FILE* input = ::fopen(input_path, "rb");
 
 	if(input == 0) {
 		fprintf(stderr, "Couldn't open input file: %s\n",
 			input_path);
+		return false;
 	}
 
-	yyset_in(input);
-
-	fprintf(stderr, "--- Parsing starts ---\n");
-
-
-	::atexit(on_exit);
+	fprintf(stderr, "--- Parsing %s ---\n", input_path);
 
+	tokens.clear();
+	{
+		FlexScanner scanner(input);
+		for(Token tok = scanner.Next();tok != 0;tok = scanner.Next()) {
+			tokens.push_back(LexedRecord::Interned(tok, scanner.lineno()));
+		}
+	}
+	fclose(input);
+	return true;
+}
 
+CandidateVector TopCandidates(vector<Rule> const&top_rules) {
 	Node top_node(top_rules[0], NodeId_Null);
 
 	Candidate top_cand;
@@ -135,52 +183,57 @@ int main(int argc, const char **argv) {
 
 	CandidateVector candidates;
 	candidates.push_back(top_cand);
+	return candidates;
+}
 
-	sStartTime = doubletime();
-
-	for(unsigned token_index=0;;++token_index) {
-		Token tok = yylex();
-		if(tok == 0) {
-			break;
-		}
+// Steps the candidates over one token, false on a parse error
+bool ConsumeLexed(LexedRecord const&lexed, unsigned token_index, CandidateVector &candidates) {
+	const int lineno = lexed.lineno;
 
-		string tok_type_name = GetTokenInstTypeName(tok);
+	char const* tok_type_name = GetTokenTypeName(lexed.type);
 
 #if !PROFILING
-		fprintf(stderr, "\n\n---- Next %s (line %i), candidates before %i\n",
-			TokenToString(tok).c_str(), yylineno, (int)candidates.size());
+	fprintf(stderr, "\n\n---- Next %s (line %i), candidates before %i\n",
+		LexedToString(lexed).c_str(), lineno, (int)candidates.size());
 #endif
 
 #if !PROFILING
-//#if 1
-		PrintCandidates(candidates);
-		CandidateVector dbg_candidates = candidates;
+	PrintCandidates(candidates);
+	CandidateVector dbg_candidates = candidates;
 #endif
 
-		ConsumeToken(tok, token_index, yylineno, candidates);
+	if(!ConsumeToken(lexed, token_index, candidates)) {
+		// An internal error, already reported
+		return false;
+	}
 
-		if(candidates.size() == 0) {
-			// TODO: Report line number in preprocessed file
-			fprintf(stderr, "ERROR at line %i, token %s\n", yylineno, tok_type_name.c_str());
+	if(candidates.size() == 0) {
+		// TODO: Report line number in preprocessed file
+		fprintf(stderr, "ERROR at line %i, token %s\n", lineno, tok_type_name);
 
 #if DEBUG
-			fprintf(stderr, "\nFinal candidates (%i):\n", (int)dbg_candidates.size());
-			PrintCandidates(dbg_candidates, true);
+		fprintf(stderr, "\nFinal candidates (%i):\n", (int)dbg_candidates.size());
+		PrintCandidates(dbg_candidates, true);
 #endif
-			exit(1);
-		}
+		return false;
+	}
 
-		absl::InlinedVector unfiltered = candidates;
-		candidates.clear();
-		for(Candidate const&cand : unfiltered) {
-			if((cand.top_completed == NodeId_Null) || (!ViolatesOperatorRules(cand))) {
-				candidates.push_back(cand);
+	// Filtered in place, a copy of the frontier would allocate each token
+	unsigned n_kept = 0;
+	for(unsigned ci=0;ci<candidates.size();++ci) {
+		Candidate const&cand = candidates[ci];
+		if((cand.top_completed == NodeId_Null) || (!ViolatesOperatorRules(cand))) {
+			if(n_kept != ci) {
+				candidates[n_kept] = cand;
 			}
+			++n_kept;
 		}
 	}
+	candidates.resize(n_kept);
+	return true;
+}
 
-	on_exit();
-
+void PrintFinalCandidates(CandidateVector const&candidates) {
 	fprintf(stderr, "\nFinal candidates (%i):\n", (int)candidates.size());
 	PrintCandidates(candidates);
 
@@ -192,8 +245,279 @@ int main(int argc, const char **argv) {
 	}
 	fprintf(stderr, "\nCompleted candidates (%i):\n", (int)completed_candidates.size());
 	PrintCandidates(completed_candidates, true);
+}
 
-	fclose(input);
+// Parses the whole file as one token stream.
+// With a prefix cache, parsing starts from the longest saved prefix, and the
+//  frontier is saved at every block boundary for later files.
+bool ParseFileSerial(const char*input_path,
+					 vector<Rule> const&top_rules,
+					 PrefixCache *prefixes) {
+	MappedFile mapped;
+	vector<LexedRecord> tokens;
+	if(!LexFile(input_path, mapped, tokens)) {
+		return false;
+	}
+
+	CurrentSession().start_time = doubletime();
 
-	return 0;
-}
\ No newline at end of file
+	CandidateVector candidates = TopCandidates(top_rules);
+
+	unsigned first_token = 0;
+	PrefixCache::Cursor cursor;
+	if(prefixes) {
+		first_token = prefixes->Restore(tokens, candidates, cursor);
+		for(unsigned ti=0;ti<first_token;++ti) {
+			RecordLexedToken(tokens[ti], ti);
+		}
+	}
+
+	for(unsigned token_index=first_token;token_index<tokens.size();++token_index) {
+		if(!ConsumeLexed(tokens[token_index], token_index, candidates)) {
+			on_exit();
+			return false;
+		}
+
+		if(prefixes && (((token_index+1) % prefixes->block_len()) == 0)) {
+			prefixes->Save(cursor, tokens, token_index+1, candidates);
+		}
+	}
+
+	on_exit();
+
+	PrintFinalCandidates(candidates);
+	return true;
+}
+
+// Tokens handed from the lexer thread to the parser at a time
+static const size_t sPipelineBatch = 256;
+// Batches the lexer can get ahead of the parser by
+static const size_t sPipelineDepth = 64;
+
+// Lexes on a second thread while the parser consumes the tokens so far,
+//  instead of lexing the whole file first.
+// The DFA lexer is used as it only reads the mapped file. The flex scanner
+//  interns token text, which the parser reads at the same time.
+bool ParseFilePipelined(const char*input_path,
+						vector<Rule> const&top_rules) {
+	MappedFile input;
+	if(!MapInputFile(input_path, input)) {
+		return false;
+	}
+	CurrentSession().lexed_text = input.begin();
+
+	// Lexing is part of the time, as it overlaps the parse
+	CurrentSession().start_time = doubletime();
+
+	SpscRing<LexedRecord> ring(sPipelineBatch * sPipelineDepth);
+	double lex_time = 0;
+	std::thread lexer_thread([&]() {
+		const double start_time = doubletime();
+		vector<LexedRecord> batch;
+		batch.reserve(sPipelineBatch);
+		DfaLexer lexer(input.begin(), input.end());
+		for(int rule = lexer.NextRule();rule >= 0;rule = lexer.NextRule()) {
+			chunked_lex::Append(lexer, rule, input.begin(), batch);
+			if(batch.size() == sPipelineBatch) {
+				if(!ring.Push(batch.data(), batch.size())) {
+					// The parser stopped at an error
+					break;
+				}
+				batch.clear();
+			}
+		}
+		ring.Push(batch.data(), batch.size());
+		ring.Close();
+		lex_time = doubletime() - start_time;
+	});
+
+	CandidateVector candidates = TopCandidates(top_rules);
+
+	vector<LexedRecord> batch(sPipelineBatch);
+	unsigned token_index = 0;
+	bool parsed = true;
+	while(parsed) {
+		const size_t n = ring.Pop(batch.data(), batch.size());
+		if(n == 0) {
+			break;
+		}
+		for(size_t bi=0;(bi<n) && parsed;++bi) {
+			parsed = ConsumeLexed(batch[bi], token_index++, candidates);
+		}
+	}
+	if(!parsed) {
+		ring.Cancel();
+	}
+	lexer_thread.join();
+
+	// Each stage is busy when not waiting on the ring. Time both were busy
+	//  at once is what running them one after the other would add.
+	const double wall_time = doubletime() - CurrentSession().start_time;
+	const double lex_busy = lex_time - ring.push_idle_ns() * 1e-9;
+	const double parse_busy = wall_time - ring.pop_idle_ns() * 1e-9;
+	fprintf(stderr, "Pipeline lexer busy %fms, idle %fms (%i waits)\n",
+		lex_busy * 1000.0, ring.push_idle_ns() * 1e-6, (int)ring.push_waits());
+	fprintf(stderr, "Pipeline parser busy %fms, idle %fms (%i waits)\n",
+		parse_busy * 1000.0, ring.pop_idle_ns() * 1e-6, (int)ring.pop_waits());
+	fprintf(stderr, "Pipeline overlap %fms\n",
+		std::max(0.0, lex_busy + parse_busy - wall_time) * 1000.0);
+
+	on_exit();
+	if(!parsed) {
+		return false;
+	}
+
+	PrintFinalCandidates(candidates);
+	return true;
+}
+
+// Lexes the whole file up front and parses it as independent top-level items
+bool ParseFileChunked(const char*input_path,
+					  vector<Rule> const&top_rules,
+					  WorkStealingPool &pool,
+					  ItemCache *cache) {
+	MappedFile mapped;
+	vector<LexedRecord> tokens;
+	if(!LexFile(input_path, mapped, tokens)) {
+		return false;
+	}
+
+	CurrentSession().start_time = doubletime();
+
+	auto keep = [](Candidate const&cand) {
+		return !ViolatesOperatorRules(cand);
+	};
+
+	CandidateVector completed_candidates;
+	Candidate stitched;
+	if(ParseChunked(top_rules[0], tokens, pool, keep, cache, stitched)) {
+		completed_candidates.push_back(stitched);
+	} else {
+		completed_candidates = ParseRange(top_rules, tokens,
+			TokenRange{0, (unsigned)tokens.size()}, keep);
+	}
+
+	on_exit();
+
+	fprintf(stderr, "\nCompleted candidates (%i):\n", (int)completed_candidates.size());
+	PrintCandidates(completed_candidates, true);
+	return completed_candidates.size() == 1;
+}
+
+int main(int argc, const char **argv) {
+
+	SetupParser();
+
+
+	const Token top_token = GetTokenTypeId("top");
+	if(!top_token) {
+		fprintf(stderr, "No top rules found!\n");
+		return 1;
+	}
+	vector<Rule> const&top_rules = GetRulesForTokenName(GetTokenInstName("top", ""));
+	assert(top_rules.size() == 1);
+
+	// Parse	
+	vector<const char*> input_paths;
+	unsigned n_threads = 1;
+	bool chunked = false;
+	const char*item_cache_path = 0;
+	unsigned item_cache_size = 4096;
+	bool use_prefixes = false;
+	bool pipelined = false;
+	unsigned prefix_block_len = 256;
+	for(int ai=1;ai<argc;++ai) {
+		if((strcmp(argv[ai], "-j") == 0) && ((ai+1) < argc)) {
+			n_threads = atoi(argv[++ai]);
+		} else if(strcmp(argv[ai], "--chunks") == 0) {
+			chunked = true;
+		} else if((strcmp(argv[ai], "--item-cache") == 0) && ((ai+1) < argc)) {
+			item_cache_path = argv[++ai];
+		} else if((strcmp(argv[ai], "--item-cache-size") == 0) && ((ai+1) < argc)) {
+			item_cache_size = atoi(argv[++ai]);
+		} else if(strcmp(argv[ai], "--prefix-cache") == 0) {
+			use_prefixes = true;
+		} else if((strcmp(argv[ai], "--prefix-block") == 0) && ((ai+1) < argc)) {
+			prefix_block_len = std::max(1, atoi(argv[++ai]));
+		} else if(strcmp(argv[ai], "--dfa-lexer") == 0) {
+			sUseDfaLexer = true;
+		} else if(strcmp(argv[ai], "--pipeline") == 0) {
+			sUseDfaLexer = true;
+			pipelined = true;
+		} else if((strcmp(argv[ai], "--lex-threads") == 0) && ((ai+1) < argc)) {
+			sUseDfaLexer = true;
+			sLexThreads = std::max(1, atoi(argv[++ai]));
+		} else {
+			input_paths.push_back(argv[ai]);
+		}
+	}
+
+	if((input_paths.size() == 0) || (pipelined && (chunked || use_prefixes))) {
+		fprintf(stderr, "Usage: parse [-j threads] [--dfa-lexer] [--lex-threads n] [--prefix-cache] [--prefix-block n] files...\n"
+						"       parse [-j threads] --pipeline files...\n"
+						"       parse [-j threads] [--dfa-lexer] [--lex-threads n] --chunks [--item-cache path]"
+						" [--item-cache-size n] files...\n");
+		return 1;
+	}
+
+	// Chunks are already parsed in parallel, don't oversubscribe
+	unique_ptr<WorkStealingPool> consume_pool;
+	if(!chunked && (n_threads > 1)) {
+		consume_pool.reset(new WorkStealingPool(n_threads));
+	}
+
+	::atexit(on_exit);
+
+	if(chunked) {
+		ItemCache cache(item_cache_size);
+		if(item_cache_path && !cache.Load(item_cache_path)) {
+			fprintf(stderr, "Starting new item cache %s\n", item_cache_path);
+		}
+
+		WorkStealingPool chunk_pool(std::max(1u, n_threads));
+		int ret = 0;
+		for(const char*input_path : input_paths) {
+			// A session per file, which frees its tokens and child arrays
+			ParseSession session;
+			ParseSession::Scope scope(session);
+			if(!ParseFileChunked(input_path, top_rules, chunk_pool, &cache)) {
+				ret = 1;
+			}
+		}
+
+		cache.PrintStats();
+		if(item_cache_path && !cache.Save(item_cache_path)) {
+			fprintf(stderr, "Couldn't save item cache %s\n", item_cache_path);
+		}
+		return ret;
+	}
+
+	int ret = 0;
+	if(pipelined) {
+		for(const char*input_path : input_paths) {
+			ParseSession session;
+			ParseSession::Scope scope(session);
+			SetConsumePool(consume_pool.get());
+			if(!ParseFilePipelined(input_path, top_rules)) {
+				ret = 1;
+			}
+		}
+		return ret;
+	}
+
+	PrefixCache prefixes(prefix_block_len, 4096, 16384);
+
+	for(const char*input_path : input_paths) {
+		ParseSession session;
+		ParseSession::Scope scope(session);
+		SetConsumePool(consume_pool.get());
+		if(!ParseFileSerial(input_path, top_rules, use_prefixes ? &prefixes : 0)) {
+			ret = 1;
+		}
+	}
+
+	if(use_prefixes) {
+		prefixes.PrintStats();
+	}
+	return ret;
+}
@@ -15,6 +15,7 @@
 #include <sys/time.h>
 
 #include "parser.h"
+#include "flex_scanner.h"
 #include "boost/multiprecision/cpp_int.hpp"
 
 using namespace parser;
@@ -53,10 +54,10 @@ bool ViolatesOperatorRules(Candidate const&cand) {
 	assert(node.parsed_tokens.size() == node.rule->pattern.size());
 
 	for(Node::ParsedToken const&parsed : node.parsed_tokens) {
-		if(parsed.sub == NodeId_Null) {
+		if(!parsed.is_sub()) {
 			continue;
 		}
-		Node const&sub_node = cand.get_node(parsed.sub);
+		Node const&sub_node = cand.get_node(parsed.sub());
 		if(!NodeHasOperatorPriority(sub_node)) {
 			continue;
 		}
@@ -69,7 +70,7 @@ bool ViolatesOperatorRules(Candidate const&cand) {
 		// Last encloses (first has highest priority, ie left to right, top to bottom)
 		if((node.rule->priority == sub_node.rule->priority) && 
 			(cand.get_first_lexical_token_index(cand.top_completed) <
-				cand.get_first_lexical_token_index(parsed.sub))) {
+				cand.get_first_lexical_token_index(parsed.sub()))) {
 			return true;
 		}
 	}
@@ -78,12 +79,14 @@ bool ViolatesOperatorRules(Candidate const&cand) {
 
 
 void on_exit() {
-	if(sStartTime == 0) {
+	ParseSession &session = CurrentSession();
+	if(session.start_time == 0) {
 		return;
 	}
 	const double end_time = doubletime();
-	fprintf(stderr, "Parsing time %fms\n", (end_time-sStartTime) * 1000.0);
-	sStartTime = 0;
+	fprintf(stderr, "Parsing time %fms\n", (end_time-session.start_time) * 1000.0);
+	fprintf(stderr, "Child arrays %i bytes\n", (int)session.child_arena->bytes_used());
+	session.start_time = 0;
 }
 
 struct TristateValue {
@@ -138,13 +141,6 @@ void ParseCSV(const char*path, InterfaceValueMap &output) {
 // ---- / grammar specific ----
 
 
-extern "C" {
-extern int yylex (void);
-void yyset_in  ( FILE * _in_str  );
-extern int yylineno;
-};
-
-
 int main(int argc, const char **argv) {
 
 	InterfaceValueMap test_values;
@@ -180,7 +176,7 @@ int main(int argc, const char **argv) {
 			input_path);
 	}
 
-	yyset_in(input);
+	FlexScanner scanner(input);
 
 	fprintf(stderr, "--- Parsing starts ---\n");
 
@@ -197,19 +193,19 @@ int main(int argc, const char **argv) {
 	CandidateVector candidates;
 	candidates.push_back(top_cand);
 
-	sStartTime = doubletime();
+	CurrentSession().start_time = doubletime();
 
 	for(unsigned token_index=0;;++token_index) {
-		Token tok = yylex();
+		Token tok = scanner.Next();
 		if(tok == 0) {
 			break;
 		}
 
-		string tok_type_name = GetTokenInstTypeName(tok);
+		char const* tok_type_name = GetTokenInstTypeName(tok);
 
 #if !PROFILING
 		fprintf(stderr, "\n\n---- Next %s (line %i), candidates before %i\n",
-			TokenToString(tok).c_str(), yylineno, (int)candidates.size());
+			TokenToString(tok).c_str(), scanner.lineno(), (int)candidates.size());
 #endif
 
 #if !PROFILING
@@ -218,11 +214,14 @@ int main(int argc, const char **argv) {
 		CandidateVector dbg_candidates = candidates;
 #endif
 
-		ConsumeToken(tok, token_index, yylineno, candidates);
+		if(!ConsumeToken(tok, token_index, scanner.lineno(), candidates)) {
+			// An internal error, already reported
+			exit(1);
+		}
 
 		if(candidates.size() == 0) {
 			// TODO: Report line number in preprocessed file
-			fprintf(stderr, "ERROR at line %i, token %s\n", yylineno, tok_type_name.c_str());
+			fprintf(stderr, "ERROR at line %i, token %s\n", scanner.lineno(), tok_type_name);
 
 #if DEBUG
 			fprintf(stderr, "\nFinal candidates (%i):\n", (int)dbg_candidates.size());
@@ -231,13 +230,18 @@ int main(int argc, const char **argv) {
 			exit(1);
 		}
 
-		absl::InlinedVector unfiltered = candidates;
-		candidates.clear();
-		for(Candidate const&cand : unfiltered) {
+		// Filtered in place, a copy of the frontier would allocate each token
+		unsigned n_kept = 0;
+		for(unsigned ci=0;ci<candidates.size();++ci) {
+			Candidate const&cand = candidates[ci];
 			if((cand.top_completed == NodeId_Null) || (!ViolatesOperatorRules(cand))) {
-				candidates.push_back(cand);
+				if(n_kept != ci) {
+					candidates[n_kept] = cand;
+				}
+				++n_kept;
 			}
 		}
+		candidates.resize(n_kept);
 	}
 
 	on_exit();
@@ -0,0 +1,283 @@
+
+
+#include "gtest/gtest.h"
+#include "parser.h"
+#include "flex_scanner.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace parser;
+
+namespace {
+
+void SetupOnce() {
+	static bool done = false;
+	if(!done) {
+		SetupParser();
+		done = true;
+	}
+}
+
+// The complete candidates for input, parsed in the calling thread's session
+std::string Parse(std::string const&input) {
+	vector<Rule> const&top_rules = GetRulesForTokenName(GetTokenInstName("top", ""));
+	Candidate top_cand;
+	top_cand.add_node(Node(top_rules[0], NodeId_Null));
+	CandidateVector candidates;
+	candidates.push_back(top_cand);
+
+	FILE* in = ::fmemopen(const_cast<char*>(input.data()), input.size(), "rb");
+	{
+		FlexScanner scanner(in);
+		unsigned token_index = 0;
+		for(Token tok = scanner.Next();tok != 0;tok = scanner.Next()) {
+			EXPECT_TRUE(ConsumeToken(tok, token_index++, scanner.lineno(), candidates));
+		}
+	}
+	fclose(in);
+
+	std::string ret;
+	for(Candidate const&cand : candidates) {
+		if(cand.is_complete()) {
+			ret += cand.ToString(NodeId_Top);
+			ret += "\n";
+		}
+	}
+	return ret;
+}
+
+const std::vector<std::string> kInputs = {
+	", 12 ,false 3",
+	",, 7 ,true - 5\n\n 12 + 3",
+	", 1 ,\n 22 3",
+	"1 + 2",
+};
+
+TEST(ParseSessionTest, TokensStayInSession) {
+	SetupOnce();
+	const TokenType num = GetTokenTypeId("NUM");
+	const Token top = GetTokenInstName("top", "");
+
+	ParseSession a;
+	ParseSession b;
+	Token in_a;
+	{
+		ParseSession::Scope scope(a);
+		in_a = GetTokenInstName(num, "12");
+		EXPECT_EQ(in_a, GetTokenInstName(num, "12"));
+		EXPECT_STREQ("12", GetTokenInstContent(in_a));
+		EXPECT_EQ(top, GetTokenInstName("top", ""));
+	}
+	{
+		ParseSession::Scope scope(b);
+		// Numbered on from the shared tokens in every session
+		const Token in_b = GetTokenInstName(num, "34");
+		EXPECT_EQ(in_a, in_b);
+		EXPECT_STREQ("34", GetTokenInstContent(in_b));
+		EXPECT_EQ(top, GetTokenInstName("top", ""));
+	}
+	{
+		ParseSession::Scope scope(a);
+		EXPECT_STREQ("12", GetTokenInstContent(in_a));
+	}
+}
+
+TEST(ParseSessionTest, ScopesNest) {
+	ParseSession a;
+	ParseSession b;
+	ParseSession &outer = CurrentSession();
+	{
+		ParseSession::Scope scope_a(a);
+		EXPECT_EQ(&a, &CurrentSession());
+		{
+			ParseSession::Scope scope_b(b);
+			EXPECT_EQ(&b, &CurrentSession());
+		}
+		EXPECT_EQ(&a, &CurrentSession());
+	}
+	EXPECT_EQ(&outer, &CurrentSession());
+}
+
+TEST(ParseSessionTest, SettingsStayInSession) {
+	WorkStealingPool pool(2);
+	ParseSession a;
+	ParseSession b;
+	{
+		ParseSession::Scope scope(a);
+		SetValidation(ValidationFull, 4);
+		SetConsumePool(&pool);
+	}
+	EXPECT_EQ(ValidationFull, a.validation.level);
+	EXPECT_EQ(4u, a.validation.full_every);
+	EXPECT_EQ(&pool, a.consume_pool);
+	EXPECT_EQ(Validation().level, b.validation.level);
+	EXPECT_EQ(0, b.consume_pool);
+}
+
+// The frontier after each token of input, in the calling thread's session
+std::vector<std::vector<std::string> > Frontiers(std::string const&input) {
+	vector<Rule> const&top_rules = GetRulesForTokenName(GetTokenInstName("top", ""));
+	Candidate top_cand;
+	top_cand.add_node(Node(top_rules[0], NodeId_Null));
+	CandidateVector candidates;
+	candidates.push_back(top_cand);
+
+	std::vector<std::vector<std::string> > ret;
+	FILE* in = ::fmemopen(const_cast<char*>(input.data()), input.size(), "rb");
+	{
+		FlexScanner scanner(in);
+		unsigned token_index = 0;
+		for(Token tok = scanner.Next();tok != 0;tok = scanner.Next()) {
+			EXPECT_TRUE(ConsumeToken(tok, token_index++, scanner.lineno(), candidates));
+			ret.emplace_back();
+			for(Candidate const&cand : candidates) {
+				ret.back().push_back(cand.ToString(NodeId_Top));
+			}
+		}
+	}
+	fclose(in);
+	return ret;
+}
+
+TEST(ParseSessionTest, PooledFrontierMatchesSerial) {
+	SetupOnce();
+	// Ambiguous, the frontier grows to 728
+	const std::string input = "1 - 2 +3 - 4 +5 - 6 +7 - 8 +9 - 10 +11";
+
+	std::vector<std::vector<std::string> > serial;
+	{
+		ParseSession session;
+		ParseSession::Scope scope(session);
+		serial = Frontiers(input);
+	}
+	size_t widest = 0;
+	for(std::vector<std::string> const&frontier : serial) {
+		widest = std::max(widest, frontier.size());
+	}
+	ASSERT_LE(4*sParallelFrontierMin, widest);
+
+	WorkStealingPool pool(4);
+	ParseSession session;
+	ParseSession::Scope scope(session);
+	SetConsumePool(&pool);
+	const std::vector<std::vector<std::string> > pooled = Frontiers(input);
+
+	// Same candidates in the same order after every token
+	ASSERT_EQ(serial.size(), pooled.size());
+	for(size_t ti=0;ti<serial.size();++ti) {
+		ASSERT_EQ(serial[ti].size(), pooled[ti].size()) << "token " << ti;
+		for(size_t ci=0;ci<serial[ti].size();++ci) {
+			ASSERT_EQ(serial[ti][ci], pooled[ti][ci]) << "token " << ti << " candidate " << ci;
+		}
+	}
+}
+
+Rule const&FindRule(const char*token_name, const char*rule_name) {
+	for(Rule const&rule : GetRulesForTokenName(GetTokenInstName(token_name, ""))) {
+		if(strcmp(GetRuleName(rule.name), rule_name) == 0) {
+			return rule;
+		}
+	}
+	assert(!"No such rule");
+	return GetRulesForTokenName(GetTokenInstName(token_name, ""))[0];
+}
+
+TEST(ParseSessionTest, FailedCheckFailsParse) {
+	SetupOnce();
+	ParseSession session;
+	ParseSession::Scope scope(session);
+	SetValidation(ValidationFull);
+
+	const TokenType comma = GetTokenTypeId("COMMA");
+	const TokenType num = GetTokenTypeId("NUM");
+	RecordLexedToken(LexedRecord::Interned(GetTokenInstName(comma, ""), 1), 0);
+	RecordLexedToken(LexedRecord::Interned(GetTokenInstName(num, "1"), 1), 1);
+
+	// expr_list { COMMA num_expr { NUM } ^expr* }, with num_expr's parent wrong
+	Candidate cand;
+	Node list(FindRule("expr", "expr_list"), NodeId_Null);
+	list.parsed_tokens.push_back(Node::ParsedToken::Lexed(0));
+	list.parsed_tokens.push_back(NodeId(NodeId_Top+1));
+	cand.add_node(list);
+	Node sub(FindRule("expr", "num_expr"), NodeId(NodeId_Top+2));
+	sub.parsed_tokens.push_back(Node::ParsedToken::Lexed(1));
+	cand.add_node(sub);
+	EXPECT_TRUE(cand.is_sane_cheap());
+	EXPECT_FALSE(cand.is_sane());
+
+	CandidateVector candidates;
+	candidates.push_back(cand);
+	EXPECT_FALSE(ConsumeToken(GetTokenInstName(num, "2"), 2, 1, candidates));
+	EXPECT_EQ(0u, candidates.size());
+}
+
+TEST(ParseSessionTest, ChildArraysGoWithSession) {
+	SetupOnce();
+	std::weak_ptr<ChildArena> arena;
+	std::shared_ptr<ChildArena> adopting(new ChildArena);
+	std::weak_ptr<ChildArena> adopted;
+	{
+		ParseSession session;
+		ParseSession::Scope scope(session);
+		EXPECT_NE("", Parse(kInputs[1]));
+		EXPECT_LT(0u, session.child_arena->bytes_used());
+		EXPECT_EQ(0u, sDefaultSession.child_arena->bytes_used());
+		arena = session.child_arena;
+
+		ParseSession kept;
+		adopted = kept.child_arena;
+		adopting->Adopt(kept.child_arena);
+	}
+	EXPECT_TRUE(arena.expired());
+	// Adopted arenas live as long as the one adopting them
+	EXPECT_FALSE(adopted.expired());
+	adopting.reset();
+	EXPECT_TRUE(adopted.expired());
+}
+
+TEST(ParseSessionTest, ConcurrentParses) {
+	SetupOnce();
+	std::vector<std::string> expected;
+	for(std::string const&input : kInputs) {
+		ParseSession session;
+		ParseSession::Scope scope(session);
+		expected.push_back(Parse(input));
+		EXPECT_NE("", expected.back());
+	}
+
+	// Each thread parses every input a few times, a session per parse
+	const unsigned n_threads = 4;
+	const unsigned n_rounds = 5;
+	std::vector<std::vector<std::string> > results(n_threads);
+	std::vector<std::thread> threads;
+	for(unsigned ti=0;ti<n_threads;++ti) {
+		threads.emplace_back([&, ti]() {
+			for(unsigned ri=0;ri<n_rounds;++ri) {
+				for(unsigned ii=0;ii<kInputs.size();++ii) {
+					// Different orders, so sessions intern differently
+					std::string const&input = kInputs[(ii + ti) % kInputs.size()];
+					ParseSession session;
+					ParseSession::Scope scope(session);
+					results[ti].push_back(Parse(input));
+				}
+			}
+		});
+	}
+	for(std::thread &t : threads) {
+		t.join();
+	}
+
+	for(unsigned ti=0;ti<n_threads;++ti) {
+		ASSERT_EQ(n_rounds * kInputs.size(), results[ti].size());
+		for(unsigned pi=0;pi<results[ti].size();++pi) {
+			const unsigned ii = ((pi % kInputs.size()) + ti) % kInputs.size();
+			EXPECT_EQ(expected[ii], results[ti][pi]);
+		}
+	}
+}
+
+}  // namespace
@@ -14,6 +14,9 @@
 #include <list>
 #include <map>
 #include <set>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
 
 #include <sys/time.h>
 
@@ -23,6 +26,9 @@
 
 #include "immer/map.hpp"
 
+#include "thread_pool.h"
+#include "validation.h"
+
 namespace parser {
 
 
@@ -102,22 +108,60 @@ const char* GetRuleName(RuleName name) {
 
 
 typedef pair<TokenType, string> TokenInstanceKey;
-map<TokenInstanceKey, Token> sTokenInstanceIds;
-map<Token, TokenInstanceKey> sTokenInstanceKeys;
 
+// Interned tokens, both ways
+struct TokenTable {
+	size_t size()const {
+		return ids.size();
+	}
 
+	// 0 if not interned here
+	Token Find(TokenInstanceKey const&key)const {
+		const auto found = ids.find(key);
+		return (found != ids.end()) ? found->second : 0;
+	}
 
-Token GetTokenInstName(const char*type_str, const char*content) {
-	TokenInstanceKey key(GetTokenTypeId(type_str), content);
-	const auto found = sTokenInstanceIds.find(key);
-	if(found != sTokenInstanceIds.end()) {
-		return found->second;
-	} else {
-		const Token newId = 1 + sTokenInstanceIds.size();
-		sTokenInstanceIds[key] = newId;
-		sTokenInstanceKeys[newId] = key;
+	void Add(TokenInstanceKey const&key, Token id) {
+		ids[key] = id;
+		keys[id] = key;
+	}
+
+	map<TokenInstanceKey, Token> ids;
+	map<Token, TokenInstanceKey> keys;
+};
+
+// The tokens the grammar names, interned while building the rules.
+// SetupParser() freezes them, from then on parses only read them and
+//  intern anything new into their ParseSession, numbered on from these.
+TokenTable sSharedTokens;
+bool sSharedTokensFrozen = false;
+
+// Of the calling thread's current ParseSession
+TokenTable &SessionTokens();
+
+Token GetTokenInstName(TokenType type, string const&content) {
+	TokenInstanceKey key(type, content);
+	const Token shared = sSharedTokens.Find(key);
+	if(shared) {
+		return shared;
+	}
+	if(!sSharedTokensFrozen) {
+		const Token newId = 1 + sSharedTokens.size();
+		sSharedTokens.Add(key, newId);
 		return newId;
 	}
+	TokenTable &session = SessionTokens();
+	const Token found = session.Find(key);
+	if(found) {
+		return found;
+	}
+	const Token newId = 1 + sSharedTokens.size() + session.size();
+	session.Add(key, newId);
+	return newId;
+}
+
+Token GetTokenInstName(const char*type_str, const char*content) {
+	return GetTokenInstName(GetTokenTypeId(type_str), content);
 }
 
 extern "C" Token LexGetTokenInstName(const char*type_str, const char*content) {
@@ -125,28 +169,40 @@ extern "C" Token LexGetTokenInstName(const char*type_str, const char*content) {
 	return GetTokenInstName(type_str, content);
 }
 
+// What the generated lex actions call, with the ids from grammar.h
+extern "C" Token LexGetTokenInstId(TokenType type, const char*content) {
+	assert((type > 0) && (type < sLexicalTokenTypes.size()));
+	return GetTokenInstName(type, content);
+}
+
 const char*GetTokenTypeName(TokenType t) {
 	assert(t < sTokenTypes.size());
 	return sTokenTypes[t].c_str();
 }
 
+TokenInstanceKey const&GetTokenInstKey(Token t) {
+	TokenTable const&table = (t <= sSharedTokens.size()) ? sSharedTokens : SessionTokens();
+	const auto found = table.keys.find(t);
+	assert(found!=table.keys.end());
+	return found->second;
+}
+
 const char*GetTokenInstContent(Token t) {
-	const auto found = sTokenInstanceKeys.find(t);
-	assert(found!=sTokenInstanceKeys.end());
-	return found->second.second.c_str();
+	return GetTokenInstKey(t).second.c_str();
 }
 
 const TokenType GetTokenInstType(Token t) {
-	const auto found = sTokenInstanceKeys.find(t);
-	assert(found!=sTokenInstanceKeys.end());
-	return found->second.first;
+	return GetTokenInstKey(t).first;
 }
 
-bool TokenIsLexical(Token t) {
-	TokenType type = GetTokenInstType(t);
+bool TokenTypeIsLexical(TokenType type) {
 	return (type>0) && (type<sLexicalTokenTypes.size());
 }
 
+bool TokenIsLexical(Token t) {
+	return TokenTypeIsLexical(GetTokenInstType(t));
+}
+
 const char*GetTokenInstTypeName(Token t) {
 	return GetTokenTypeName(GetTokenInstType(t));
 }
@@ -233,6 +289,25 @@ map<RuleName, Rule> ExtractRules(map<Token, vector<Rule> > const&rules_by_token_
 
 const map<RuleName, Rule> sRulesByRuleName = ExtractRules(sRulesByTokenName);
 
+// By RuleName-1, for lookups while parsing
+vector<Rule const*> IndexRules(map<RuleName, Rule> const&rules_by_rule_name) {
+	vector<Rule const*> ret;
+	for(auto const&value : rules_by_rule_name) {
+		if(ret.size() < value.first) {
+			ret.resize(value.first, 0);
+		}
+		ret[value.first-1] = &value.second;
+	}
+	return ret;
+}
+
+const vector<Rule const*> sRulesById = IndexRules(sRulesByRuleName);
+
+Rule const&GetRuleById(RuleName rule_id) {
+	assert((rule_id > 0) && (rule_id <= sRulesById.size()) && sRulesById[rule_id-1]);
+	return *sRulesById[rule_id-1];
+}
+
 string TokenToString(Token tok) {
 	assert(tok);
 	const string content = GetTokenInstContent(tok);
@@ -407,29 +482,367 @@ enum NodeId {
 	NodeId_Top = 1,
 };
 
+// Lexed tokens are stored once per parse, indexed by token_index.
+// Nodes only keep the index, so line numbers aren't copied on every node update.
+// The parse only looks at token types, so a token's text is left where the
+//  lexer found it, in the ParseSession's lexed_text, and only interned into a Token when
+//  something asks for one.
+struct LexedRecord {
+	LexedRecord() : type(0), offset(0), length(0), lineno(0), interned(0) { }
+
+	// For lexers which intern as they go, like yylex()
+	static LexedRecord Interned(Token tok, int lineno) {
+		LexedRecord rec;
+		rec.type = GetTokenInstType(tok);
+		rec.lineno = lineno;
+		rec.interned = tok;
+		return rec;
+	}
+
+	TokenType type;
+	// The text in the session's lexed_text, length 0 for tokens without contents
+	uint32_t offset;
+	uint32_t length;
+	int lineno;
+	// 0 until LexedToken()
+	mutable Token interned;
+};
+
+// Exact-size child arrays for nodes, owned by the ParseSession they were
+//  parsed in and freed with it.
+// Arrays are shared between candidates by immer, so they are never modified
+//  once a node points at them, and nothing is freed before the arena.
+// Each thread bump allocates from its own block of each arena it uses. The
+//  blocks are kept by the arena since nodes outlive the frontier worker
+//  that created them.
+// Candidates kept past their session, like saved frontiers, keep a
+//  shared_ptr to its arena, and a session continuing them Adopt()s it.
+struct ChildArena {
+	static const unsigned sBlockLen = 1 << 14;
+
+	ChildArena() : id_(sNextId.fetch_add(1, std::memory_order_relaxed) + 1), bytes_used_(0) {
+	}
+
+	ChildArena(ChildArena const&) = delete;
+	ChildArena& operator=(ChildArena const&) = delete;
+
+	uint32_t* allocate(unsigned n) {
+		assert(n <= sBlockLen);
+		Cursor &cursor = ThreadCursor();
+		if((cursor.used + n) > sBlockLen) {
+			cursor.block = NewBlock();
+			cursor.used = 0;
+		}
+		uint32_t *ret = cursor.block + cursor.used;
+		cursor.used += n;
+		bytes_used_.fetch_add(n * sizeof(uint32_t), std::memory_order_relaxed);
+		return ret;
+	}
+
+	// Keeps other's arrays until this arena is freed
+	void Adopt(shared_ptr<ChildArena> const&other) {
+		if(!other || (other.get() == this)) {
+			return;
+		}
+		std::lock_guard<std::mutex> lock(mutex_);
+		if(std::find(adopted_.begin(), adopted_.end(), other) == adopted_.end()) {
+			adopted_.push_back(other);
+		}
+	}
+
+	size_t bytes_used()const {
+		return bytes_used_.load(std::memory_order_relaxed);
+	}
+
+private:
+	// A thread's block in one arena, by arena id since arenas come and go
+	struct Cursor {
+		uint64_t arena_id;
+		uint32_t *block;
+		unsigned used;
+	};
+
+	// A thread switching between more arenas than this starts new blocks
+	static const unsigned sThreadCursors = 8;
+
+	Cursor &ThreadCursor() {
+		thread_local Cursor cursors[sThreadCursors] = {};
+		Cursor &cursor = cursors[id_ % sThreadCursors];
+		if(cursor.arena_id != id_) {
+			cursor.arena_id = id_;
+			cursor.block = 0;
+			cursor.used = sBlockLen;
+		}
+		return cursor;
+	}
+
+	uint32_t* NewBlock() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		blocks_.emplace_back(new uint32_t[sBlockLen]);
+		return blocks_.back().get();
+	}
+
+	// Never 0, which marks an unused Cursor
+	const uint64_t id_;
+	std::atomic<size_t> bytes_used_;
+
+	std::mutex mutex_;
+	vector<unique_ptr<uint32_t[]> > blocks_;
+	vector<shared_ptr<ChildArena> > adopted_;
+
+	inline static std::atomic<uint64_t> sNextId;
+};
+
+// What one parse changes as it goes: the tokens it interned, its lexed
+//  tokens and the text they are in, its nodes' child arrays, and when it
+//  started. Also how it is checked and which pool expands its frontiers.
+// The rules, the step tables and sSharedTokens are only read while parsing,
+//  so parses in different sessions can run on different threads at once.
+// A thread parses in the session a ParseSession::Scope made current, or in
+//  a default one, so a program which parses on one thread needs neither.
+// Nodes refer to lexed tokens by index and to interned tokens by id, so
+//  candidates are only meaningful with the session they came from current.
+struct ParseSession {
+	ParseSession()
+	  : lexed_text(0), child_arena(new ChildArena), consume_pool(0), start_time(0) {
+	}
+
+	ParseSession(ParseSession const&) = delete;
+	ParseSession& operator=(ParseSession const&) = delete;
+
+	// Makes session current on this thread, until the end of the scope
+	struct Scope {
+		explicit Scope(ParseSession &session) : prev(sCurrent) {
+			sCurrent = &session;
+		}
+
+		~Scope() {
+			sCurrent = prev;
+		}
+
+		ParseSession *prev;
+	};
+
+	static ParseSession &Current();
+
+	// Tokens interned after SetupParser()
+	TokenTable tokens;
+
+	// What LexedRecord offsets point into, which outlives the parse
+	char const* lexed_text;
+
+	// By token index, see RecordLexedToken()
+	vector<LexedRecord> lexed_tokens;
+
+	// Shared with whatever keeps candidates past the session
+	shared_ptr<ChildArena> child_arena;
+
+	// How much ConsumeToken() checks, see SetValidation()
+	Validation validation;
+
+	// Not owned, see SetConsumePool()
+	WorkStealingPool *consume_pool;
+
+	// When the parse started, 0 once reported
+	double start_time;
+
+  private:
+	inline static thread_local ParseSession *sCurrent = 0;
+};
+
+ParseSession sDefaultSession;
+
+ParseSession &ParseSession::Current() {
+	return sCurrent ? *sCurrent : sDefaultSession;
+}
+
+ParseSession &CurrentSession() {
+	return ParseSession::Current();
+}
+
+TokenTable &SessionTokens() {
+	return CurrentSession().tokens;
+}
+
+string LexedContent(LexedRecord const&rec) {
+	if(rec.length) {
+		return string(CurrentSession().lexed_text + rec.offset, rec.length);
+	}
+	return rec.interned ? GetTokenInstContent(rec.interned) : "";
+}
+
+// Appends a token's type and text to key, so runs of tokens can be compared
+//  without interning them
+void AppendLexedKey(string &key, TokenType type, char const*text, uint32_t length) {
+	key.append((char const*)&type, sizeof(type));
+	key.append((char const*)&length, sizeof(length));
+	key.append(text, length);
+}
+
+void AppendLexedKey(string &key, LexedRecord const&rec) {
+	if(rec.length) {
+		AppendLexedKey(key, rec.type, CurrentSession().lexed_text + rec.offset, rec.length);
+	} else {
+		char const*text = rec.interned ? GetTokenInstContent(rec.interned) : "";
+		AppendLexedKey(key, rec.type, text, strlen(text));
+	}
+}
+
+// Interns on first use. The session's token table isn't locked, so only
+//  call this from the thread driving the parse.
+Token LexedToken(LexedRecord const&rec) {
+	if(!rec.interned) {
+		rec.interned = GetTokenInstName(rec.type, LexedContent(rec));
+	}
+	return rec.interned;
+}
+
+// TokenToString() without interning
+string LexedToString(LexedRecord const&rec) {
+	const string content = LexedContent(rec);
+	string ret = GetTokenTypeName(rec.type);
+	if(content.size() > 0) {
+		ret += "(";
+		ret += content;
+		ret += ")";
+	}
+	return ret;
+}
+
+void RecordLexedToken(LexedRecord const&rec, unsigned token_index) {
+	vector<LexedRecord> &lexed_tokens = CurrentSession().lexed_tokens;
+	if(token_index >= lexed_tokens.size()) {
+		lexed_tokens.resize(token_index+1);
+	}
+	lexed_tokens[token_index] = rec;
+}
+
 struct Node {
 
+	// 32-bit tagged handle: either a sub node id (high bit set),
+	//  or the token_index of a lexed token in the session's lexed_tokens
 	struct ParsedToken {
-		ParsedToken(Token lexed, unsigned token_index, int lineno) 
-			: lexed(lexed), sub(NodeId_Null),
-			  token_index(token_index), lineno(lineno) {
+		static const uint32_t sSubTag = 0x80000000u;
+
+		explicit ParsedToken(uint32_t handle) : handle(handle) {
 		}
 
-		ParsedToken(NodeId sub) : lexed(0), sub(sub) {
+		ParsedToken(NodeId sub) : handle(sSubTag | sub) {
+			assert(!(sub & sSubTag));
 		}
 
-		Token lexed;
-		NodeId sub;
+		static ParsedToken Lexed(unsigned token_index) {
+			assert(!(token_index & sSubTag));
+			return ParsedToken(uint32_t(token_index));
+		}
 
-		// Extra metadata if lexed is valid
-		unsigned token_index;
-		int lineno;
+		bool is_sub()const {
+			return handle & sSubTag;
+		}
+
+		NodeId sub()const {
+			return is_sub() ? NodeId(handle & ~sSubTag) : NodeId_Null;
+		}
+
+		// Interned, see LexedToken()
+		Token lexed()const {
+			return is_sub() ? 0 : LexedToken(CurrentSession().lexed_tokens[handle]);
+		}
+
+		TokenType lexed_type()const {
+			return is_sub() ? 0 : CurrentSession().lexed_tokens[handle].type;
+		}
+
+		LexedRecord const&record()const {
+			assert(!is_sub());
+			return CurrentSession().lexed_tokens[handle];
+		}
+
+		unsigned token_index()const {
+			assert(!is_sub());
+			return handle;
+		}
+
+		int lineno()const {
+			assert(!is_sub());
+			return CurrentSession().lexed_tokens[handle].lineno;
+		}
+
+		uint32_t handle;
+	};
+
+	// Copy-on-write view of a child array in the session's ChildArena
+	struct ParsedTokens {
+		struct const_iterator {
+			uint32_t const*p;
+
+			ParsedToken operator*()const {
+				return ParsedToken(*p);
+			}
+			const_iterator& operator++() {
+				++p;
+				return *this;
+			}
+			bool operator!=(const_iterator const&o)const {
+				return p != o.p;
+			}
+		};
+
+		ParsedTokens() : handles(0), count(0) {
+		}
+
+		unsigned size()const {
+			return count;
+		}
+
+		ParsedToken operator[](unsigned i)const {
+			assert(i < count);
+			return ParsedToken(handles[i]);
+		}
+
+		ParsedToken back()const {
+			return (*this)[count-1];
+		}
+
+		const_iterator begin()const {
+			return const_iterator{handles};
+		}
+
+		const_iterator end()const {
+			return const_iterator{handles + count};
+		}
+
+		void assign(uint32_t const*first, uint32_t n) {
+			uint32_t *next = CurrentSession().child_arena->allocate(n);
+			std::copy(first, first + n, next);
+			handles = next;
+			count = n;
+		}
+
+		void push_back(ParsedToken parsed) {
+			uint32_t *next = CurrentSession().child_arena->allocate(count+1);
+			std::copy(handles, handles + count, next);
+			next[count] = parsed.handle;
+			handles = next;
+			++count;
+		}
+
+		void set(unsigned i, ParsedToken parsed) {
+			assert(i < count);
+			uint32_t *next = CurrentSession().child_arena->allocate(count);
+			std::copy(handles, handles + count, next);
+			next[i] = parsed.handle;
+			handles = next;
+		}
+
+		uint32_t const*handles;
+		uint32_t count;
 	};
 
 	// Pointer instead of reference for move semantics
 	Rule const*rule;
+	ParsedTokens parsed_tokens;
 	NodeId parent;
-	absl::InlinedVector<ParsedToken, sInlinedRuleLen> parsed_tokens;
 
 	Node() : rule(0), parent(NodeId_Null) {
 
@@ -474,7 +887,7 @@ struct Candidate {
 	typedef absl::InlinedVector<NodeId, sNodeIdInlineCount> NodeIdVector;
 
 	Candidate()
-	 : next_node_id(NodeId_Top), work_id(NodeId_Top) {
+	 : next_node_id(NodeId_Top), work_id(NodeId_Top), top_completed(NodeId_Null) {
 
 	}
 
@@ -485,10 +898,93 @@ struct Candidate {
 		return nid;
 	}
 
+	// Copies every node of other into this candidate, with other's top
+	//  node placed under parent. Lexed token indices are moved by token_offset.
+	// Returns the new id of other's top node.
+	NodeId graft(Candidate const&other, NodeId parent, int token_offset = 0) {
+		const unsigned offset = next_node_id - NodeId_Top;
+		auto remap = [offset](NodeId nid) {
+			return NodeId(nid + offset);
+		};
+
+		vector<uint32_t> remapped;
+		for(unsigned nid=NodeId_Top;nid<other.next_node_id;++nid) {
+			Node node = other.get_node(NodeId(nid));
+			node.parent = (nid == NodeId_Top) ? parent : remap(node.parent);
+
+			remapped.clear();
+			for(Node::ParsedToken parsed : node.parsed_tokens) {
+				remapped.push_back(parsed.is_sub() ?
+					Node::ParsedToken(remap(parsed.sub())).handle :
+					Node::ParsedToken::Lexed(parsed.token_index() + token_offset).handle);
+			}
+			node.parsed_tokens.assign(remapped.data(), remapped.size());
+
+			const NodeId new_nid = add_node(node);
+			assert(new_nid == remap(NodeId(nid)));
+		}
+		return remap(NodeId_Top);
+	}
+
 	string ToString()const {
 		return ToString(NodeId_Top);
 	}
 
+	// The nodes at top and work_id exist
+	bool is_sane_cheap()const {
+		return nodes_by_id.find(NodeId_Top) && nodes_by_id.find(work_id);
+	}
+
+	// Every node under top exists, its subs have it as parent, all but its
+	//  last sub are complete, and work_id is one of them
+	bool is_sane()const {
+		NodeIdVector stack;
+		stack.push_back(NodeId_Top);
+		bool found_work_id = false;
+
+		while(stack.size()) {
+			const NodeId nid = stack.back();
+			stack.pop_back();
+
+			Node const*node_ptr = nodes_by_id.find(nid);
+			if(!node_ptr || !node_ptr->rule) {
+				fprintf(stderr, "Candidate is insane: missing node %u\n", (unsigned)nid);
+				return false;
+			}
+			Node const&node = *node_ptr;
+			if(node.parsed_tokens.size() > node.pattern_length()) {
+				fprintf(stderr, "Candidate is insane: %s parsed past its pattern\n",
+					GetRuleName(node.rule->name));
+				return false;
+			}
+			found_work_id = found_work_id || (nid == work_id);
+
+			for(unsigned i=0;i<node.parsed_tokens.size();++i) {
+				const NodeId sub = node.parsed_tokens[i].sub();
+				if(!sub) {
+					continue;
+				}
+				Node const*sub_ptr = nodes_by_id.find(sub);
+				if(!sub_ptr || (sub_ptr->parent != nid)) {
+					fprintf(stderr, "Candidate is insane: sub %u of %u has another parent\n",
+						(unsigned)sub, (unsigned)nid);
+					return false;
+				}
+				if(((i+1) < node.parsed_tokens.size()) && !is_complete(sub)) {
+					fprintf(stderr, "Candidate is insane: incomplete left-hand sub %u\n",
+						(unsigned)sub);
+					return false;
+				}
+				stack.push_back(sub);
+			}
+		}
+
+		if(!found_work_id) {
+			fprintf(stderr, "Candidate is insane: work_id %u not under top\n", (unsigned)work_id);
+		}
+		return found_work_id;
+	}
+
 	bool is_complete()const {
 		return is_complete(NodeId_Top);
 	}
@@ -502,7 +998,7 @@ struct Candidate {
  			return false;
 
  		Node::ParsedToken const&last = node.parsed_tokens.back();
- 		return last.lexed || (last.sub && is_complete(last.sub));
+ 		return !last.is_sub() || is_complete(last.sub());
  	}
 
  	Token next_token_in_pattern(NodeId nid)const {
@@ -536,7 +1032,7 @@ struct Candidate {
  	}
 
 
-	void step_down(Token tok,
+	void step_down(TokenType tok_type,
 				CandidateVector& successors) {
 
 		const NodeId incomplete_work_id = get_incomplete_ancestor_or_top(work_id);
@@ -554,7 +1050,7 @@ struct Candidate {
 			if(IsRuleTokenName(next_token)) {
 				StepContext step_down_ctx;
 
-				step_down_ctx.lexed = GetTokenInstType(tok);
+				step_down_ctx.lexed = tok_type;
 				step_down_ctx.needed_rule = next_token;
 
 
@@ -589,9 +1085,7 @@ struct Candidate {
 		NodeId last_nid = parent;
 
 		for(const RuleName step_down_rule_id : stack) {
-			auto found_rule = sRulesByRuleName.find(step_down_rule_id);
-			assert(found_rule != sRulesByRuleName.end());
-			Rule const&rule = found_rule->second;
+			Rule const&rule = GetRuleById(step_down_rule_id);
 
 			Node sub_node(rule, last_nid);
 			const NodeId sub_nid = add_node(sub_node);
@@ -607,7 +1101,7 @@ struct Candidate {
 		return last_nid;
  	}
 
-	void step_up(Token tok,
+	void step_up(TokenType tok_type,
 				 CandidateVector& successors) {
 
 		for(NodeId nid = work_id;nid != NodeId_Null;nid = get_node(nid).parent) {
@@ -625,7 +1119,7 @@ struct Candidate {
 			// Complete, step up
 			StepContext step_up_ctx;
 
-			step_up_ctx.lexed = GetTokenInstType(tok);
+			step_up_ctx.lexed = tok_type;
 			step_up_ctx.needed_rule = node.rule->token_name;
 
 		#if DEBUG
@@ -643,9 +1137,7 @@ struct Candidate {
 				const StepUpAction& action = step_up_it->second;
 				const RuleName step_up_rule_id = action.step_up_rule_id;
 
-				auto found_rule = sRulesByRuleName.find(step_up_rule_id);
-				assert(found_rule != sRulesByRuleName.end());
-				Rule const&rule = found_rule->second;
+				Rule const&rule = GetRuleById(step_up_rule_id);
 
 				Candidate new_cand(*this);
 
@@ -660,8 +1152,8 @@ struct Candidate {
 		  		});
 		  		new_cand.nodes_by_id = new_cand.nodes_by_id.update(node.parent, [&](Node node) {
 		  			const unsigned idx = node.parsed_tokens.size()-1;
-		  			assert(node.parsed_tokens[idx].sub == nid);
-		  			node.parsed_tokens[idx] = Node::ParsedToken(new_nid);
+		  			assert(node.parsed_tokens[idx].sub() == nid);
+		  			node.parsed_tokens.set(idx, Node::ParsedToken(new_nid));
 		  			return node;
 		  		});
 
@@ -677,8 +1169,10 @@ struct Candidate {
 
  	}
 
+	// A complete top is returned as is, like when an item parsed from its
+	//  own root is given more tokens
  	NodeId get_incomplete_ancestor_or_top(NodeId nid)const {
-		while(is_complete(nid)) {
+		while((nid != NodeId_Top) && is_complete(nid)) {
 			/*
 			fprintf(stderr, "--- parent %i at %s\n", 
 					(int)get_node(nid).parent,
@@ -692,14 +1186,12 @@ struct Candidate {
 		return nid;
  	}
 
-	bool consume(Token tok, unsigned token_index, int lineno) {
+	bool consume(TokenType tok_type, unsigned token_index) {
 		top_completed = NodeId_Null;
 
 		// Find first incomplete
 		for(NodeId nid = work_id;nid != NodeId_Null;nid = get_node(nid).parent) {
 			if(!is_complete(nid)) {
-				const TokenType tok_type = GetTokenInstType(tok);
-
 				const Token next_token_this_node = next_token_in_pattern(nid);
 
 			  	if(GetTokenInstType(next_token_this_node) == tok_type) {
@@ -707,7 +1199,7 @@ struct Candidate {
 
 			  		nodes_by_id = nodes_by_id.update(nid, [&](Node node) {
 			  			node.parsed_tokens.push_back(
-			  				Node::ParsedToken(tok, token_index, lineno));
+			  				Node::ParsedToken::Lexed(token_index));
 			  			return node;
 			  		});
 
@@ -739,9 +1231,9 @@ struct Candidate {
 	unsigned get_first_lexical_token_index(NodeId nid)const {
 		Node const&node = get_node(nid);
 		for(unsigned i=0;i<node.parsed_tokens.size();++i) {
-			if(node.parsed_tokens[i].lexed != 0) {
-				assert(TokenIsLexical(node.parsed_tokens[i].lexed));
-				return node.parsed_tokens[i].token_index;
+			if(!node.parsed_tokens[i].is_sub()) {
+				assert(TokenTypeIsLexical(node.parsed_tokens[i].lexed_type()));
+				return node.parsed_tokens[i].token_index();
 			}
 		}
 		assert(!"Shouldn't get here");
@@ -752,11 +1244,11 @@ struct Candidate {
  	unsigned get_first_lexical_token_index(NodeId nid)const {
  		Node const&node = get_node(nid);
 		assert(node.parsed_tokens.size() > 0);
-		if(node.parsed_tokens[0].sub != 0) {
-			return get_first_lexical_token_index(node.parsed_tokens[0].sub);
+		if(node.parsed_tokens[0].is_sub()) {
+			return get_first_lexical_token_index(node.parsed_tokens[0].sub());
 		}
-		assert(TokenIsLexical(node.parsed_tokens[0].lexed));
-		return node.parsed_tokens[0].lexed;
+		assert(TokenTypeIsLexical(node.parsed_tokens[0].lexed_type()));
+		return node.parsed_tokens[0].token_index();
 	}
 #endif
 	string ToString(NodeId nid)const {
@@ -773,8 +1265,8 @@ struct Candidate {
 			bool complete_here = false;
 
 			if(i < node.next_unprocessed_index()) {
-				if(node.parsed_tokens[i].sub) {
-					complete_here = is_complete(node.parsed_tokens[i].sub);
+				if(node.parsed_tokens[i].sub()) {
+					complete_here = is_complete(node.parsed_tokens[i].sub());
 				} else {
 					complete_here = true;
 				}
@@ -791,11 +1283,11 @@ struct Candidate {
 					ostr << "^";
 				}
 
-				if(node.parsed_tokens[i].lexed) {
-					ostr << TokenToString(node.parsed_tokens[i].lexed);
+				if(!node.parsed_tokens[i].is_sub()) {
+					ostr << LexedToString(node.parsed_tokens[i].record());
 				} else {
-					assert(node.parsed_tokens[i].sub);
-					ostr << ToString(node.parsed_tokens[i].sub);
+					assert(node.parsed_tokens[i].sub());
+					ostr << ToString(node.parsed_tokens[i].sub());
 				}
 			}
 			if((!nid_complete) && complete_here && (i == (node.parsed_tokens.size()-1))) {
@@ -835,11 +1327,11 @@ struct Candidate {
 			if(i >= node.next_unprocessed_index()) {
 				ostr << TokenToString(node.rule->pattern[i]);
 			} else {
-				if(node.parsed_tokens[i].lexed) {
-					ostr << TokenToString(node.parsed_tokens[i].lexed);
+				if(!node.parsed_tokens[i].is_sub()) {
+					ostr << LexedToString(node.parsed_tokens[i].record());
 				} else {
-					assert(node.parsed_tokens[i].sub);
-					ostr << ToStringPretty(node.parsed_tokens[i].sub, level + 1);
+					assert(node.parsed_tokens[i].sub());
+					ostr << ToStringPretty(node.parsed_tokens[i].sub(), level + 1);
 				}
 			}
 			ostr << endl;
@@ -858,8 +1350,6 @@ struct Candidate {
 typedef Candidate::CandidateVector CandidateVector;
 
 
-static double sStartTime = 0;
-
 
 
 void PrintCandidates(CandidateVector const&candidates, bool pretty = false) {
@@ -869,46 +1359,193 @@ void PrintCandidates(CandidateVector const&candidates, bool pretty = false) {
 	}
 }
 
-void ConsumeToken(Token tok, unsigned token_index, int lineno, 
-				  CandidateVector &candidates) {
+// Frontiers at least this wide are expanded on the session's consume_pool,
+//  if it has one.
+// Narrower frontiers stay on the calling thread.
+static const unsigned sParallelFrontierMin = 64;
+static const unsigned sParallelChunkLen = 16;
+
+// How much ConsumeToken() checks the current session's candidates,
+//  see ValidationLevel
+void SetValidation(ValidationLevel level, unsigned full_every_n_tokens = 1) {
+	CurrentSession().validation.level = level;
+	CurrentSession().validation.full_every = full_every_n_tokens;
+}
 
-	CandidateVector prev_candidates = candidates;
-	candidates.clear();
+// Expands the current session's wide frontiers on pool, 0 turns parallel
+//  expansion off. The caller owns the pool, which can serve several sessions.
+void SetConsumePool(WorkStealingPool *pool) {
+	CurrentSession().consume_pool = pool;
+}
 
+// Successors of a run of the frontier.
+// Kept separately so runs expanded in parallel can be concatenated in
+//  exactly the order a single serial pass produces.
+struct ConsumeBuffers {
+	CandidateVector consumed;
 	CandidateVector branched_down;
 	CandidateVector branched_up;
+};
+
+// The previous frontier and the runs, kept between tokens so a warmed up
+//  frontier is consumed without allocating
+struct ConsumeScratch {
+	CandidateVector prev_candidates;
+	vector<ConsumeBuffers> runs;
+};
+
+thread_local ConsumeScratch sConsumeScratch;
+
+// Keeps the heap storage, which InlinedVector::clear() gives back
+inline void EmptyKeepingStorage(CandidateVector &v) {
+	v.erase(v.begin(), v.end());
+}
+
+void ConsumeBranched(TokenType tok_type, unsigned token_index,
+					 CandidateVector &branched) {
+	for(Candidate &branched_cand : branched) {
+		if(!branched_cand.consume(tok_type, token_index)) {
+			assert(!"Successors should always be able to consume the next token");
+		}
+	}
+}
 
-	for(Candidate &cand : prev_candidates) {
-		if(cand.consume(tok, token_index, lineno)) {
-			candidates.push_back(cand);
+void ExpandFrontier(TokenType tok_type, unsigned token_index,
+					Candidate *first, Candidate *last,
+					ConsumeBuffers &out) {
+	for(Candidate *cand = first;cand != last;++cand) {
+		if(cand->consume(tok_type, token_index)) {
+			out.consumed.push_back(*cand);
 		} else {
-			cand.step_down(tok, branched_down);
-			cand.step_up(tok, branched_up);
+			cand->step_down(tok_type, out.branched_down);
+			cand->step_up(tok_type, out.branched_up);
 		}
 	}
+}
 
 #if !PROFILING
-	fprintf(stderr, "Branched down to %i:\n", (int)branched_down.size());
-	PrintCandidates(branched_down);
-	fprintf(stderr, "Branched up to %i:\n", (int)branched_up.size());
-	PrintCandidates(branched_up);
+// Prints one of the branched lists of the runs as a single list
+void PrintBranched(char const* direction, vector<ConsumeBuffers> const&runs,
+				   unsigned n_runs, CandidateVector ConsumeBuffers::*branched) {
+	size_t n_branched = 0;
+	for(unsigned ri=0;ri<n_runs;++ri) {
+		n_branched += (runs[ri].*branched).size();
+	}
+	fprintf(stderr, "Branched %s to %i:\n", direction, (int)n_branched);
+	for(unsigned ri=0;ri<n_runs;++ri) {
+		PrintCandidates(runs[ri].*branched);
+	}
+}
 #endif
-	for(Candidate &branched_cand : branched_down) {
-		if(branched_cand.consume(tok, token_index, lineno)) {
-			candidates.push_back(branched_cand);
-		} else {
-			assert(!"Successors should always be able to consume the next token");
+
+// Steps the frontier over the next token. Returns false if a candidate
+//  failed a validation check, which empties candidates as the parse is
+//  broken, see SetValidation().
+bool ConsumeToken(LexedRecord const&lexed, unsigned token_index,
+				  CandidateVector &candidates) {
+
+	RecordLexedToken(lexed, token_index);
+	const TokenType tok_type = lexed.type;
+
+	// Double buffered: the frontier moves to prev_candidates, and the new
+	//  one is built in the storage the one before it used
+	CandidateVector &prev_candidates = sConsumeScratch.prev_candidates;
+	prev_candidates.swap(candidates);
+	EmptyKeepingStorage(candidates);
+
+	const unsigned n_prev = prev_candidates.size();
+
+	ParseSession &session = CurrentSession();
+
+	// Only the first n_runs are used this token, the rest keep their storage
+	vector<ConsumeBuffers> &runs = sConsumeScratch.runs;
+	unsigned n_runs = 1;
+	if(session.consume_pool && (n_prev >= sParallelFrontierMin)) {
+		n_runs = (n_prev + sParallelChunkLen - 1) / sParallelChunkLen;
+	}
+	if(runs.size() < n_runs) {
+		runs.resize(n_runs);
+	}
+
+#if PROFILING
+	const bool consume_branched = true;
+#else
+	// Traced before they consume, so left to do after all the runs
+	const bool consume_branched = false;
+#endif
+
+	if(n_runs > 1) {
+		// The pool can be shared, so its threads take the session along
+		session.consume_pool->ParallelFor(n_runs, [&](unsigned ri) {
+			ParseSession::Scope scope(session);
+			Candidate *first = prev_candidates.data() + ri * sParallelChunkLen;
+			Candidate *last = prev_candidates.data() + std::min(n_prev, (ri+1) * sParallelChunkLen);
+			ExpandFrontier(tok_type, token_index, first, last, runs[ri]);
+			if(consume_branched) {
+				ConsumeBranched(tok_type, token_index, runs[ri].branched_down);
+				ConsumeBranched(tok_type, token_index, runs[ri].branched_up);
+			}
+		});
+	} else {
+		ExpandFrontier(tok_type, token_index,
+			prev_candidates.data(), prev_candidates.data() + n_prev, runs[0]);
+		if(consume_branched) {
+			ConsumeBranched(tok_type, token_index, runs[0].branched_down);
+			ConsumeBranched(tok_type, token_index, runs[0].branched_up);
 		}
 	}
-	for(Candidate &branched_cand : branched_up) {
-		if(branched_cand.consume(tok, token_index, lineno)) {
-			candidates.push_back(branched_cand);
-		} else {
-			assert(!"Successors should always be able to consume the next token");
+
+#if !PROFILING
+	PrintBranched("down", runs, n_runs, &ConsumeBuffers::branched_down);
+	PrintBranched("up", runs, n_runs, &ConsumeBuffers::branched_up);
+	for(unsigned ri=0;ri<n_runs;++ri) {
+		ConsumeBranched(tok_type, token_index, runs[ri].branched_down);
+		ConsumeBranched(tok_type, token_index, runs[ri].branched_up);
+	}
+#endif
+
+	for(unsigned ri=0;ri<n_runs;++ri) {
+		ConsumeBuffers const&run = runs[ri];
+		candidates.insert(candidates.end(), run.consumed.begin(), run.consumed.end());
+	}
+	for(unsigned ri=0;ri<n_runs;++ri) {
+		ConsumeBuffers const&run = runs[ri];
+		candidates.insert(candidates.end(), run.branched_down.begin(), run.branched_down.end());
+	}
+	for(unsigned ri=0;ri<n_runs;++ri) {
+		ConsumeBuffers const&run = runs[ri];
+		candidates.insert(candidates.end(), run.branched_up.begin(), run.branched_up.end());
+	}
+
+	// Emptied now rather than at the next token, so the old frontier's
+	//  nodes aren't held on to
+	EmptyKeepingStorage(prev_candidates);
+	for(unsigned ri=0;ri<n_runs;++ri) {
+		EmptyKeepingStorage(runs[ri].consumed);
+		EmptyKeepingStorage(runs[ri].branched_down);
+		EmptyKeepingStorage(runs[ri].branched_up);
+	}
+
+	// A candidate which fails a check fails the parse, as in SyntaxTree
+	if(session.validation.Cheap()) {
+		const bool full = session.validation.FullAt(token_index);
+		for(Candidate const&cand : candidates) {
+			if(!cand.is_sane_cheap() || (full && !cand.is_sane())) {
+				fprintf(stderr, "Internal consistency failure at token %u\n", token_index);
+				EmptyKeepingStorage(candidates);
+				return false;
+			}
 		}
 	}
+	return true;
 }
 
+bool ConsumeToken(Token tok, unsigned token_index, int lineno,
+				  CandidateVector &candidates) {
+	return ConsumeToken(LexedRecord::Interned(tok, lineno), token_index, candidates);
+}
+
+// Builds the shared tables, once before any parse
 void SetupParser() {
 	const double start_create_step_downs_time = doubletime();
 	CreateStepDowns();
@@ -918,6 +1555,8 @@ void SetupParser() {
 	CreateStepUps();
 	const double end_create_step_ups_time = doubletime();
 
+	sSharedTokensFrozen = true;
+
 
 	fprintf(stderr, "Time to generate step-downs %fms step-ups %fms\n", 
 		1000.0*(end_create_step_downs_time - start_create_step_downs_time),
@@ -925,6 +1564,7 @@ void SetupParser() {
 
 	fprintf(stderr, "Step downs count: %i\n", (int)sStepDownMap.size());
 	fprintf(stderr, "Step ups count: %i\n", (int)sStepUpMap.size());
+	fprintf(stderr, "Node size: %i bytes\n", (int)sizeof(Node));
 #if SHOW_STEP_DOWNS
 	fprintf(stderr, "------ step downs -----\n");
 	for(auto const&step_down_val : sStepDownMap) {
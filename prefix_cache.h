@@ -0,0 +1,262 @@
+
+#ifndef PREFIX_CACHE_H
+#define PREFIX_CACHE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+
+#include "parser.h"
+
+namespace parser {
+
+// Saved frontiers for token prefixes shared between the files of a batch,
+//  like a common include block at the head of every preprocessed file.
+// Candidates are immutable, so the frontier after a prefix can be kept and
+//  handed to any later file which starts with the same tokens.
+// Prefixes are cut into blocks of block_len tokens. Each trie level is one
+//  block, keyed by a hash of its token types and texts, and the block's
+//  types and texts are kept to rule out hash collisions. Nothing is
+//  interned, as ItemCache::HashLexed().
+// Files can be parsed in separate ParseSessions. A snapshot's child arrays
+//  are copied into an arena of its own, which a restored session adopts,
+//  rather than keeping every array the snapshot's session allocated.
+// A file's own tail is of no use to anyone else, so a prefix is only
+//  snapshot once a second file has reached it. Trie nodes are added up to
+//  max_nodes and snapshots up to max_snapshots.
+struct PrefixCache {
+	PrefixCache(unsigned block_len, size_t max_snapshots, size_t max_nodes)
+	  : block_len_(block_len), max_snapshots_(max_snapshots), max_nodes_(max_nodes),
+	  	n_snapshots_(0), n_nodes_(0), n_files_(0), n_hits_(0), n_tokens_(0), n_skipped_(0) {
+		assert(block_len_ > 0);
+	}
+
+	unsigned block_len()const {
+		return block_len_;
+	}
+
+	struct TrieNode;
+
+	// Where a file's Save() calls have got to, so each call only walks the
+	//  blocks since the last one. Set by Restore().
+	struct Cursor {
+		Cursor() : node(0), pos(0) { }
+
+		// 0 once the file can't save anything more
+		TrieNode *node;
+		unsigned pos;
+	};
+
+	// Sets frontier to the state after the longest saved prefix of tokens,
+	//  and cursor to the end of that prefix.
+	// Returns the prefix length, or 0 if nothing matched and frontier is untouched.
+	unsigned Restore(vector<LexedRecord> const&tokens, CandidateVector &frontier,
+					 Cursor &cursor) {
+		++n_files_;
+		n_tokens_ += tokens.size();
+
+		cursor.node = &root_;
+		cursor.pos = 0;
+
+		TrieNode *node = &root_;
+		unsigned pos = 0;
+		while((pos + block_len_) <= tokens.size()) {
+			node = node->Find(BlockKey(tokens, pos), block_key_);
+			if(!node) {
+				break;
+			}
+			pos += block_len_;
+			if(node->has_frontier) {
+				cursor.node = node;
+				cursor.pos = pos;
+			}
+		}
+
+		if(cursor.pos == 0) {
+			return 0;
+		}
+		++n_hits_;
+		n_skipped_ += cursor.pos;
+		frontier = cursor.node->frontier;
+		CurrentSession().child_arena->Adopt(cursor.node->arena);
+		return cursor.pos;
+	}
+
+	// Saves the frontier after tokens[0, n_tokens), where n_tokens is the
+	//  cursor's position plus block_len.
+	void Save(Cursor &cursor, vector<LexedRecord> const&tokens, unsigned n_tokens,
+			  CandidateVector const&frontier) {
+		if(!cursor.node) {
+			return;
+		}
+		assert(n_tokens == (cursor.pos + block_len_));
+		assert(n_tokens <= tokens.size());
+
+		const uint64_t hash = BlockKey(tokens, cursor.pos);
+		TrieNode *child = cursor.node->Find(hash, block_key_);
+		if(child) {
+			++child->n_visits;
+		} else {
+			if(n_nodes_ >= max_nodes_) {
+				cursor.node = 0;
+				return;
+			}
+			child = cursor.node->Add(hash, block_key_);
+			++n_nodes_;
+		}
+		cursor.node = child;
+		cursor.pos = n_tokens;
+
+		if(!child->has_frontier && (child->n_visits >= 2) && (n_snapshots_ < max_snapshots_)) {
+			child->has_frontier = true;
+			child->arena.reset(new ChildArena);
+			CopyFrontier(frontier, child->arena, child->frontier);
+			++n_snapshots_;
+		}
+	}
+
+	void PrintStats()const {
+		fprintf(stderr, "Prefix cache: %i / %i files restored, %llu / %llu tokens skipped (%.1f%%), %i snapshots of %llu bytes, %i blocks\n",
+			(int)n_hits_, (int)n_files_, n_skipped_, n_tokens_,
+			n_tokens_ ? (100.0 * n_skipped_ / n_tokens_) : 0.0, (int)n_snapshots_,
+			(unsigned long long)snapshot_bytes(), (int)n_nodes_);
+	}
+
+	struct TrieNode {
+		TrieNode()
+		  : n_visits(1), has_frontier(false) {
+		}
+
+		TrieNode *Find(uint64_t hash, string const&key) {
+			const auto found = children.find(hash);
+			if((found == children.end()) || (found->second->key != key)) {
+				return 0;
+			}
+			return found->second.get();
+		}
+
+		// On a hash collision the newer block replaces the older subtree
+		TrieNode *Add(uint64_t hash, string const&key) {
+			unique_ptr<TrieNode> &child = children[hash];
+			child.reset(new TrieNode);
+			child->key = key;
+			return child.get();
+		}
+
+		// The block's token types and texts, see AppendLexedKey()
+		string key;
+		// Files which reached the end of this block
+		unsigned n_visits;
+		bool has_frontier;
+		CandidateVector frontier;
+		// Holds frontier's child arrays, and nothing else
+		shared_ptr<ChildArena> arena;
+		absl::flat_hash_map<uint64_t, unique_ptr<TrieNode> > children;
+	};
+
+	size_t n_snapshots()const {
+		return n_snapshots_;
+	}
+
+	size_t n_nodes()const {
+		return n_nodes_;
+	}
+
+	// Child array bytes the snapshots keep alive
+	size_t snapshot_bytes()const {
+		absl::flat_hash_set<ChildArena const*> arenas;
+		return ArenaBytes(root_, arenas);
+	}
+
+  private:
+	// Bytes of the arenas under node which aren't in arenas yet
+	static size_t ArenaBytes(TrieNode const&node, absl::flat_hash_set<ChildArena const*> &arenas) {
+		size_t ret = 0;
+		if(node.arena && arenas.insert(node.arena.get()).second) {
+			ret += node.arena->bytes_used();
+		}
+		for(auto const&child : node.children) {
+			ret += ArenaBytes(*child.second, arenas);
+		}
+		return ret;
+	}
+
+	// Copies frontier into copy with its child arrays in arena.
+	// Candidates share most of their nodes, and so do the frontiers of one
+	//  session, so each array is copied once per session. Later snapshots
+	//  keep the arenas of earlier ones they share arrays with.
+	void CopyFrontier(CandidateVector const&frontier, shared_ptr<ChildArena> const&arena,
+					  CandidateVector &copy) {
+		shared_ptr<ChildArena> const&session_arena = CurrentSession().child_arena;
+		if(copied_from_.lock() != session_arena) {
+			copied_.clear();
+			copied_from_ = session_arena;
+			last_arena_.reset();
+		}
+		arena->Adopt(last_arena_);
+		last_arena_ = arena;
+
+		copy = frontier;
+		for(Candidate &cand : copy) {
+			for(unsigned nid=NodeId_Top;nid<cand.next_node_id;++nid) {
+				Node::ParsedTokens const&parsed = cand.get_node(NodeId(nid)).parsed_tokens;
+				if(parsed.size() == 0) {
+					continue;
+				}
+				uint32_t const*&handles = copied_[parsed.handles];
+				if(!handles) {
+					uint32_t *next = arena->allocate(parsed.size());
+					std::copy(parsed.handles, parsed.handles + parsed.size(), next);
+					handles = next;
+				}
+				cand.nodes_by_id = cand.nodes_by_id.update(NodeId(nid), [&](Node node) {
+					node.parsed_tokens.handles = handles;
+					return node;
+				});
+			}
+		}
+	}
+
+	// Sets block_key_ to the types and texts of block_len tokens from first,
+	//  see AppendLexedKey(), and returns its hash
+	uint64_t BlockKey(vector<LexedRecord> const&tokens, unsigned first) {
+		block_key_.clear();
+		for(unsigned ti=first;ti<(first+block_len_);++ti) {
+			AppendLexedKey(block_key_, tokens[ti]);
+		}
+
+		uint64_t h = 14695981039346656037ull;
+		for(char c : block_key_) {
+			h = (h ^ (unsigned char)c) * 1099511628211ull;
+		}
+		return h;
+	}
+
+	const unsigned block_len_;
+	const size_t max_snapshots_;
+	const size_t max_nodes_;
+	TrieNode root_;
+
+	// Scratch for BlockKey(), kept so lookups don't allocate
+	string block_key_;
+	// For CopyFrontier(), the copies of copied_from_'s child arrays so far,
+	//  the latest of which are in last_arena_
+	absl::flat_hash_map<uint32_t const*, uint32_t const*> copied_;
+	weak_ptr<ChildArena> copied_from_;
+	shared_ptr<ChildArena> last_arena_;
+
+	size_t n_snapshots_;
+	size_t n_nodes_;
+	size_t n_files_;
+	size_t n_hits_;
+	unsigned long long n_tokens_;
+	unsigned long long n_skipped_;
+};
+
+}  // namespace parser
+
+#endif//PREFIX_CACHE_H
@@ -0,0 +1,175 @@
+
+
+#include "gtest/gtest.h"
+#include "parser.h"
+#include "flex_scanner.h"
+#include "prefix_cache.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace parser;
+
+namespace {
+
+void SetupOnce() {
+	static bool done = false;
+	if(!done) {
+		SetupParser();
+		done = true;
+	}
+}
+
+vector<LexedRecord> Lex(std::string const&input) {
+	vector<LexedRecord> tokens;
+	FILE* in = ::fmemopen(const_cast<char*>(input.data()), input.size(), "rb");
+	{
+		FlexScanner scanner(in);
+		for(Token tok = scanner.Next();tok != 0;tok = scanner.Next()) {
+			tokens.push_back(LexedRecord::Interned(tok, scanner.lineno()));
+		}
+	}
+	fclose(in);
+	return tokens;
+}
+
+// Ambiguous, so the saved frontiers are more than one candidate wide
+const std::string kPrefix = "1 - 2 +3 - 4 +5 - 6 +2 +2 +2 +2 +2 +2 +2 +2";
+const unsigned kBlockLen = 4;
+
+// Parses input as the parse binary does: from the longest prefix in cache,
+//  saving the frontier after every block. Uses a session of its own unless
+//  given one.
+// Returns the final candidates, and sets restored to the prefix length.
+std::vector<std::string> ParseFile(PrefixCache *cache, std::string const&input,
+								   unsigned *restored = nullptr,
+								   ParseSession *session = nullptr) {
+	ParseSession own_session;
+	ParseSession::Scope scope(session ? *session : own_session);
+	const vector<LexedRecord> tokens = Lex(input);
+
+	vector<Rule> const&top_rules = GetRulesForTokenName(GetTokenInstName("top", ""));
+	CandidateVector candidates;
+	Candidate top_cand;
+	top_cand.add_node(Node(top_rules[0], NodeId_Null));
+	candidates.push_back(top_cand);
+
+	unsigned first_token = 0;
+	PrefixCache::Cursor cursor;
+	if(cache) {
+		first_token = cache->Restore(tokens, candidates, cursor);
+		for(unsigned ti=0;ti<first_token;++ti) {
+			RecordLexedToken(tokens[ti], ti);
+		}
+	}
+	if(restored) {
+		*restored = first_token;
+	}
+
+	for(unsigned ti=first_token;ti<tokens.size();++ti) {
+		EXPECT_TRUE(ConsumeToken(tokens[ti], ti, candidates));
+		if(cache && (((ti+1) % cache->block_len()) == 0)) {
+			cache->Save(cursor, tokens, ti+1, candidates);
+		}
+	}
+
+	std::vector<std::string> ret;
+	for(Candidate const&cand : candidates) {
+		ret.push_back(cand.ToString());
+	}
+	return ret;
+}
+
+TEST(PrefixCacheTest, SnapshotsOnSecondVisit) {
+	SetupOnce();
+	PrefixCache cache(kBlockLen, 64, 64);
+
+	unsigned restored = 0;
+	ParseFile(&cache, kPrefix + " +3", &restored);
+	EXPECT_EQ(0u, restored);
+	EXPECT_EQ(0u, cache.n_snapshots());
+	const size_t n_blocks = cache.n_nodes();
+	EXPECT_EQ(Lex(kPrefix + " +3").size() / kBlockLen, n_blocks);
+
+	// Nothing to restore yet, but the shared blocks are snapshot now
+	ParseFile(&cache, kPrefix + " - 7", &restored);
+	EXPECT_EQ(0u, restored);
+	const size_t n_shared = Lex(kPrefix).size() / kBlockLen;
+	EXPECT_EQ(n_shared, cache.n_snapshots());
+
+	ParseFile(&cache, kPrefix + " +5 - 6", &restored);
+	EXPECT_EQ(n_shared * kBlockLen, restored);
+}
+
+TEST(PrefixCacheTest, RestoredParseMatchesCold) {
+	SetupOnce();
+	PrefixCache cache(kBlockLen, 64, 64);
+	ParseFile(&cache, kPrefix + " +3");
+	ParseFile(&cache, kPrefix + " - 7");
+
+	// The sessions the snapshots were taken in are gone by now
+	const std::string input = kPrefix + " +5 - 6 +7";
+	unsigned restored = 0;
+	const std::vector<std::string> warm = ParseFile(&cache, input, &restored);
+	EXPECT_LT(0u, restored);
+	const std::vector<std::string> cold = ParseFile(nullptr, input);
+	EXPECT_LT(1u, cold.size());
+	EXPECT_EQ(cold, warm);
+}
+
+TEST(PrefixCacheTest, SnapshotsOnlyKeepTheirFrontiers) {
+	SetupOnce();
+	PrefixCache cache(kBlockLen, 64, 64);
+	ParseFile(&cache, kPrefix + " +3");
+
+	ParseSession session;
+	ParseFile(&cache, kPrefix + " - 7", nullptr, &session);
+	ASSERT_LT(0u, cache.n_snapshots());
+
+	// The session's arena also has every array its discarded candidates
+	//  and partial nodes used
+	EXPECT_LT(0u, cache.snapshot_bytes());
+	EXPECT_GT(session.child_arena->bytes_used(), cache.snapshot_bytes());
+}
+
+TEST(PrefixCacheTest, Caps) {
+	SetupOnce();
+	const std::vector<std::string> inputs = {
+		kPrefix + " +3", kPrefix + " - 7", kPrefix + " +5 - 6"};
+
+	PrefixCache few_snapshots(kBlockLen, 2, 64);
+	for(std::string const&input : inputs) {
+		ParseFile(&few_snapshots, input);
+	}
+	EXPECT_EQ(2u, few_snapshots.n_snapshots());
+	unsigned restored = 0;
+	ParseFile(&few_snapshots, inputs[0], &restored);
+	EXPECT_EQ(2*kBlockLen, restored);
+
+	PrefixCache few_nodes(kBlockLen, 64, 3);
+	for(std::string const&input : inputs) {
+		ParseFile(&few_nodes, input);
+	}
+	EXPECT_EQ(3u, few_nodes.n_nodes());
+	EXPECT_EQ(3u, few_nodes.n_snapshots());
+	ParseFile(&few_nodes, inputs[0], &restored);
+	EXPECT_EQ(3*kBlockLen, restored);
+}
+
+TEST(PrefixCacheTest, BlockCollisions) {
+	PrefixCache::TrieNode root;
+	PrefixCache::TrieNode *first = root.Add(7, "first");
+	EXPECT_EQ(first, root.Find(7, "first"));
+
+	// Same hash, other tokens
+	EXPECT_EQ(nullptr, root.Find(7, "second"));
+
+	// The newer block replaces the older one
+	PrefixCache::TrieNode *second = root.Add(7, "second");
+	EXPECT_EQ(second, root.Find(7, "second"));
+	EXPECT_EQ(nullptr, root.Find(7, "first"));
+	EXPECT_EQ(1u, root.children.size());
+}
+
+}  // namespace
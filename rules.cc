@@ -98,8 +98,8 @@ map<Token, TokenInstanceKey> sTokenInstanceKeys;
 
 
 
-Token GetTokenInstName(const char*type_str, const char*content) {
-	TokenInstanceKey key(GetTokenTypeId(type_str), content);
+Token GetTokenInstName(TokenType type, string const&content) {
+	TokenInstanceKey key(type, content);
 	const auto found = sTokenInstanceIds.find(key);
 	if(found != sTokenInstanceIds.end()) {
 		return found->second;
@@ -111,6 +111,10 @@ Token GetTokenInstName(const char*type_str, const char*content) {
 	}
 }
 
+Token GetTokenInstName(const char*type_str, const char*content) {
+	return GetTokenInstName(GetTokenTypeId(type_str), content);
+}
+
 string TokenToString(Token tok) {
 	assert(tok);
 	const string content = GetTokenInstContent(tok);
@@ -131,6 +135,11 @@ extern "C" Token LexGetTokenInstName(const char*type_str, const char*content) {
 	return GetTokenInstName(type_str, content);
 }
 
+extern "C" Token LexGetTokenInstId(TokenType type, const char*content) {
+	assert((type > 0) && (type < sLexicalTokenTypes.size()));
+	return GetTokenInstName(type, content);
+}
+
 const char*GetTokenTypeName(TokenType t) {
 	assert(t < sTokenTypes.size());
 	return sTokenTypes[t].c_str();
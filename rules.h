@@ -59,8 +59,11 @@ std::vector<std::string> BuildTokenTypes();
 std::map<std::string, TokenType> BuildTokenTypeIds();
 TokenType GetTokenTypeId(const char*type);
 const char* GetRuleName(RuleName name);
+Token GetTokenInstName(TokenType type, std::string const&content);
 Token GetTokenInstName(const char*type_str, const char*content="");
 extern "C" Token LexGetTokenInstName(const char*type_str, const char*content);
+// What the generated lex actions call, with the ids from grammar.h
+extern "C" Token LexGetTokenInstId(TokenType type, const char*content);
 const char*GetTokenTypeName(TokenType t);
 const char*GetTokenInstContent(Token t);
 const TokenType GetTokenInstType(Token t);
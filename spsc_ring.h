@@ -0,0 +1,187 @@
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// A bounded lock-free ring between one producer thread and one consumer
+//  thread, like a lexer handing tokens to a parser.
+// Items are moved in batches, so the two threads touch the shared indices
+//  once per batch rather than once per item. Each side keeps a copy of the
+//  other side's index and only reloads it when it looks full or empty.
+// A full ring makes Push() wait, which holds the producer back to the pace
+//  of the consumer. Waiting yields rather than blocks, and the time each
+//  side spends waiting is counted.
+// The producer ends the stream with Close(). The consumer can give up early
+//  with Cancel(), after which Push() returns false.
+template<typename T>
+class SpscRing {
+  public:
+	// capacity is rounded up to a power of 2
+	explicit SpscRing(size_t capacity)
+	  : slots_(RoundUpPow2(std::max<size_t>(capacity, 2))), mask_(slots_.size() - 1),
+	  	tail_(0), head_cache_(0), closed_(false), push_idle_ns_(0), push_waits_(0),
+	  	head_(0), tail_cache_(0), cancelled_(false), pop_idle_ns_(0), pop_waits_(0) {
+	}
+
+	SpscRing(SpscRing const&) = delete;
+	SpscRing& operator=(SpscRing const&) = delete;
+
+	size_t capacity()const {
+		return slots_.size();
+	}
+
+	// ---- Producer ----
+
+	// Copies in all n items, waiting for room. False if the consumer has
+	//  cancelled, in which case some may not have been added.
+	bool Push(T const* items, size_t n) {
+		IdleTimer idle(push_idle_ns_, push_waits_);
+		const size_t tail = tail_.load(std::memory_order_relaxed);
+		size_t pushed = 0;
+		while(pushed < n) {
+			if(cancelled_.load(std::memory_order_relaxed)) {
+				break;
+			}
+			size_t room = capacity() - (tail + pushed - head_cache_);
+			if(room == 0) {
+				head_cache_ = head_.load(std::memory_order_acquire);
+				room = capacity() - (tail + pushed - head_cache_);
+				if(room == 0) {
+					idle.Wait();
+					continue;
+				}
+			}
+			const size_t k = std::min(room, n - pushed);
+			for(size_t i=0;i<k;++i) {
+				slots_[(tail + pushed + i) & mask_] = items[pushed + i];
+			}
+			pushed += k;
+			tail_.store(tail + pushed, std::memory_order_release);
+		}
+		return !cancelled_.load(std::memory_order_acquire);
+	}
+
+	// No more items, Pop() returns 0 once the rest are taken
+	void Close() {
+		closed_.store(true, std::memory_order_release);
+	}
+
+	// Time Push() spent waiting on a full ring, and how many times it did.
+	// Only read them once the producer is done.
+	uint64_t push_idle_ns()const {
+		return push_idle_ns_;
+	}
+
+	uint64_t push_waits()const {
+		return push_waits_;
+	}
+
+	// ---- Consumer ----
+
+	// Copies out up to max items, waiting while the ring is empty.
+	// 0 when it is closed and empty.
+	size_t Pop(T* items, size_t max) {
+		IdleTimer idle(pop_idle_ns_, pop_waits_);
+		const size_t head = head_.load(std::memory_order_relaxed);
+		for(;;) {
+			size_t avail = tail_cache_ - head;
+			if(avail == 0) {
+				// Closed first, so the tail read after it is the last one
+				const bool closed = closed_.load(std::memory_order_acquire);
+				tail_cache_ = tail_.load(std::memory_order_acquire);
+				avail = tail_cache_ - head;
+				if(avail == 0) {
+					if(closed) {
+						return 0;
+					}
+					idle.Wait();
+					continue;
+				}
+			}
+			const size_t k = std::min(avail, max);
+			for(size_t i=0;i<k;++i) {
+				items[i] = slots_[(head + i) & mask_];
+			}
+			head_.store(head + k, std::memory_order_release);
+			return k;
+		}
+	}
+
+	// Stops the producer, for a consumer which won't take any more
+	void Cancel() {
+		cancelled_.store(true, std::memory_order_release);
+	}
+
+	// Time Pop() spent waiting on an empty ring, and how many times it did
+	uint64_t pop_idle_ns()const {
+		return pop_idle_ns_;
+	}
+
+	uint64_t pop_waits()const {
+		return pop_waits_;
+	}
+
+  private:
+	static size_t RoundUpPow2(size_t n) {
+		size_t ret = 1;
+		while(ret < n) {
+			ret <<= 1;
+		}
+		return ret;
+	}
+
+	// Counts one wait from the first Wait() to the end of the call
+	struct IdleTimer {
+		IdleTimer(uint64_t &idle_ns, uint64_t &waits)
+		  : idle_ns(idle_ns), waits(waits), waiting(false) {
+		}
+
+		~IdleTimer() {
+			if(waiting) {
+				idle_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - start).count();
+				++waits;
+			}
+		}
+
+		void Wait() {
+			if(!waiting) {
+				waiting = true;
+				start = std::chrono::steady_clock::now();
+			}
+			std::this_thread::yield();
+		}
+
+		uint64_t &idle_ns;
+		uint64_t &waits;
+		bool waiting;
+		std::chrono::steady_clock::time_point start;
+	};
+
+	std::vector<T> slots_;
+	const size_t mask_;
+
+	// Producer side, on its own cache line
+	alignas(64) std::atomic<size_t> tail_;
+	size_t head_cache_;
+	std::atomic<bool> closed_;
+	uint64_t push_idle_ns_;
+	uint64_t push_waits_;
+
+	// Consumer side
+	alignas(64) std::atomic<size_t> head_;
+	size_t tail_cache_;
+	std::atomic<bool> cancelled_;
+	uint64_t pop_idle_ns_;
+	uint64_t pop_waits_;
+};
+
+#endif//SPSC_RING_H
@@ -0,0 +1,90 @@
+
+
+#include "gtest/gtest.h"
+#include "spsc_ring.h"
+
+#include <thread>
+#include <vector>
+
+namespace {
+
+TEST(SpscRingTest, Capacity) {
+	EXPECT_EQ(2u, SpscRing<int>(0).capacity());
+	EXPECT_EQ(8u, SpscRing<int>(8).capacity());
+	EXPECT_EQ(16u, SpscRing<int>(9).capacity());
+}
+
+TEST(SpscRingTest, SingleThread) {
+	SpscRing<int> ring(8);
+	const int in[5] = {1, 2, 3, 4, 5};
+	EXPECT_TRUE(ring.Push(in, 5));
+	ring.Close();
+
+	int out[8];
+	ASSERT_EQ(3u, ring.Pop(out, 3));
+	EXPECT_EQ(1, out[0]);
+	EXPECT_EQ(3, out[2]);
+	ASSERT_EQ(2u, ring.Pop(out, 8));
+	EXPECT_EQ(4, out[0]);
+	EXPECT_EQ(5, out[1]);
+	// Closed and drained
+	EXPECT_EQ(0u, ring.Pop(out, 8));
+	EXPECT_EQ(0u, ring.Pop(out, 8));
+}
+
+TEST(SpscRingTest, InOrderAcrossThreads) {
+	// Small ring and odd batch sizes, so the producer often waits on a full
+	//  ring and the indices wrap many times
+	SpscRing<unsigned> ring(16);
+	const unsigned n = 100000;
+	std::thread producer([&]() {
+		std::vector<unsigned> batch;
+		for(unsigned i=0;i<n;) {
+			batch.clear();
+			for(unsigned bi=0;(bi<37) && (i<n);++bi) {
+				batch.push_back(i++);
+			}
+			EXPECT_TRUE(ring.Push(batch.data(), batch.size()));
+		}
+		ring.Close();
+	});
+
+	std::vector<unsigned> got;
+	unsigned out[7];
+	for(size_t k = ring.Pop(out, 7);k > 0;k = ring.Pop(out, 7)) {
+		got.insert(got.end(), out, out + k);
+	}
+	producer.join();
+
+	ASSERT_EQ(n, got.size());
+	for(unsigned i=0;i<n;++i) {
+		ASSERT_EQ(i, got[i]);
+	}
+	// It can't have got through 100000 items 16 at a time without waiting
+	EXPECT_GT(ring.push_waits() + ring.pop_waits(), 0u);
+}
+
+TEST(SpscRingTest, CancelStopsProducer) {
+	SpscRing<int> ring(4);
+	bool pushed_all = true;
+	std::thread producer([&]() {
+		std::vector<int> batch(3, 1);
+		// Fills the ring and waits, until cancelled
+		for(int i=0;i<1000;++i) {
+			if(!ring.Push(batch.data(), batch.size())) {
+				pushed_all = false;
+				break;
+			}
+		}
+		ring.Close();
+	});
+
+	int out[2];
+	EXPECT_EQ(2u, ring.Pop(out, 2));
+	ring.Cancel();
+	producer.join();
+	EXPECT_FALSE(pushed_all);
+	EXPECT_FALSE(ring.Push(out, 1));
+}
+
+}  // namespace
@@ -2,6 +2,8 @@
 #include "syntax_tree.h"
 #include <sstream>
 #include <cassert>
+#include <cstdint>
+#include <algorithm>
 
 #include <boost/range/adaptor/reversed.hpp>
 
@@ -9,16 +11,28 @@ using namespace std;
 
 namespace parser {
 
+// Check the incremental completion state against a full walk of the subtree
+#define CHECK_COMPLETE_SLOW 0
+// Dumps of the tree around each token, which cost more than the parse
+#define PRINT_TREES 0
+
 static size_t sInitialNodesAlloc = 1024;
-static size_t sNodesAlign = 32;
 
 SyntaxTree::SyntaxTree()
-	: node_array_(sInitialNodesAlloc, sNodesAlign) {
+	: reclaim_at_(sInitialNodesAlloc),
+	  live_mark_(0),
+	  by_span_(0, SpanHash{this}, SpanEq{this}) {
 }
 
 bool SyntaxTree::Init(char const* top_rule_name) {
-	assert(work_ptrs_.size() == 0);
-	assert(node_array_.size() == 0);
+	// A tree can be reused for another parse, keeping the memory of its nodes
+	work_ptrs_.clear();
+	step_up_ptrs_.clear();
+	step_up_copies_.clear();
+	moved_up_.clear();
+	node_array_.reset();
+	token_array_.clear();
+	reclaim_at_ = sInitialNodesAlloc;
 
 	Token top_tok = parser::GetTokenInstName(top_rule_name);
 	if (top_tok == 0) {
@@ -33,19 +47,21 @@ bool SyntaxTree::Init(char const* top_rule_name) {
 	}
 
 	Node* new_node = AddNode(top_rules[0]);
+	new_node->start_idx = 1;
+	assert(HandleOf(new_node) == 0);
 
-	work_ptrs_.insert(new_node);
+	work_ptrs_.insert(HandleOf(new_node));
 	// Top rule can't be a step-up (rules.size() == 1)
 
 	return true;
 }
 
 bool SyntaxTree::CanComplete()const {
-	return CanComplete(GetTop());
+	return CountParses() > 0;
 }
 
 bool SyntaxTree::FullyComplete()const {
-	return CheckComplete_slow(GetTop());
+	return IsComplete(GetTop());
 }
 
 Node *SyntaxTree::GetTop()const {
@@ -53,7 +69,7 @@ Node *SyntaxTree::GetTop()const {
 	if(node_array_.size() == 0) {
 		return 0;
 	}
-	return node_array_.get_first();
+	return GetNode(0);
 }
 
 Token SyntaxTree::NextTokenInPattern(Node const*node)const {
@@ -62,23 +78,6 @@ Token SyntaxTree::NextTokenInPattern(Node const*node)const {
 }
 
 
-bool SyntaxTree::NodeContainsWorkPtr_slow(Node *n)const {
-	if(work_ptrs_.contains(n)) {
-		return true;
-	}
-
-//	if(n->parsed.size() > 0) {
-	for(ParsedSlot const&slot : n->parsed) {
-		for(Node *sn : slot.subs) {
-			if(NodeContainsWorkPtr_slow(sn)) {
-				return true;
-			}
-		}
-	}
-	return false;
-}
-
-
 bool SyntaxTree::ConsumeInNode(Node* incomplete,
 							   TokenType next_tok_type,
 							   LexedTokenIdx lexed_idx) {
@@ -94,6 +93,7 @@ bool SyntaxTree::ConsumeInNode(Node* incomplete,
 
 //	incomplete->parsed.emplace_back(std::move(ParsedSlot(lexed_idx)));
 	incomplete->AddParsed(lexed_idx);
+	CompletionChanged(incomplete, false);
 
 
 	return true;
@@ -105,7 +105,7 @@ void SyntaxTree::UpdateWorkPtr(Node* incomplete) {
 		MarkCompleteAndMoveUp(incomplete);
 	} else {
 		// Continue working on this node
-		work_ptrs_.insert(incomplete);
+		work_ptrs_.insert(HandleOf(incomplete));
 	}
 }
 
@@ -116,7 +116,9 @@ bool SyntaxTree::ConsumeToken(LexedToken const&next) {
 
 	assert(node_array_.size() > 0);
 
+#if PRINT_TREES
 	fprintf(stderr, "--- consume %s ---\n", TokenToString(next.tok).c_str());
+#endif
 /*
 fprintf(stderr, "ConsumeToken tree:\n%s\n", 
 	ToString(0).c_str());
@@ -124,95 +126,61 @@ fprintf(stderr, "ConsumeToken tree:\n%s\n",
 
 	assert(TokenIsLexical(next.tok));
 
-// Step up needs to happen here?
-	{
-		const auto prev_work_ptrs(work_ptrs_);
-		for(Node* work_n : prev_work_ptrs) {
-			if(!IsComplete(work_n)) {
-				continue;
-			}
+	const TokenType next_tok_type = GetTokenInstType(next.tok);
 
-			fprintf(stderr, "== Try step up on %s (tok %s)\n", 
-				GetRuleName(work_n->rule.name),
-				TokenToString(next.tok).c_str());
-
-			// Step up then step down
-			for(Node* n = work_n;n && (n!=GetTop());n = n->parent) {
-				StepContext ctx;
-				ctx.lexed = GetTokenInstType(next.tok);
-				ctx.needed_rule = n->rule.token_name;
-
-				std::pair<StepUpMap::iterator, StepUpMap::iterator> found = GetStepUps(ctx);
-				if(found.first != found.second) {
-					Node* parent = n->parent;
-					assert(parent);
-					assert(parent->parsed.size());
-					ParsedSlot &parent_last_slot = parent->parsed.back();
-					parent_last_slot.subs.erase(n);
-					assert(work_ptrs_.contains(n));
-					work_ptrs_.erase(n);
-
-					for(StepUpMap::iterator it = found.first;
-						it != found.second;
-						++it) {
-						const StepUpAction& action = it->second;
-
-						assert(GetRuleByName(action.step_up_rule_id).token_name 
-								== GetRuleByName(n->rule.name).token_name);
-						assert(action.then_step_down.size() == 0);
-
-						fprintf(stderr, "======== Can step up on %s with rule %s stack %i\n", 
-								GetRuleName(n->rule.name),
-								GetRuleName(action.step_up_rule_id),
-								(int)action.then_step_down.size());
-
-						// shallow copy is safe because node is complete
-						Node* new_child = ShallowCopyNode(n);
-						work_ptrs_.insert(new_child);
-
-						Node* new_node = AddNode(GetRuleByName(action.step_up_rule_id));
-						new_node->AddParsed(new_child);
-
-						new_child->parent = new_node;
-						new_node->parent = parent;
-						parent_last_slot.subs.insert(new_node);
-					}
-					// TODO: Multi step up
-					break;
-				}
+	token_array_.push_back(next);
+	// Index from 1
+	const LexedTokenIdx lexed_idx = token_array_.size();
 
+	// Step up: a complete work ptr, and each ancestor with a full pattern up
+	//  to the first one which isn't, may become the first child of a node
+	//  which consumes next.
+	// The existing nodes stay where they are for the branch which doesn't step up.
+	{
+		stepped_up_.clear();
+		step_up_copies_.clear();
+		// StepUpFrom() adds work ptrs, go over the ones from before
+		prev_work_ptrs_ = work_ptrs_;
+		for(Node* work_n : Nodes(prev_work_ptrs_)) {
+			if(!IsComplete(work_n) || stepped_up_.contains(work_n)) {
+				continue;
 			}
+			stepped_up_[work_n] = work_n;
+			StepUpFrom(work_n, work_n, next_tok_type, lexed_idx, stepped_up_);
 		}
 	}
 
 	{
-		const auto prev_work_ptrs = std::move(work_ptrs_);
+		prev_work_ptrs_.clear();
+		prev_work_ptrs_.swap(work_ptrs_);
+		moved_up_.clear();
 
-		for(Node* n : prev_work_ptrs) {
+		for(Node* n : Nodes(prev_work_ptrs_)) {
+			// Dropped with a branch which was complete up to top
+			if(IsReleased(n)) {
+				continue;
+			}
 			UpdateWorkPtr(n);
 		}
 	}
 
-	const TokenType next_tok_type = GetTokenInstType(next.tok);
-
-	token_array_.push_back(next);
-	// Index from 1
-	const LexedTokenIdx lexed_idx = token_array_.size();
-
 	bool did_consume = false;
 
-	const auto prev_work_ptrs = std::move(work_ptrs_);
+	prev_work_ptrs_.clear();
+	prev_work_ptrs_.swap(work_ptrs_);
 
-	for(Node* incomplete : prev_work_ptrs) {
+	for(Node* incomplete : Nodes(prev_work_ptrs_)) {
 		assert(!IsComplete(incomplete));
 
+#if PRINT_TREES
 fprintf(stderr, "*** next work_ptr tree:\n%s\n", 
 	ToString(0, incomplete).c_str());
+#endif
 
 
 		if(ConsumeInNode(incomplete, next_tok_type, lexed_idx)) {
 //			UpdateWorkPtr(incomplete);
-			work_ptrs_.insert(incomplete);
+			work_ptrs_.insert(HandleOf(incomplete));
 			did_consume = true;
 			continue;
 		}
@@ -245,10 +213,9 @@ fprintf(stderr, "*** next work_ptr tree:\n%s\n",
 				StepDownStack const&stack = it->second;
 
 				Node* last_descendant;
-				Node* top_of_stack = BuildStepDownStack(stack, last_descendant);
+				Node* top_of_stack = BuildStepDownStack(stack, last_descendant, lexed_idx);
 
-				incomplete->parsed.back().subs.insert(top_of_stack);
-				top_of_stack->parent = incomplete;
+				InsertSub(incomplete, top_of_stack);
 
 				// Completion needs to happen as a separate step..
 				const bool ret = ConsumeInNode(last_descendant, next_tok_type, lexed_idx);
@@ -263,38 +230,64 @@ fprintf(stderr, "*** next work_ptr tree:\n%s\n",
 			}
 
 			for(Node* last_descendant : last_descendants) {
-				work_ptrs_.insert(last_descendant);
+				work_ptrs_.insert(HandleOf(last_descendant));
 			}
 
+		} else if(incomplete != GetTop()) {
+			// Nothing in the next rule can start with this token
+			DeleteNode(incomplete);
 		}
 
 
 	}
 
+	MergeWorkPtrs();
+
+	// Growing the threshold with what's left keeps the marking linear in the
+	//  number of nodes allocated. It grows faster when little was dead.
+	if(node_array_.size() >= reclaim_at_) {
+		const size_t n_before = node_array_.size();
+		const size_t n_dead = ReclaimNodes();
+		const size_t growth = (4*n_dead < n_before) ? 4 : 2;
+		reclaim_at_ = std::max(sInitialNodesAlloc, growth*node_array_.size());
+	}
+
+#if PRINT_TREES
 	fprintf(stderr, "\n>> After ConsumeToken (ptrs %i, complete %i):\n%s\n",
 		(int)work_ptrs_.size(), (int)IsComplete(GetTop()),
 		ToString(0).c_str());
 
-	for(Node *ptr : work_ptrs_) {
+	for(Node *ptr : Nodes(work_ptrs_)) {
 		fprintf(stderr, "-- %s\n", ToString(-1, ptr).c_str());
 	}
+#endif
 
-	assert(NodeIsSane(GetTop()));
+	if(validation_.Cheap() && !WorkPtrsAreSane()) {
+		fprintf(stderr, "Internal consistency failure after token %u\n", lexed_idx);
+		return false;
+	}
+	if(validation_.FullAt(lexed_idx) && !TreeIsSane()) {
+		fprintf(stderr, "Internal consistency failure in tree after token %u\n", lexed_idx);
+		return false;
+	}
 
 	return did_consume || work_ptrs_.size();
 }
 
+void SyntaxTree::SetValidation(ValidationLevel level, unsigned full_every_n_tokens) {
+	validation_.level = level;
+	validation_.full_every = full_every_n_tokens;
+}
+
+// Only looks at n and the nodes next to it, relying on its subs' completion
+//  state. Checking every node this way checks all of the tree.
 bool SyntaxTree::NodeIsSane(Node *n)const {
-	if(n->parent) {
+	const NodeHandle h = HandleOf(n);
+	for(Node* parent : Nodes(n->parents)) {
 		bool found_in_parent = false;
-		for(ParsedSlot const&slot : n->parent->parsed) {
-			for(Node* sub : slot.subs) {
-				if(sub == n) {
-					found_in_parent = true;
-					break;
-				}
-			}
-			if(found_in_parent) {
+		for(ParsedSlot const&slot : parent->parsed) {
+			if(slot.subs.contains(h)) {
+				found_in_parent = true;
 				break;
 			}
 		}
@@ -306,50 +299,224 @@ bool SyntaxTree::NodeIsSane(Node *n)const {
 
 	if(n->parsed.size() > 0) {
 		// All nodes must be complete to the left of the newest
-		for(int li=0;li<(n->parsed.size()-1);++li) {
+		for(size_t li=0;li<(n->parsed.size()-1);++li) {
 			ParsedSlot const&slot = n->parsed[li];
-			for(Node* sub : slot.subs) {
-				if(!CheckComplete_slow(sub)) {
-					fprintf(stderr, "Node is insane: !CheckComplete_slow() for left-hand sub\n");
-					return false;
-				}
-				if(!IsComplete(sub)) {
+			if(!slot.lexed_idx && (slot.subs.size() == 0)) {
+				fprintf(stderr, "Node is insane: empty left-hand slot\n");
+				return false;
+			}
+			for(Node* sub : Nodes(slot.subs)) {
+				if(!sub->IsComplete()) {
 					fprintf(stderr, "Node is insane: !IsComplete() for left-hand sub\n");
 					return false;
 				}
-				if(NodeContainsWorkPtr_slow(sub)) {
-					fprintf(stderr, "Node is insane: Left-hand sub contains work ptr\n");
-					return false;
-				}
-				/*
-				assert(sub->subs_complete == sub->parsed.back().subs.size());
-				if(sub->subs_complete != sub->parsed.back().subs.size()) {
-					return false;
-				}*/
 			}
 		}
-		/*
-		assert(n->subs_complete == CountSubsComplete_slow(n));
-		if(n->subs_complete != CountSubsComplete_slow(n)) {
+
+		unsigned n_complete = 0;
+		for(Node* sub : Nodes(n->parsed.back().subs)) {
+			if(sub->IsComplete()) {
+				++n_complete;
+			}
+		}
+		if(n->subs_complete != n_complete) {
+			fprintf(stderr, "Node is insane: subs_complete %i, counted %i\n",
+				n->subs_complete, n_complete);
 			return false;
 		}
-		*/
+	}
+	return true;
+}
 
+bool SyntaxTree::WorkPtrsAreSane()const {
+	for(NodeHandle h : work_ptrs_) {
+		Node* n = GetNode(h);
+		if(IsReleased(n)) {
+			fprintf(stderr, "Work ptr is insane: released %s\n", GetRuleName(n->rule.name));
+			return false;
+		}
+		for(Node* parent : Nodes(n->parents)) {
+			if(!parent->parsed.size() || !parent->parsed.back().subs.contains(h)) {
+				fprintf(stderr, "Work ptr is insane: not in its parent\n");
+				return false;
+			}
+		}
 	}
 	return true;
 }
 
+bool SyntaxTree::TreeIsSane()const {
+	MarkLive();
+
+	bool sane = true;
+	node_array_.for_each([this, &sane](Node* n) {
+		if(sane && (n->live_mark == live_mark_) && !NodeIsSane(n)) {
+			sane = false;
+		}
+	});
+	if(!sane) {
+		return false;
+	}
+
+	for(Node* n : Nodes(work_ptrs_)) {
+		if(n->live_mark != live_mark_) {
+			fprintf(stderr, "Work ptr is insane: not reachable from top\n");
+			return false;
+		}
+	}
+	return WorkPtrsAreSane();
+}
+
+void SyntaxTree::StepUpFrom(Node* n, Node* complete_n,
+							TokenType next_tok_type, LexedTokenIdx lexed_idx,
+							absl::flat_hash_map<Node*, Node*> &stepped_up) {
+	// complete_n is the first child of the step ups in every parent, or one
+	//  copy of n is, so they can be merged
+	Node* new_child = (complete_n != n) ? complete_n : 0;
+
+	const auto parents(n->parents);
+	for(Node* p : Nodes(parents)) {
+		StepUp(complete_n, new_child, p, next_tok_type, lexed_idx);
+
+		if((p == GetTop()) || (p->parsed.size() < p->rule.pattern.size())) {
+			continue;
+		}
+
+		// Ambiguous complete subs share their ancestors
+		const auto found = stepped_up.find(p);
+		if(found != stepped_up.end()) {
+			if(found->second != p) {
+				// Another branch for the copy of p, which has already stepped up
+				Node* complete_p = found->second;
+				complete_p->parsed.back().subs.insert(HandleOf(complete_n));
+				complete_p->subs_complete = complete_p->parsed.back().subs.size();
+			}
+			continue;
+		}
+
+		if(IsComplete(p)) {
+			stepped_up[p] = p;
+			StepUpFrom(p, p, next_tok_type, lexed_idx, stepped_up);
+		} else {
+			// Other branches of the last slot are still incomplete,
+			//  keep only the ones we came up through
+			Node* complete_p = ShallowCopyNode(p);
+			complete_p->parsed.back().subs.clear();
+			complete_p->parsed.back().subs.insert(HandleOf(complete_n));
+			complete_p->subs_complete = 1;
+			stepped_up[p] = complete_p;
+			StepUpFrom(p, complete_p, next_tok_type, lexed_idx, stepped_up);
+		}
+	}
+}
+
+void SyntaxTree::StepUp(Node* n, NodePtr& new_child, Node* p,
+						TokenType next_tok_type, LexedTokenIdx lexed_idx) {
+	StepContext ctx;
+	ctx.lexed = next_tok_type;
+	ctx.needed_rule = n->rule.token_name;
+
+	std::pair<StepUpMap::iterator, StepUpMap::iterator> found = GetStepUps(ctx);
+	if(found.first == found.second) {
+		return;
+	}
+
+	Node* parent = CopyCompleteAncestors(p);
+
+	// One new node per step up rule. The step down stacks after it are
+	//  alternatives in its second slot.
+	absl::InlinedVector<Node*, 4> new_nodes;
+
+	for(StepUpMap::iterator it = found.first;
+		it != found.second;
+		++it) {
+		const StepUpAction& action = it->second;
+
+		assert(GetRuleByName(action.step_up_rule_id).pattern[0] == n->rule.token_name);
+
+		fprintf(stderr, "======== Can step up on %s with rule %s stack %i\n",
+				GetRuleName(n->rule.name),
+				GetRuleName(action.step_up_rule_id),
+				(int)action.then_step_down.size());
+
+		Node* new_node = 0;
+		for(Node* nn : new_nodes) {
+			if(nn->rule.name == action.step_up_rule_id) {
+				new_node = nn;
+				break;
+			}
+		}
+
+		if(!new_node) {
+			new_node = AddNode(GetRuleByName(action.step_up_rule_id));
+			new_node->start_idx = n->start_idx;
+
+			// shallow copy is safe because node is complete
+			if(!new_child) {
+				new_child = ShallowCopyNode(n);
+			}
+			new_node->AddParsed();
+			InsertSub(new_node, new_child);
+
+			InsertSub(parent, new_node);
+			new_nodes.push_back(new_node);
+		}
+
+		if(action.then_step_down.size() == 0) {
+			// The new node consumes next itself
+			work_ptrs_.insert(HandleOf(new_node));
+			continue;
+		}
+
+		if(new_node->parsed.size() == 1) {
+			new_node->AddParsed();
+		}
+
+		Node* last_descendant;
+		Node* top_of_stack = BuildStepDownStack(action.then_step_down, last_descendant, lexed_idx);
+		InsertSub(new_node, top_of_stack);
+
+		work_ptrs_.insert(HandleOf(last_descendant));
+	}
+}
+
+Node* SyntaxTree::CopyCompleteAncestors(Node* p) {
+	if((p == GetTop()) || (p->parsed.size() < p->rule.pattern.size())) {
+		return p;
+	}
+
+	// Step ups at every level below p share one copy of it
+	const auto found = step_up_copies_.find(p);
+	if(found != step_up_copies_.end()) {
+		return found->second;
+	}
+
+	// Shallow copy is fine for all but the last slot, which gets only the
+	//  stepped up branches
+	Node* copy = ShallowCopyNode(p);
+	copy->parsed.back().subs.clear();
+	copy->subs_complete = 0;
+	step_up_copies_[p] = copy;
+
+	const auto parents(p->parents);
+	for(Node* above : Nodes(parents)) {
+		InsertSub(CopyCompleteAncestors(above), copy);
+	}
+	return copy;
+}
+
 Node* SyntaxTree::BuildStepDownStack(StepDownStack const&stack,
-									 NodePtr& last_descendant) {
+									 NodePtr& last_descendant,
+									 LexedTokenIdx start_idx) {
 	Node* child = 0;
 
 	for(RuleName down_rule : boost::adaptors::reverse(stack)) {
 		Node* new_node = AddNode(GetRuleByName(down_rule));
+		new_node->start_idx = start_idx;
 
 		if(child) {
-//			new_node->parsed.emplace_back(std::move(ParsedSlot(child)));
-			new_node->AddParsed(child);
-			child->parent = new_node;
+			new_node->AddParsed();
+			InsertSub(new_node, child);
 		}
 
 		if(!child) {
@@ -360,161 +527,405 @@ Node* SyntaxTree::BuildStepDownStack(StepDownStack const&stack,
 	return child;
 }
 
-void SyntaxTree::MarkCompleteAndMoveUp(Node* incomplete) {
-	
-	int inserted_work_ptrs = 0;
-
-	// Move up: 
-	// - Setting completion flags
-	// - Finally, inserting the work ptr at first incomplete
+void SyntaxTree::MarkCompleteAndMoveUp(Node* complete) {
 	fprintf(stderr, "MarkCompleteAndMoveUp {\n");
-	for(Node *n = incomplete->parent;n;n = n->parent) {
-
-		fprintf(stderr, "-- n %s subs %i/%i\n",
-			GetRuleName(n->rule.name),
-			CountSubsComplete_slow(n),
-			n->parsed.back().subs.size());
 
-		if(n->parsed.back().subs.size()) {
-			fprintf(stderr, "--- %s\n",
-					GetRuleName((*n->parsed.back().subs.begin())->rule.name));
+	// Each parent is a separate context to move up in
+	const auto parents(complete->parents);
+	for(NodeHandle ph : parents) {
+		// Moving up in an earlier one may have dropped this one
+		if(complete->parents.contains(ph)) {
+			MoveUp(complete, GetNode(ph));
 		}
+	}
 
-		//++n->subs_complete;
-		//assert(n->subs_complete == CountSubsComplete_slow(n));
+	fprintf(stderr, "===== MarkCompleteAndMoveUp }\n");
+}
 
-		if(n->parsed.size() == n->rule.pattern.size()) {
-			assert((n==incomplete) || n->parsed.back().subs.size());
-		} else {
-			ParsedSlot const&last_slot = n->parsed.back();
-			bool all_subs_complete = true;
-			for(Node* sub : last_slot.subs) {
-				if(!IsComplete(sub)) {
-					all_subs_complete = false;
-					break;
-				}
-			}
-			if(!all_subs_complete) {
-				absl::InlinedVector<Node*, 2> completes;
-				absl::InlinedVector<Node*, 2> incompletes;
+void SyntaxTree::MoveUp(Node* complete, Node* p) {
+	fprintf(stderr, "-- n %s subs %i/%i\n",
+		GetRuleName(p->rule.name),
+		p->subs_complete,
+		(int)p->parsed.back().subs.size());
 
-				for(Node* sub : last_slot.subs) {
-					if(IsComplete(sub)) {
-						completes.push_back(sub);
-					} else {
-						incompletes.push_back(sub);
-					}
-				}
+	if(p->parsed.size() < p->rule.pattern.size()) {
+		MoveWorkPtrTo(complete, p);
+		return;
+	}
 
-				// Cannot advance work ptr beyond incomplete node
-				// Need to resolve by cloning / splitting the node
+	const bool in_p = p->parsed.back().subs.contains(HandleOf(complete));
 
-				// Shallow copy is fine for all but last ParsedSlot
-				// For that slot, complete subs go into one copy, incomplete into the other
-				Node* copy_for_completes = ShallowCopyNode(n);
+	if(p == GetTop()) {
+		// Complete up to top, this branch can't take the next token
+		if(in_p) {
+			EraseSub(p, complete);
+		}
+		if(IsReleased(complete)) {
+			ReleaseNode(complete);
+		}
+		return;
+	}
 
-				
-				for(Node* sub : incompletes) {
-					copy_for_completes->parsed.back().subs.erase(sub);
-				}
-				for(Node* sub : completes) {
-					n->parsed.back().subs.erase(sub);
-					sub->parent = copy_for_completes;
-				}
+	const auto found = moved_up_.find(p);
 
-				assert(n->parent);
-				n->parent->parsed.back().subs.insert(copy_for_completes);
-				
-				assert(NodeIsSane(n));
-				assert(NodeIsSane(copy_for_completes));
+	if(in_p && IsComplete(p)) {
+		// Once for all its subs
+		if(found == moved_up_.end()) {
+			moved_up_[p] = p;
+			MarkCompleteAndMoveUp(p);
+		}
+		return;
+	}
 
-				work_ptrs_.insert(copy_for_completes);
-				++inserted_work_ptrs;
-			} else {
-				work_ptrs_.insert(n);
-				++inserted_work_ptrs;
-			}
-			break;
+	// Other branches of p's last slot are still incomplete. This one moves
+	//  to a copy with only the complete ones in the slot, so the work ptr
+	//  doesn't skip past the others.
+	if(in_p) {
+		EraseSub(p, complete);
+	}
+
+	if(found != moved_up_.end()) {
+		// The copy has already moved up
+		assert(found->second != p);
+		if(!IsReleased(found->second)) {
+			InsertSub(found->second, complete);
+		} else if(IsReleased(complete)) {
+			ReleaseNode(complete);
 		}
+		return;
 	}
-	fprintf(stderr, "===== MarkCompleteAndMoveUp inserted_work_ptrs %i }\n",
-		inserted_work_ptrs);
-	if(inserted_work_ptrs == 0) {
-		DeleteNode(incomplete);
+
+	Node* copy = ShallowCopyNode(p);
+	copy->parsed.back().subs.clear();
+	copy->subs_complete = 0;
+	InsertSub(copy, complete);
+	moved_up_[p] = copy;
+
+	// A parent of p where the copy completes up to top may drop the copy
+	//  before the others have taken it
+	copies_moving_up_.insert(copy);
+	const auto parents(p->parents);
+	for(Node* above : Nodes(parents)) {
+		MoveUp(copy, above);
+	}
+	copies_moving_up_.erase(copy);
+	if(IsReleased(copy)) {
+		ReleaseNode(copy);
 	}
 }
 
-bool SyntaxTree::IsComplete(Node* n)const {
-	if(n->parsed.size() < n->rule.pattern.size()) {
-		return false;
+void SyntaxTree::MoveWorkPtrTo(Node* complete, Node* above) {
+	const auto found = moved_up_.find(above);
+	if(found != moved_up_.end()) {
+		// Already split, the completes go to the same copy
+		EraseSub(above, complete);
+		InsertSub(found->second, complete);
+		return;
 	}
-	assert(n->parsed.size() > 0);
-//	if(n->subs_complete < n->parsed.back().subs.size()) {
-	if(CountSubsComplete_slow(n) < n->parsed.back().subs.size()) {
-		return false;
+
+	if(!above->parsed.back().subs.contains(HandleOf(complete))) {
+		InsertSub(above, complete);
 	}
 
-	assert(CheckComplete_slow(n));
-	//assert(n->subs_complete == CountSubsComplete_slow(n));
+	ParsedSlot const&last_slot = above->parsed.back();
+	if(above->subs_complete == last_slot.subs.size()) {
+		work_ptrs_.insert(HandleOf(above));
+		return;
+	}
 
-	return true;
+	// Cannot advance work ptr beyond incomplete node
+	// Need to resolve by cloning / splitting the node
+
+	// Shallow copy is fine for all but last ParsedSlot
+	// For that slot, complete subs move to the copy, incomplete ones stay
+	absl::InlinedVector<Node*, 2> completes;
+	for(Node* sub : Nodes(last_slot.subs)) {
+		if(IsComplete(sub)) {
+			completes.push_back(sub);
+		}
+	}
+
+	Node* copy_for_completes = ShallowCopyNode(above);
+	copy_for_completes->parsed.back().subs.clear();
+	copy_for_completes->subs_complete = 0;
+
+	for(Node* sub : completes) {
+		EraseSub(above, sub);
+		InsertSub(copy_for_completes, sub);
+	}
+
+	assert(above != GetTop());
+	const auto parents(above->parents);
+	for(Node* above_parent : Nodes(parents)) {
+		InsertSub(above_parent, copy_for_completes);
+	}
+
+	assert(NodeIsSane(above));
+	assert(NodeIsSane(copy_for_completes));
+
+	moved_up_[above] = copy_for_completes;
+	work_ptrs_.insert(HandleOf(copy_for_completes));
 }
 
-bool SyntaxTree::CanComplete(Node* n)const {
-	if(n->parsed.size() != n->rule.pattern.size()) {
+LexedTokenIdx SyntaxTree::SlotStartIdx(ParsedSlot const&slot)const {
+	if(slot.lexed_idx) {
+		return slot.lexed_idx;
+	}
+	assert(slot.subs.size() > 0);
+	// The alternatives in a slot all start at the same token
+	return GetNode(*slot.subs.begin())->start_idx;
+}
+
+size_t SyntaxTree::SpanHash::operator()(Node const* n)const {
+	size_t h = absl::Hash<std::pair<unsigned, unsigned> >()({n->rule.name, n->start_idx});
+	for(ParsedSlot const&slot : n->parsed) {
+		h = absl::Hash<std::pair<size_t, unsigned> >()({h, tree->SlotStartIdx(slot)});
+	}
+	return h;
+}
+
+bool SyntaxTree::SpanEq::operator()(Node const* a, Node const* b)const {
+	if((a->rule.name != b->rule.name) ||
+	   (a->start_idx != b->start_idx) ||
+	   (a->parsed.size() != b->parsed.size())) {
 		return false;
 	}
-	if(n->parsed.back().subs.size()) {
-		bool any_subs_can_complete = false;
-		for(Node* sub : n->parsed.back().subs) {
-			if(CanComplete(sub)) {
-				any_subs_can_complete = true;
-				break;
+	for(size_t si=0;si<a->parsed.size();++si) {
+		if(tree->SlotStartIdx(a->parsed[si]) != tree->SlotStartIdx(b->parsed[si])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void SyntaxTree::MergeWorkPtrs() {
+	std::vector<Node*> &level = merge_level_;
+	level.clear();
+	for(Node* n : Nodes(work_ptrs_)) {
+		level.push_back(n);
+	}
+
+	// All work ptrs end at the last token, as do their ancestors' last slots,
+	//  so the rule and where each slot starts are enough to tell two nodes
+	//  cover the same tokens
+	while(level.size() > 1) {
+		by_span_.clear();
+		merged_.clear();
+
+		for(Node* n : level) {
+			const auto inserted = by_span_.insert(n);
+			if(!inserted.second) {
+				MergeNode(*inserted.first, n);
+				merged_.push_back(*inserted.first);
 			}
 		}
-		if(!any_subs_can_complete) {
-			return false;
+
+		// Parents which now share a sub may be the same as each other too.
+		// Leaving them would count the sub's parses twice.
+		std::sort(merged_.begin(), merged_.end());
+		merged_.erase(std::unique(merged_.begin(), merged_.end()), merged_.end());
+		level.clear();
+		for(Node* n : merged_) {
+			for(Node* p : Nodes(n->parents)) {
+				if(p != GetTop()) {
+					level.push_back(p);
+				}
+			}
 		}
-	} else {
-		if(!TokenIsLexical(n->rule.pattern[0])) {
-			return false;
+		std::sort(level.begin(), level.end());
+		level.erase(std::unique(level.begin(), level.end()), level.end());
+	}
+}
+
+// into and from cover the same tokens slot by slot, so any mix of their
+//  alternatives is a parse in any of their parents
+void SyntaxTree::MergeNode(Node* into, Node* from) {
+	assert(into->rule.name == from->rule.name);
+	assert(into->parsed.size() == from->parsed.size());
+
+	const NodeHandle from_h = HandleOf(from);
+	for(size_t si=0;si<from->parsed.size();++si) {
+		ParsedSlot const&from_slot = from->parsed[si];
+		assert(from_slot.lexed_idx == into->parsed[si].lexed_idx);
+
+		for(Node* sub : Nodes(from_slot.subs)) {
+			sub->parents.erase(from_h);
+			if(si == (from->parsed.size()-1)) {
+				InsertSub(into, sub);
+			} else {
+				into->parsed[si].subs.insert(HandleOf(sub));
+			}
 		}
 	}
-	return true;
+
+	const auto parents(from->parents);
+	for(Node* p : Nodes(parents)) {
+		EraseSub(p, from);
+		InsertSub(p, into);
+	}
+
+	ReleaseNode(from);
+}
+
+bool SyntaxTree::IsComplete(Node* n)const {
+	const bool ret = n->IsComplete();
+#if CHECK_COMPLETE_SLOW
+	assert(ret == CheckComplete_slow(n));
+	assert((n->parsed.size() == 0) || (n->subs_complete == CountSubsComplete_slow(n)));
+#endif
+	return ret;
+}
+
+// The cross-checked IsComplete() can't be used while the counts are being updated
+void SyntaxTree::InsertSub(Node* n, Node* sub) {
+	ParsedSlot &last_slot = n->parsed.back();
+	const NodeHandle sub_h = HandleOf(sub);
+	if(last_slot.subs.contains(sub_h)) {
+		return;
+	}
+	const bool was_complete = n->IsComplete();
+	last_slot.subs.insert(sub_h);
+	sub->parents.insert(HandleOf(n));
+	if(sub->IsComplete()) {
+		++n->subs_complete;
+	}
+	CompletionChanged(n, was_complete);
+}
+
+void SyntaxTree::EraseSub(Node* n, Node* sub) {
+	ParsedSlot &last_slot = n->parsed.back();
+	const NodeHandle sub_h = HandleOf(sub);
+	if(!last_slot.subs.contains(sub_h)) {
+		return;
+	}
+	const bool was_complete = n->IsComplete();
+	last_slot.subs.erase(sub_h);
+	sub->parents.erase(HandleOf(n));
+	if(sub->IsComplete()) {
+		assert(n->subs_complete > 0);
+		--n->subs_complete;
+	}
+	CompletionChanged(n, was_complete);
+}
+
+void SyntaxTree::CompletionChanged(Node* n, bool was_complete) {
+	const bool is_complete = n->IsComplete();
+	if(is_complete == was_complete) {
+		return;
+	}
+
+	for(Node* parent : Nodes(n->parents)) {
+		assert(parent->parsed.back().subs.contains(HandleOf(n)));
+		const bool parent_was_complete = parent->IsComplete();
+		if(is_complete) {
+			++parent->subs_complete;
+		} else {
+			assert(parent->subs_complete > 0);
+			--parent->subs_complete;
+		}
+		CompletionChanged(parent, parent_was_complete);
+	}
+}
+
+static size_t SaturatingAdd(size_t a, size_t b) {
+	return (a > (SIZE_MAX - b)) ? SIZE_MAX : (a + b);
+}
+
+static size_t SaturatingMul(size_t a, size_t b) {
+	if(a && (b > (SIZE_MAX / a))) {
+		return SIZE_MAX;
+	}
+	return a * b;
+}
+
+size_t SyntaxTree::CountParses()const {
+	ParseCounts counts;
+	return CountParses(GetTop(), counts);
 }
 
-Node* SyntaxTree::FindIncompletePattern(Node* within)const {
-	if(within->parsed.size() < within->rule.pattern.size()) {
-		return within;
+// Shared nodes are counted once, so this is linear in the size of the forest
+//  rather than in the number of parses
+size_t SyntaxTree::CountParses(Node const* n, ParseCounts &counts)const {
+	const auto found = counts.find(n);
+	if(found != counts.end()) {
+		return found->second;
 	}
 
-	for(const ParsedSlot& slot : within->parsed) {
-		for(Node* sub : slot.subs) {
-			Node* ret = FindIncompletePattern(sub);
-			if(ret != nullptr) {
-				return ret;
+	size_t ret = 0;
+	if(n->parsed.size() == n->rule.pattern.size()) {
+		ret = 1;
+		for(ParsedSlot const&slot : n->parsed) {
+			if(slot.lexed_idx) {
+				continue;
+			}
+			size_t slot_parses = 0;
+			for(Node const* sub : Nodes(slot.subs)) {
+				slot_parses = SaturatingAdd(slot_parses, CountParses(sub, counts));
 			}
+			ret = SaturatingMul(ret, slot_parses);
 		}
 	}
 
-	return nullptr;
+	counts[n] = ret;
+	return ret;
+}
+
+size_t SyntaxTree::DeleteIncomplete() {
+	ParseCounts counts;
+	const size_t n_parses = CountParses(GetTop(), counts);
+
+	absl::flat_hash_set<Node*> pruned;
+	PruneIncomplete(GetTop(), counts, pruned);
+
+	assert((n_parses == 0) || FullyComplete());
+	return n_parses;
 }
 
-void SyntaxTree::DeleteIncomplete() {
-	while(!FullyComplete()) {
-		// Don't delete top
-		Node* incomplete = FindIncompletePattern(GetTop());
-		DeleteNode(incomplete);
+void SyntaxTree::PruneIncomplete(Node* n, ParseCounts const&counts,
+								 absl::flat_hash_set<Node*> &pruned) {
+	if(!pruned.insert(n).second) {
+		return;
+	}
+
+	for(size_t si=0;si<n->parsed.size();++si) {
+		ParsedSlot &slot = n->parsed[si];
+		const bool last_slot = (si == (n->parsed.size()-1));
+
+		absl::InlinedVector<Node*, 4> dead;
+		for(Node* sub : Nodes(slot.subs)) {
+			if(counts.at(sub) == 0) {
+				dead.push_back(sub);
+			}
+		}
+
+		for(Node* sub : dead) {
+			if(last_slot) {
+				EraseSub(n, sub);
+			} else {
+				slot.subs.erase(HandleOf(sub));
+				sub->parents.erase(HandleOf(n));
+			}
+			if(IsReleased(sub)) {
+				ReleaseNode(sub);
+			}
+		}
+
+		for(Node* sub : Nodes(slot.subs)) {
+			PruneIncomplete(sub, counts, pruned);
+		}
 	}
 }
 
 bool SyntaxTree::CheckComplete_slow(Node *n)const {
 	for(ParsedSlot const&slot : n->parsed) {
-		for(Node* sub : slot.subs) {
+		for(Node* sub : Nodes(slot.subs)) {
 			if(!CheckComplete_slow(sub)) {
 				return false;
 			}
 		}
+		if(!slot.lexed_idx && (slot.subs.size() == 0)) {
+			return false;
+		}
 	}
 	return n->parsed.size() == n->rule.pattern.size();
 }
@@ -525,7 +936,7 @@ unsigned SyntaxTree::CountSubsComplete_slow(Node *n)const {
 	}
 	unsigned n_complete = 0;
 
-	for(Node* sub : n->parsed.back().subs) {
+	for(Node* sub : Nodes(n->parsed.back().subs)) {
 		if(CheckComplete_slow(sub)) {
 			++n_complete;
 		}
@@ -535,59 +946,195 @@ unsigned SyntaxTree::CountSubsComplete_slow(Node *n)const {
 }
 
 Node* SyntaxTree::AddNode(Rule const&rule) {
-	return new (node_array_.allocate()) Node (rule);
+	return GetNode(node_array_.allocate(rule));
 }
 
 Node* SyntaxTree::ShallowCopyNode(Node* n) {
-	return new (node_array_.allocate()) Node (*n);
+	return GetNode(node_array_.allocate(*n));
+}
+
+bool SyntaxTree::IsReleased(Node const* n)const {
+	return (n != GetTop()) && (n->parents.size() == 0) &&
+		   !copies_moving_up_.contains(const_cast<Node*>(n));
 }
 
-void SyntaxTree::RemoveWorkPtrsFromTree(Node *n) {
-	work_ptrs_.erase(n);
+void SyntaxTree::ReleaseNode(Node* n) {
+	assert(IsReleased(n));
+	const NodeHandle h = HandleOf(n);
+	work_ptrs_.erase(h);
 
-	if(n->parsed.size() > 0) {
-		for(Node* n : n->parsed.back().subs) {
-			RemoveWorkPtrsFromTree(n);
+	for(ParsedSlot const&slot : n->parsed) {
+		for(Node* sub : Nodes(slot.subs)) {
+			if(!sub->parents.contains(h)) {
+				continue;
+			}
+			sub->parents.erase(h);
+			if(IsReleased(sub)) {
+				ReleaseNode(sub);
+			}
 		}
 	}
 }
 
 void SyntaxTree::DeleteNode(Node* n) {
 	assert(n!=GetTop());
-	assert(n->parent);
 
+#if PRINT_TREES
 fprintf(stderr, "Delete %s, tree:\n%s\n", 
 	GetRuleName(n->rule.name),
 	ToString(0).c_str());
+#endif
+
+	// Remove from every parent. A parent left with nothing in its last slot
+	//  goes too, up to top.
+	const auto parents(n->parents);
+	for(Node* remove_from : Nodes(parents)) {
+		const size_t prev_size = remove_from->parsed.back().subs.size();
+		EraseSub(remove_from, n);
+		assert(remove_from->parsed.back().subs.size() < prev_size);
+
+		if((remove_from != GetTop()) &&
+		   (remove_from->parsed.back().subs.size() == 0) &&
+		   !IsReleased(remove_from)) {
+			DeleteNode(remove_from);
+		}
+	}
 
-	Node* to_remove = n;
-	Node* remove_from = n->parent;
+	ReleaseNode(n);
+}
 
-	// Find first ancestor with >1 sub in the last slot, or top
-	while(true) {
-		assert(remove_from->parsed.size());
-		size_t n_subs_last = remove_from->parsed.back().subs.size();
-		assert(n_subs_last > 0);
+size_t SyntaxTree::MarkLive()const {
+	++live_mark_;
+
+	std::vector<Node const*> &stack = mark_stack_;
+	stack.clear();
+	stack.push_back(GetTop());
+	GetTop()->live_mark = live_mark_;
+	size_t n_live = 1;
+
+	while(stack.size()) {
+		Node const* n = stack.back();
+		stack.pop_back();
+		for(ParsedSlot const&slot : n->parsed) {
+			for(Node const* sub : Nodes(slot.subs)) {
+				if(sub->live_mark != live_mark_) {
+					sub->live_mark = live_mark_;
+					++n_live;
+					stack.push_back(sub);
+				}
+			}
+		}
+	}
+	return n_live;
+}
+
+size_t SyntaxTree::NumLiveNodes()const {
+	return MarkLive();
+}
 
+size_t SyntaxTree::LinkBytes()const {
+	size_t bytes = sizeof(work_ptrs_);
+	node_array_.for_each([&bytes](Node const* n) {
+		bytes += sizeof(n->parents) + n->parents.heap_bytes();
+		for(ParsedSlot const&slot : n->parsed) {
+			bytes += sizeof(slot.subs) + slot.subs.heap_bytes();
+		}
+	});
+	return bytes;
+}
 
-		if((n_subs_last > 1) || (remove_from == GetTop())) {
-			break;
+// Released nodes can still be in the slots of copies, which don't add
+//  themselves as parents, so only what can't be reached from top is dead
+size_t SyntaxTree::ReclaimNodes() {
+	MarkLive();
+	const unsigned live = live_mark_;
+
+	std::vector<NodeHandle> &dead = dead_nodes_;
+	dead.clear();
+	node_array_.for_each([this, live, &dead](Node* n) {
+		if(n->live_mark != live) {
+			dead.push_back(HandleOf(n));
+			return;
+		}
+		// Live nodes can still list dead ones as parents
+		absl::InlinedVector<NodeHandle, 2> dead_parents;
+		for(NodeHandle ph : n->parents) {
+			if(GetNode(ph)->live_mark != live) {
+				dead_parents.push_back(ph);
+			}
+		}
+		for(NodeHandle ph : dead_parents) {
+			n->parents.erase(ph);
 		}
+	});
 
-		// Move up
-		to_remove = remove_from;
-		remove_from = remove_from->parent;
+	for(NodeHandle h : dead) {
+		assert(!work_ptrs_.contains(h));
+		work_ptrs_.erase(h);
+		node_array_.deallocate(h);
 	}
 
+	// Only valid while consuming a token
+	step_up_copies_.clear();
+	moved_up_.clear();
+
+	return dead.size();
+}
+
+void SyntaxTree::CompactNodes() {
+	// Old handles in the order visited, and the new handle of each
+	std::vector<NodeHandle> order;
+	absl::flat_hash_map<NodeHandle, NodeHandle> moved;
+
+	BlockPool<Node> compacted;
+
+	// Top first, so it stays the first node
+	order.push_back(0);
+	moved[0] = compacted.allocate(GetTop()->rule);
+	for(size_t oi=0;oi<order.size();++oi) {
+		for(ParsedSlot const&slot : GetNode(order[oi])->parsed) {
+			for(NodeHandle sub : slot.subs) {
+				if(!moved.contains(sub)) {
+					moved[sub] = compacted.allocate(GetNode(sub)->rule);
+					order.push_back(sub);
+				}
+			}
+		}
+	}
+
+	for(NodeHandle h : order) {
+		Node const* n = GetNode(h);
+		Node* to = compacted.get(moved.at(h));
+		to->start_idx = n->start_idx;
+		to->subs_complete = n->subs_complete;
+		for(ParsedSlot const&slot : n->parsed) {
+			to->parsed.emplace_back(slot.lexed_idx);
+			for(NodeHandle sub : slot.subs) {
+				to->parsed.back().subs.insert(moved.at(sub));
+			}
+		}
+		for(NodeHandle p : n->parents) {
+			const auto found = moved.find(p);
+			if(found != moved.end()) {
+				to->parents.insert(found->second);
+			}
+		}
+	}
+
+	InlinedSet<NodeHandle, 4> prev_work_ptrs;
+	prev_work_ptrs.swap(work_ptrs_);
+	for(NodeHandle n : prev_work_ptrs) {
+		const auto found = moved.find(n);
+		assert(found != moved.end());
+		if(found != moved.end()) {
+			work_ptrs_.insert(found->second);
+		}
+	}
 
-	assert(to_remove);
-	assert(remove_from);
-	RemoveWorkPtrsFromTree(to_remove);
-	assert(!NodeContainsWorkPtr_slow(to_remove));
+	step_up_copies_.clear();
+	moved_up_.clear();
 
-	const size_t prev_size = remove_from->parsed.back().subs.size();
-	remove_from->parsed.back().subs.erase(to_remove);
-	assert(remove_from->parsed.back().subs.size() < prev_size);
+	node_array_.swap(compacted);
 }
 
 void SyntaxTree::MakeIndent(ostringstream &ostr, int n) {
@@ -625,7 +1172,7 @@ std::string SyntaxTree::ToString(int multiline, Node const*n)const {
 		};
 
 		if(i >= n->parsed.size()) {
-			if((i == n->parsed.size()) && work_ptrs_.contains(const_cast<Node*>(n))) {
+			if((i == n->parsed.size()) && work_ptrs_.contains(HandleOf(n))) {
 				ostr << "^";
 			}
 
@@ -656,7 +1203,7 @@ std::string SyntaxTree::ToString(int multiline, Node const*n)const {
 			}
 		}
 		size_t si = 0;
-		for(Node const*sn : slot.subs) {
+		for(Node const*sn : Nodes(slot.subs)) {
 			ostr << ToString((multiline<0)?-1:(multiline+1), sn);
 			if(multiline < 0) {
 				if(si < (slot.subs.size()-1)) {
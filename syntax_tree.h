@@ -2,10 +2,14 @@
 #ifndef SYNTAX_TREE_H
 #define SYNTAX_TREE_H
 
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
 #include "absl/container/inlined_vector.h"
+#include "compact_set.h"
 #include "inlined_set.h"
-#include "block_allocator.h"
+#include "block_array.h"
 #include "rules.h"
+#include "validation.h"
 
 #include <sstream>
 #include <vector>
@@ -16,49 +20,80 @@ namespace parser {
 // 0 = NULL, indexes from 1
 typedef unsigned LexedTokenIdx;
 
+// Index of a node in SyntaxTree's node pool, the top is 0
+// Links between nodes are handles, half the size of pointers, so a
+//  CompactSet of them holds two inline
+typedef uint32_t NodeHandle;
+
 struct Node;
 
-struct ParsedSlot {
+// 16 bytes: lexed_idx fills the space before the packed subs
+struct alignas(8) ParsedSlot {
 	ParsedSlot(LexedTokenIdx lexed) : lexed_idx(lexed) { }
-	ParsedSlot(Node* sub) : lexed_idx(0) {subs.insert(sub);}
 	ParsedSlot() : lexed_idx(0) { }
 
 	LexedTokenIdx 				lexed_idx;
-	InlinedSet<Node*, 4> 	    subs;
+	CompactSet<NodeHandle> 		subs;
 };
 
 struct Node {
 	Node(Rule const&rule) 
-	  : rule(rule), parent(0)//, subs_complete(0) 
+	  : rule(rule), start_idx(0), subs_complete(0), live_mark(0) 
+	{
+	}
+
+	// A copy has no parents until it is put in a slot
+	Node(Node const&o)
+	  : rule(o.rule), start_idx(o.start_idx), parsed(o.parsed),
+	    subs_complete(o.subs_complete), live_mark(0)
 	{
 	}
 
 	// Pointer instead of reference for move semantics
 	Rule const&rule;
 
-	Node* parent;
+	// The first token covered by this node
+	// Before parents to fill the space before the packed set
+	LexedTokenIdx start_idx;
+
+	// Nodes holding this one in their last slot, which it moves up into
+	// - More than one after equivalent work ptrs were merged
+	// - Copies which share a complete node don't add themselves
+	CompactSet<NodeHandle> parents;
 
 	// These correspond to the tokens in the rule pattern
-	absl::InlinedVector<ParsedSlot, 8> parsed;
+	// Most patterns are 4 tokens or fewer
+	absl::InlinedVector<ParsedSlot, 4> parsed;
 
 	// The number of sub-nodes complete in the last slot
 	// - All but the last slot must be all complete
 	// - Complete means all slots filled and all subs complete
-//	unsigned subs_complete;
+	// - Kept up to date by SyntaxTree as subs complete, are added and are removed
+	unsigned subs_complete;
+
+	// The last marking from top which reached this node
+	mutable unsigned live_mark;
 
 	inline void AddParsed(LexedTokenIdx lexed) {
 		parsed.emplace_back(std::move(ParsedSlot(lexed)));
-//		subs_complete = 0;
-	}
-
-	inline void AddParsed(Node* sub) {
-		parsed.emplace_back(std::move(ParsedSlot(sub)));
-//		subs_complete = 0;
+		subs_complete = 0;
 	}
 
 	inline void AddParsed() {
 		parsed.emplace_back(std::move(ParsedSlot()));
-//		subs_complete = 0;
+		subs_complete = 0;
+	}
+
+	// A last slot with neither a token nor subs isn't parsed yet
+	inline bool IsComplete()const {
+		if(parsed.size() < rule.pattern.size()) {
+			return false;
+		}
+		ParsedSlot const&last = parsed.back();
+		if(last.lexed_idx) {
+			return true;
+		}
+		return (last.subs.size() > 0) && (subs_complete == last.subs.size());
 	}
 };
 
@@ -97,7 +132,44 @@ struct SyntaxTree {
 	bool CanComplete()const;
 	bool FullyComplete()const;
 
-	void DeleteIncomplete();
+	// How much ConsumeToken() checks the tree, see ValidationLevel
+	void SetValidation(ValidationLevel level, unsigned full_every_n_tokens = 1);
+
+	// Prunes the alternatives which can't complete in one bottom-up pass
+	// Returns the number of parses left, saturating at SIZE_MAX
+	size_t DeleteIncomplete();
+
+	// The number of complete parses, without changing the tree
+	size_t CountParses()const;
+
+	// The number of incomplete nodes the next token is offered to
+	size_t NumWorkPtrs()const {
+		return work_ptrs_.size();
+	}
+
+	// Nodes allocated and not on the free list, reachable from top or not
+	size_t NumNodes()const {
+		return node_array_.size();
+	}
+	size_t NumFreeNodes()const {
+		return node_array_.num_free();
+	}
+
+	// Bytes of the links between nodes and of the work ptrs: the parents and
+	//  subs sets, and the arrays those with more than fit inline use
+	size_t LinkBytes()const;
+
+	// Nodes reachable from top. The rest of NumNodes() are dead.
+	size_t NumLiveNodes()const;
+
+	// Puts the nodes no longer reachable from top on the free list for
+	//  AddNode() and ShallowCopyNode(). Returns how many.
+	// Also done while parsing, each time the nodes double.
+	size_t ReclaimNodes();
+
+	// Moves the live nodes into fresh contiguous blocks, top first
+	// Invalidates all Node pointers and handles
+	void CompactNodes();
 
 	// multiline=0 to enable
 	std::string ToString(int multiline=-1, Node const*n=0)const;
@@ -106,15 +178,14 @@ struct SyntaxTree {
 
   private:
 
-  	Node* FindIncompletePattern(Node* within)const;
-
-  	bool NodeContainsWorkPtr_slow(Node *n)const;
   	bool NodeIsSane(Node *n)const;
+  	bool WorkPtrsAreSane()const;
+  	bool TreeIsSane()const;
 
   	// Recursively check that all sub-nodes are complete, without using subs_complete
+  	// Only for cross-checking the incremental state
   	bool CheckComplete_slow(Node *n)const;
 
-  	void RemoveWorkPtrsFromTree(Node *n);
 
   	unsigned CountSubsComplete_slow(Node *n)const;
 
@@ -126,12 +197,111 @@ struct SyntaxTree {
   					   TokenType next_tok_type,
   					   LexedTokenIdx lexed_idx);
 
+  	// Steps up complete_n in each of n's parents, then moves on to the
+  	//  parents with full patterns. complete_n is n, or a copy of it with
+  	//  only the complete branches we came up through.
+  	// stepped_up has the nodes already visited, and what stood in for them.
+  	void StepUpFrom(Node* n, Node* complete_n,
+  					TokenType next_tok_type, LexedTokenIdx lexed_idx,
+  					absl::flat_hash_map<Node*, Node*> &stepped_up);
+
+  	// Adds the branches where complete node n in parent p is the first child
+  	//  of a step up rule. That child is new_child, a copy of n made on first use.
+  	void StepUp(Node* n, NodePtr& new_child, Node* p,
+  				TokenType next_tok_type, LexedTokenIdx lexed_idx);
+
+  	// Where the step up branches of a node in p go: p if it still has
+  	//  pattern tokens to parse, otherwise copies of the ancestors up to one
+  	//  which has. The original ancestors are left to the branch which doesn't step up.
+  	// The copies are made once per token, in step_up_copies_.
+  	Node* CopyCompleteAncestors(Node* p);
+
   	Node* BuildStepDownStack(StepDownStack const&stack,
-  							 NodePtr& last_descendant);
+  							 NodePtr& last_descendant,
+  							 LexedTokenIdx start_idx);
+
+  	// Change the subs of n's last slot, keeping subs_complete up to date
+  	void InsertSub(Node* n, Node* sub);
+  	void EraseSub(Node* n, Node* sub);
+
+  	// Passes a change in n's completion up to the ancestors it changes
+  	void CompletionChanged(Node* n, bool was_complete);
+
+  	void MarkCompleteAndMoveUp(Node* complete);
+
+  	// Moves complete up through parent p. complete is in p's last slot, or
+  	//  is a copy standing in for the sub there it was made from.
+  	// p is copied at most once per token, in moved_up_.
+  	void MoveUp(Node* complete, Node* p);
+
+  	// above still has pattern tokens to parse and gets the work ptr
+  	void MoveWorkPtrTo(Node* complete, Node* above);
+
+  	// Work ptrs with the same rule covering the same tokens slot by slot
+  	//  are merged into one node, then likewise the parents they share
+  	void MergeWorkPtrs();
+  	void MergeNode(Node* into, Node* from);
+
+  	// The rule and where each slot starts, which MergeWorkPtrs() compares
+  	struct SpanHash {
+  		size_t operator()(Node const* n)const;
+  		SyntaxTree const* tree;
+  	};
+  	struct SpanEq {
+  		bool operator()(Node const* a, Node const* b)const;
+  		SyntaxTree const* tree;
+  	};
+
+  	// The first token covered by a filled slot
+  	LexedTokenIdx SlotStartIdx(ParsedSlot const&slot)const;
+
+  	Node* GetNode(NodeHandle h)const {
+  		return node_array_.get(h);
+  	}
+  	NodeHandle HandleOf(Node const* n)const {
+  		return node_array_.handle_of(n);
+  	}
+
+  	// Iterates a set of handles as the nodes they refer to
+  	template<typename Set>
+  	struct NodeRange {
+  		struct iterator {
+  			Node* operator*()const {
+  				return pool->get(*it);
+  			}
+  			iterator& operator++() {
+  				++it;
+  				return *this;
+  			}
+  			bool operator!=(iterator const&o)const {
+  				return it != o.it;
+  			}
+  			BlockPool<Node> const* pool;
+  			typename Set::iterator it;
+  		};
+  		iterator begin()const {
+  			return iterator{pool, set.begin()};
+  		}
+  		iterator end()const {
+  			return iterator{pool, set.end()};
+  		}
+  		BlockPool<Node> const* pool;
+  		Set const&set;
+  	};
+  	template<typename Set>
+  	NodeRange<Set> Nodes(Set const&set)const {
+  		return NodeRange<Set>{&node_array_, set};
+  	}
 
-  	void MarkCompleteAndMoveUp(Node* incomplete);
   	bool IsComplete(Node* n)const;
-  	bool CanComplete(Node* n)const;
+
+  	// Complete parses of n, each node counted once into counts
+  	typedef absl::flat_hash_map<Node const*, size_t> ParseCounts;
+  	size_t CountParses(Node const* n, ParseCounts &counts)const;
+
+  	// Drops the subs counted 0 under n, each node visited once
+  	void PruneIncomplete(Node* n, ParseCounts const&counts,
+  						 absl::flat_hash_set<Node*> &pruned);
 
   	LexedToken const&GetLexedTokenByIdx(LexedTokenIdx idx)const;
 
@@ -139,6 +309,14 @@ struct SyntaxTree {
   	Node* ShallowCopyNode(Node* n);
   	void DeleteNode(Node* n);
 
+  	// Drops n, which has no parents left, and anything only reachable through it
+  	void ReleaseNode(Node* n);
+  	bool IsReleased(Node const* n)const;
+
+  	// Marks everything reachable from top through the slots with a new
+  	//  live_mark_, returns how many
+  	size_t MarkLive()const;
+
   	bool NodeComplete(Node const* node)const;
   	Node* GetTop()const;
 
@@ -159,19 +337,49 @@ struct SyntaxTree {
   	// Incomplete nodes may also be removed to satisfy it. 
 
   	// Next incomplete nodes up the tree. Any descendents of these are complete. 
-  	InlinedSet<Node*, 4>       		 work_ptrs_;
+  	// Equivalent ones are merged after each token, so with their shared
+  	//  parents they stay near the number of distinct grammar states.
+  	InlinedSet<NodeHandle, 4>   		 work_ptrs_;
 
   	// A list of completed nodes at or above the work_ptrs
   	//  which could consume a given token by inserting a node with the same
   	//  rule in their place. These are things like binary expressions and lists. 
   	std::multimap<TokenType, Node*>  step_up_ptrs_;
 
+  	// Full ancestors copied for the step ups of the current token, by original
+  	absl::flat_hash_map<Node*, Node*> step_up_copies_;
+
+  	// Nodes complete subs were moved up through for the current token, and
+  	//  the copies the subs were moved to. A node which moved up whole maps to itself.
+  	absl::flat_hash_map<Node*, Node*> moved_up_;
+
+  	// Copies MoveUp() hasn't finished moving up through all their parents.
+  	//  They aren't released while they have none yet.
+  	absl::flat_hash_set<Node*> copies_moving_up_;
+
   	// std::vector uses copy constructor..
 //	std::vector<Node>     	   node_array_;
-	BlockAllocator<Node> 	   node_array_;
-
-	// TODO: Use BlockAllocator? Need to index though?
-	std::vector<LexedToken>    token_array_;
+	// Indexed by NodeHandle, top first
+	BlockPool<Node> 		   node_array_;
+
+	Validation 				   validation_;
+
+	// NumNodes() at which to reclaim next
+	size_t reclaim_at_;
+	mutable unsigned live_mark_;
+
+	// Indexed by LexedTokenIdx-1, grows without copying
+	BlockArray<LexedToken, 10> token_array_;
+
+	// Scratch kept between tokens, so a warmed up tree consumes without allocating
+	// The work ptrs of the previous pass, swapped with work_ptrs_
+	InlinedSet<NodeHandle, 4>  prev_work_ptrs_;
+	absl::flat_hash_map<Node*, Node*> stepped_up_;
+	std::vector<Node*> 		   merge_level_;
+	std::vector<Node*> 		   merged_;
+	absl::flat_hash_set<Node*, SpanHash, SpanEq> by_span_;
+	mutable std::vector<Node const*> mark_stack_;
+	std::vector<NodeHandle>    dead_nodes_;
 };
 
 };  // namespace parser
@@ -0,0 +1,145 @@
+
+
+#include "gtest/gtest.h"
+#include "syntax_tree.h"
+#include "rules.h"
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+// Replaces the global operator new for the whole test binary, so the
+//  allocations made while parsing a token can be counted.
+// Every form is replaced, so nothing reaches the library's own.
+static size_t sNumAllocs = 0;
+
+// Out of line, so the compiler doesn't see free() inlined into a delete
+//  of memory from operator new, -Wmismatched-new-delete
+__attribute__((noinline)) static void* CountedAlloc(size_t n, size_t align) {
+	++sNumAllocs;
+	n = n ? n : 1;
+	void* p = 0;
+	if(align > alignof(std::max_align_t)) {
+		if(posix_memalign(&p, align, n) != 0) {
+			p = 0;
+		}
+	} else {
+		p = malloc(n);
+	}
+	if(!p) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+__attribute__((noinline)) static void CountedFree(void* p) {
+	free(p);
+}
+
+void* operator new(size_t n) {
+	return CountedAlloc(n, 0);
+}
+
+void* operator new[](size_t n) {
+	return CountedAlloc(n, 0);
+}
+
+void* operator new(size_t n, std::align_val_t align) {
+	return CountedAlloc(n, size_t(align));
+}
+
+void* operator new[](size_t n, std::align_val_t align) {
+	return CountedAlloc(n, size_t(align));
+}
+
+void operator delete(void* p) noexcept {
+	CountedFree(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	CountedFree(p);
+}
+
+void operator delete[](void* p) noexcept {
+	CountedFree(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+	CountedFree(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+	CountedFree(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+	CountedFree(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept {
+	CountedFree(p);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+	CountedFree(p);
+}
+
+namespace {
+
+// Parses tokens once to warm up the tree, then again after Init().
+// Returns the number of tokens the second pass allocated in.
+size_t TokensAllocatingWhenWarm(std::vector<parser::LexedToken> const&tokens) {
+	parser::SyntaxTree tree;
+	EXPECT_TRUE(tree.Init("top"));
+	const size_t cold_before = sNumAllocs;
+	EXPECT_TRUE(tree.Parse(tokens.begin(), tokens.end()));
+	EXPECT_TRUE(tree.CanComplete());
+	// Or the counting isn't hooked up
+	EXPECT_LT(cold_before, sNumAllocs);
+
+	EXPECT_TRUE(tree.Init("top"));
+	size_t n_allocating = 0;
+	for(auto it = tokens.begin();it != tokens.end();++it) {
+		const size_t before = sNumAllocs;
+		EXPECT_TRUE(tree.Parse(it, it+1));
+		if(sNumAllocs != before) {
+			++n_allocating;
+		}
+	}
+	EXPECT_TRUE(tree.CanComplete());
+	return n_allocating;
+}
+
+TEST(SyntaxTreeAllocTest, ListIsAllocationFree) {
+	// COMMA TRUE COMMA TRUE ... TRUE, nested expr_lists
+	std::vector<parser::LexedToken> tokens;
+	parser::LexedToken tok;
+	for(int i=0;i<2000;++i) {
+		tok.tok = parser::GetTokenInstName("COMMA");
+		tokens.push_back(tok);
+		tok.tok = parser::GetTokenInstName("TRUE");
+		tokens.push_back(tok);
+	}
+	tokens.push_back(tok);
+
+	EXPECT_EQ(0u, TokensAllocatingWhenWarm(tokens));
+}
+
+TEST(SyntaxTreeAllocTest, StepUpChainIsAllocationFree) {
+	// NUM PLUS NUM PLUS ... NUM, a step up at every PLUS
+	std::vector<parser::LexedToken> tokens;
+	parser::LexedToken tok;
+	for(int i=0;i<2000;++i) {
+		tok.tok = parser::GetTokenInstName("NUM", "1");
+		tokens.push_back(tok);
+		tok.tok = parser::GetTokenInstName("PLUS");
+		tokens.push_back(tok);
+	}
+	tok.tok = parser::GetTokenInstName("NUM", "1");
+	tokens.push_back(tok);
+
+	EXPECT_EQ(0u, TokensAllocatingWhenWarm(tokens));
+}
+
+}  // namespace
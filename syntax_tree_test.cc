@@ -101,7 +101,7 @@ TEST(SyntaxTreeTest, OneComplete) {
 	EXPECT_FALSE(tree.FullyComplete());
 	EXPECT_TRUE(tree.CanComplete());
 
-	tree.DeleteIncomplete();
+	EXPECT_EQ(1u, tree.DeleteIncomplete());
 
 	fprintf(stderr, "After DeleteIncomplete %s\n", tree.ToString(0).c_str());
 
@@ -109,6 +109,243 @@ TEST(SyntaxTreeTest, OneComplete) {
 	EXPECT_TRUE(tree.CanComplete());
 }
 
+TEST(SyntaxTreeTest, MultiLevelStepUp) {
+	// true11 can't step up, its parent expr_true can
+	parser::SyntaxTree tree;
+	ASSERT_TRUE(tree.Init("top"));
+	parser::LexedToken tok;
+	std::vector<parser::LexedToken> tokens;
+	tok.tok = parser::GetTokenInstName("TRUE");
+	tokens.push_back(tok);
+	tok.tok = parser::GetTokenInstName("DASH");
+	tokens.push_back(tok);
+	tok.tok = parser::GetTokenInstName("NUM", "1");
+	tokens.push_back(tok);
+
+	EXPECT_TRUE(tree.Parse(tokens.begin(), tokens.end()));
+	EXPECT_TRUE(tree.CanComplete());
+
+	tree.DeleteIncomplete();
+	EXPECT_TRUE(tree.FullyComplete());
+}
+
+TEST(SyntaxTreeTest, StepUpThenStepDown) {
+	// expr_pos: expr pos steps down to pos_num for PLUS
+	parser::SyntaxTree tree;
+	ASSERT_TRUE(tree.Init("top"));
+	parser::LexedToken tok;
+	std::vector<parser::LexedToken> tokens;
+	tok.tok = parser::GetTokenInstName("NUM", "5");
+	tokens.push_back(tok);
+	tok.tok = parser::GetTokenInstName("PLUS");
+	tokens.push_back(tok);
+	tok.tok = parser::GetTokenInstName("NUM", "10");
+	tokens.push_back(tok);
+	tok.tok = parser::GetTokenInstName("PLUS");
+	tokens.push_back(tok);
+	tok.tok = parser::GetTokenInstName("NUM", "1");
+	tokens.push_back(tok);
+
+	EXPECT_TRUE(tree.Parse(tokens.begin(), tokens.end()));
+	EXPECT_TRUE(tree.CanComplete());
+
+	tree.DeleteIncomplete();
+	EXPECT_TRUE(tree.FullyComplete());
+}
+
+TEST(SyntaxTreeTest, AmbiguousStepUps) {
+	// PLUS can step up the inner or the outer expression of 5-10
+	parser::SyntaxTree tree;
+	ASSERT_TRUE(tree.Init("top"));
+	parser::LexedToken tok;
+	std::vector<parser::LexedToken> tokens;
+	tok.tok = parser::GetTokenInstName("NUM", "5");
+	tokens.push_back(tok);
+	tok.tok = parser::GetTokenInstName("DASH");
+	tokens.push_back(tok);
+	tok.tok = parser::GetTokenInstName("NUM", "10");
+	tokens.push_back(tok);
+	tok.tok = parser::GetTokenInstName("PLUS");
+	tokens.push_back(tok);
+	tok.tok = parser::GetTokenInstName("NUM", "1");
+	tokens.push_back(tok);
+
+	EXPECT_TRUE(tree.Parse(tokens.begin(), tokens.end()));
+	EXPECT_TRUE(tree.CanComplete());
+	EXPECT_TRUE(tree.FullyComplete());
+
+	// Both parses are kept as alternatives under top
+	EXPECT_EQ(0, tree.ToString().find("top {("));
+}
+
+TEST(SyntaxTreeTest, StepUpNotConsumed) {
+	parser::SyntaxTree tree;
+	ASSERT_TRUE(tree.Init("top"));
+	parser::LexedToken tok;
+	std::vector<parser::LexedToken> tokens;
+	tok.tok = parser::GetTokenInstName("NUM", "5");
+	tokens.push_back(tok);
+	tok.tok = parser::GetTokenInstName("PLUS");
+	tokens.push_back(tok);
+	tok.tok = parser::GetTokenInstName("PLUS");
+	tokens.push_back(tok);
+
+	EXPECT_FALSE(tree.Parse(tokens.begin(), tokens.end()));
+	EXPECT_FALSE(tree.CanComplete());
+}
+
+TEST(SyntaxTreeTest, MergedWorkPtrsStayBounded) {
+	// Each COMMA may start expr_list or expr_list_double, so without
+	//  merging the branches grow with the number of commas, as Fibonacci
+	//  numbers: far past 2^32 for this many
+	parser::SyntaxTree tree;
+	ASSERT_TRUE(tree.Init("top"));
+	parser::LexedToken tok;
+	std::vector<parser::LexedToken> tokens;
+	tok.tok = parser::GetTokenInstName("COMMA");
+	for(int i=0;i<300;++i) {
+		tokens.push_back(tok);
+	}
+	tok.tok = parser::GetTokenInstName("TRUE");
+	for(int i=0;i<160;++i) {
+		tokens.push_back(tok);
+	}
+
+	size_t max_work_ptrs = 0;
+	for(auto it = tokens.begin();it != tokens.end();++it) {
+		ASSERT_TRUE(tree.Parse(it, it+1));
+		max_work_ptrs = std::max(max_work_ptrs, tree.NumWorkPtrs());
+	}
+	EXPECT_LE(max_work_ptrs, 3u);
+	EXPECT_TRUE(tree.CanComplete());
+}
+
+TEST(SyntaxTreeTest, MergedWorkPtrCompleteUpToTop) {
+	// The expr_list starting at the third COMMA is merged under both
+	//  top-level readings. At the last TRUE it completes up to top
+	//  through one of them, while the other still needs the final NUM.
+	parser::SyntaxTree tree;
+	ASSERT_TRUE(tree.Init("top"));
+	parser::LexedToken tok;
+	std::vector<parser::LexedToken> tokens;
+	for(char c : std::string(",,f,t,f,,,22t2")) {
+		switch(c) {
+		case ',': tok.tok = parser::GetTokenInstName("COMMA"); break;
+		case 't': tok.tok = parser::GetTokenInstName("TRUE"); break;
+		case 'f': tok.tok = parser::GetTokenInstName("FALSE"); break;
+		default: tok.tok = parser::GetTokenInstName("NUM", "2"); break;
+		}
+		tokens.push_back(tok);
+	}
+
+	EXPECT_TRUE(tree.Parse(tokens.begin(), tokens.end()));
+	EXPECT_EQ(3u, tree.DeleteIncomplete());
+	EXPECT_TRUE(tree.FullyComplete());
+}
+
+TEST(SyntaxTreeTest, DeleteIncompleteCountsParses) {
+	// 1-1-1-1-1 can be grouped in Catalan(4) = 14 ways
+	parser::SyntaxTree tree;
+	ASSERT_TRUE(tree.Init("top"));
+	parser::LexedToken tok;
+	std::vector<parser::LexedToken> tokens;
+	for(int i=0;i<5;++i) {
+		if(i) {
+			tok.tok = parser::GetTokenInstName("DASH");
+			tokens.push_back(tok);
+		}
+		tok.tok = parser::GetTokenInstName("NUM", "1");
+		tokens.push_back(tok);
+	}
+
+	EXPECT_TRUE(tree.Parse(tokens.begin(), tokens.end()));
+	EXPECT_EQ(14u, tree.CountParses());
+	EXPECT_EQ(14u, tree.DeleteIncomplete());
+	EXPECT_TRUE(tree.FullyComplete());
+	EXPECT_EQ(14u, tree.CountParses());
+}
+
+TEST(SyntaxTreeTest, ReclaimAndCompactNodes) {
+	parser::SyntaxTree tree;
+	ASSERT_TRUE(tree.Init("top"));
+	parser::LexedToken tok;
+	std::vector<parser::LexedToken> tokens;
+	tok.tok = parser::GetTokenInstName("COMMA");
+	for(int i=0;i<6;++i) {
+		tokens.push_back(tok);
+	}
+	tok.tok = parser::GetTokenInstName("TRUE");
+	for(int i=0;i<4;++i) {
+		tokens.push_back(tok);
+	}
+
+	EXPECT_TRUE(tree.Parse(tokens.begin(), tokens.end()));
+	const size_t n_parses = tree.CountParses();
+	const size_t n_live = tree.NumLiveNodes();
+	EXPECT_LT(n_live, tree.NumNodes());
+
+	const size_t n_dead = tree.NumNodes() - n_live;
+	EXPECT_EQ(n_dead, tree.ReclaimNodes());
+	EXPECT_EQ(n_live, tree.NumNodes());
+	EXPECT_EQ(n_dead, tree.NumFreeNodes());
+
+	tree.CompactNodes();
+	EXPECT_EQ(n_live, tree.NumNodes());
+	EXPECT_EQ(0u, tree.NumFreeNodes());
+	EXPECT_EQ(n_parses, tree.CountParses());
+
+	// Still parses on from the compacted nodes
+	EXPECT_TRUE(tree.Parse(tokens.end()-1, tokens.end()));
+	EXPECT_TRUE(tree.CanComplete());
+}
+
+TEST(SyntaxTreeTest, InitReuses) {
+	parser::SyntaxTree tree;
+	parser::LexedToken tok;
+	std::vector<parser::LexedToken> tokens;
+	tok.tok = parser::GetTokenInstName("COMMA");
+	for(int i=0;i<6;++i) {
+		tokens.push_back(tok);
+	}
+	tok.tok = parser::GetTokenInstName("TRUE");
+	for(int i=0;i<4;++i) {
+		tokens.push_back(tok);
+	}
+
+	ASSERT_TRUE(tree.Init("top"));
+	EXPECT_TRUE(tree.Parse(tokens.begin(), tokens.end()));
+	const size_t n_parses = tree.CountParses();
+	const size_t n_nodes = tree.NumNodes();
+
+	// The same parse again, over the nodes of the first
+	ASSERT_TRUE(tree.Init("top"));
+	EXPECT_EQ(1u, tree.NumNodes());
+	EXPECT_TRUE(tree.Parse(tokens.begin(), tokens.end()));
+	EXPECT_EQ(n_parses, tree.CountParses());
+	EXPECT_EQ(n_nodes, tree.NumNodes());
+}
+
+TEST(SyntaxTreeTest, FullValidation) {
+	parser::SyntaxTree tree;
+	ASSERT_TRUE(tree.Init("top"));
+	tree.SetValidation(parser::ValidationFull, 2);
+	parser::LexedToken tok;
+	std::vector<parser::LexedToken> tokens;
+	tok.tok = parser::GetTokenInstName("COMMA");
+	tokens.push_back(tok);
+	tokens.push_back(tok);
+	for(int i=0;i<4;++i) {
+		if(i) {
+			tok.tok = parser::GetTokenInstName("DASH");
+			tokens.push_back(tok);
+		}
+		tok.tok = parser::GetTokenInstName("NUM", "1");
+		tokens.push_back(tok);
+	}
+	tok.tok = parser::GetTokenInstName("TRUE");
+	tokens.push_back(tok);
 
-// TODO: Test of multiple step ups to remove
+	EXPECT_TRUE(tree.Parse(tokens.begin(), tokens.end()));
+	EXPECT_TRUE(tree.CanComplete());
+}
 
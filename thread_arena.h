@@ -0,0 +1,327 @@
+
+#ifndef THREAD_ARENA_H
+#define THREAD_ARENA_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Fixed size pages shared by the ConcurrentAllocators of all threads
+// - Pages are aligned to their size, so the page of an object is found from its address
+// - Like BlockAllocator, memory isn't given back to the system, but pages
+//   released by one allocator are reused by the next
+struct PagePool {
+	static constexpr size_t kPageSize = size_t(1) << 16;
+
+	static PagePool& Shared() {
+		static PagePool pool;
+		return pool;
+	}
+
+	PagePool() {}
+
+	~PagePool() {
+		for(void* page : free_) {
+			::free(page);
+		}
+	}
+
+	PagePool(PagePool const&) = delete;
+	PagePool& operator=(PagePool const&) = delete;
+
+	void* Allocate() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if(free_.size()) {
+				void* page = free_.back();
+				free_.pop_back();
+				return page;
+			}
+		}
+		return ::aligned_alloc(kPageSize, kPageSize);
+	}
+
+	void Free(void* page) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		free_.push_back(page);
+	}
+
+	size_t num_free()const {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return free_.size();
+	}
+
+  private:
+	mutable std::mutex mutex_;
+	std::vector<void*> free_;
+};
+
+// Allocates objects of one type from any number of threads without contending
+// - Each thread allocates from its own arena of pages taken from a PagePool
+// - A thread frees its own objects straight onto its free list. Objects from
+//   other threads are collected per owner and handed back kBatchSize at a time,
+//   so the owner's lock is taken once per batch. flush() hands back the rest.
+// - Arenas belong to the allocator rather than the thread, so objects stay
+//   valid after the thread which allocated them exits
+// - Destroying the allocator destroys the objects still allocated, and must
+//   not overlap any other use of it
+template<typename T>
+struct ConcurrentAllocator {
+	static constexpr size_t kBatchSize = 64;
+
+	explicit ConcurrentAllocator(PagePool& pool = PagePool::Shared())
+	  : pool_(pool), id_(NextId()) {
+	}
+
+	~ConcurrentAllocator() {
+		// Everything on a free list or in a batch is already destroyed
+		std::vector<T*> dead;
+		for(std::unique_ptr<Arena> const&arena : arenas_) {
+			arena->CollectDead(dead);
+		}
+		std::sort(dead.begin(), dead.end());
+
+		for(std::unique_ptr<Arena> const&arena : arenas_) {
+			arena->ForEachSlot([&dead](T* p) {
+				if(!std::is_trivially_destructible<T>::value &&
+				   !std::binary_search(dead.begin(), dead.end(), p)) {
+					p->~T();
+				}
+			});
+			arena->ReleasePages(pool_);
+		}
+	}
+
+	ConcurrentAllocator(ConcurrentAllocator const&) = delete;
+	ConcurrentAllocator& operator=(ConcurrentAllocator const&) = delete;
+
+	// Returns unconstructed pointer
+	// Use new on this address. Don't use delete.
+	T* allocate() {
+		return Local().allocate();
+	}
+
+	// Destroys p, which may come from any thread
+	void deallocate(T* p) {
+		Local().deallocate(p);
+	}
+
+	// Hands the calling thread's partial batches back to their owners
+	void flush() {
+		Local().flush();
+	}
+
+	// The number of objects allocated and not deallocated
+	// Only meaningful while no thread is allocating or deallocating
+	size_t size()const {
+		std::lock_guard<std::mutex> lock(arenas_mutex_);
+		size_t allocated = 0;
+		size_t deallocated = 0;
+		for(std::unique_ptr<Arena> const&arena : arenas_) {
+			allocated += arena->n_allocated;
+			deallocated += arena->n_deallocated;
+		}
+		return allocated - deallocated;
+	}
+
+	size_t num_arenas()const {
+		std::lock_guard<std::mutex> lock(arenas_mutex_);
+		return arenas_.size();
+	}
+
+  private:
+
+	struct Arena;
+
+	struct PageHeader {
+		Arena* owner;
+	};
+
+	static constexpr size_t kFirstOffset =
+		((sizeof(PageHeader) + alignof(T) - 1) / alignof(T)) * alignof(T);
+	static constexpr size_t kPerPage = (PagePool::kPageSize - kFirstOffset) / sizeof(T);
+	static_assert(kPerPage > 0, "T is too large for a PagePool page");
+
+	static T* Slot(PageHeader* page, size_t i) {
+		return reinterpret_cast<T*>(reinterpret_cast<char*>(page) + kFirstOffset) + i;
+	}
+
+	static Arena* OwnerOf(T* p) {
+		const uintptr_t page = reinterpret_cast<uintptr_t>(p) & ~uintptr_t(PagePool::kPageSize - 1);
+		return reinterpret_cast<PageHeader*>(page)->owner;
+	}
+
+	struct Arena {
+		Arena(PagePool& pool, std::thread::id thread)
+		  : thread(thread), n_allocated(0), n_deallocated(0),
+		  	pool_(pool), next_index_(kPerPage), has_incoming_(false) {
+		}
+
+		T* allocate() {
+			++n_allocated;
+			if(free_.empty()) {
+				TakeIncoming();
+			}
+			if(free_.size()) {
+				T* reused = free_.back();
+				free_.pop_back();
+				return reused;
+			}
+			if(next_index_ == kPerPage) {
+				PageHeader* page = static_cast<PageHeader*>(pool_.Allocate());
+				page->owner = this;
+				pages_.push_back(page);
+				next_index_ = 0;
+			}
+			return Slot(pages_.back(), next_index_++);
+		}
+
+		void deallocate(T* p) {
+			++n_deallocated;
+			p->~T();
+			Arena* owner = OwnerOf(p);
+			if(owner == this) {
+				free_.push_back(p);
+				return;
+			}
+			std::vector<T*> &batch = OutgoingTo(owner);
+			batch.push_back(p);
+			if(batch.size() >= kBatchSize) {
+				owner->Receive(batch);
+			}
+		}
+
+		void flush() {
+			for(std::pair<Arena*, std::vector<T*> > &outgoing : outgoing_) {
+				if(outgoing.second.size()) {
+					outgoing.first->Receive(outgoing.second);
+				}
+			}
+		}
+
+		void CollectDead(std::vector<T*> &dead)const {
+			dead.insert(dead.end(), free_.begin(), free_.end());
+			dead.insert(dead.end(), incoming_.begin(), incoming_.end());
+			for(std::pair<Arena*, std::vector<T*> > const&outgoing : outgoing_) {
+				dead.insert(dead.end(), outgoing.second.begin(), outgoing.second.end());
+			}
+		}
+
+		// Every slot handed out, including deallocated ones
+		template<typename F>
+		void ForEachSlot(F f)const {
+			for(size_t pi=0;pi<pages_.size();++pi) {
+				const size_t last = ((pi+1) == pages_.size()) ? next_index_ : kPerPage;
+				for(size_t i=0;i<last;++i) {
+					f(Slot(pages_[pi], i));
+				}
+			}
+		}
+
+		void ReleasePages(PagePool& pool) {
+			for(PageHeader* page : pages_) {
+				pool.Free(page);
+			}
+			pages_.clear();
+		}
+
+		const std::thread::id thread;
+		// Counted by the thread calling, not the owner
+		size_t n_allocated;
+		size_t n_deallocated;
+
+	  private:
+
+		// Called by other threads
+		void Receive(std::vector<T*> &batch) {
+			{
+				std::lock_guard<std::mutex> lock(incoming_mutex_);
+				incoming_.insert(incoming_.end(), batch.begin(), batch.end());
+				has_incoming_.store(true, std::memory_order_release);
+			}
+			batch.clear();
+		}
+
+		void TakeIncoming() {
+			// Saves taking the lock while nothing came back
+			if(!has_incoming_.load(std::memory_order_acquire)) {
+				return;
+			}
+			std::lock_guard<std::mutex> lock(incoming_mutex_);
+			free_.swap(incoming_);
+			has_incoming_.store(false, std::memory_order_relaxed);
+		}
+
+		// Few threads free into any one arena, so a linear search does
+		std::vector<T*>& OutgoingTo(Arena* owner) {
+			for(std::pair<Arena*, std::vector<T*> > &outgoing : outgoing_) {
+				if(outgoing.first == owner) {
+					return outgoing.second;
+				}
+			}
+			outgoing_.emplace_back(owner, std::vector<T*>());
+			return outgoing_.back().second;
+		}
+
+		PagePool& pool_;
+		std::vector<PageHeader*> pages_;
+		// Index in the last page allocate() takes from next
+		size_t next_index_;
+		std::vector<T*> free_;
+		std::vector<std::pair<Arena*, std::vector<T*> > > outgoing_;
+
+		std::mutex incoming_mutex_;
+		std::vector<T*> incoming_;
+		std::atomic<bool> has_incoming_;
+	};
+
+	// The calling thread's arena
+	// The last one a thread used is cached, so a thread alternating between
+	//  allocators takes the slow path each switch
+	Arena& Local() {
+		struct LastUsed {
+			uint64_t allocator_id;
+			Arena* arena;
+		};
+		static thread_local LastUsed last = {0, nullptr};
+		if(last.allocator_id != id_) {
+			last.arena = &FindOrAddArena();
+			last.allocator_id = id_;
+		}
+		return *last.arena;
+	}
+
+	Arena& FindOrAddArena() {
+		const std::thread::id self = std::this_thread::get_id();
+		std::lock_guard<std::mutex> lock(arenas_mutex_);
+		for(std::unique_ptr<Arena> const&arena : arenas_) {
+			if(arena->thread == self) {
+				return *arena;
+			}
+		}
+		arenas_.emplace_back(new Arena(pool_, self));
+		return *arenas_.back();
+	}
+
+	// Never 0, and never reused, unlike addresses
+	static uint64_t NextId() {
+		static std::atomic<uint64_t> next_id(1);
+		return next_id.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	PagePool& pool_;
+	const uint64_t id_;
+
+	mutable std::mutex arenas_mutex_;
+	std::vector<std::unique_ptr<Arena> > arenas_;
+};
+
+#endif//THREAD_ARENA_H
@@ -0,0 +1,86 @@
+
+#include "syntax_tree.h"
+#include "thread_arena.h"
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+// Times allocating parser::Nodes from 1 to N threads at once, with new/delete
+//  and with a shared ConcurrentAllocator. Each thread frees half of its own
+//  nodes and half of its neighbour's, as when chunks are merged.
+
+namespace {
+
+const size_t kNodesPerThread = 1 << 17;
+
+template<typename Alloc, typename Free>
+double Run(unsigned n_threads, Alloc alloc, Free free) {
+	std::vector<std::vector<parser::Node*> > nodes(n_threads);
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> threads;
+	for(unsigned ti=0;ti<n_threads;++ti) {
+		threads.emplace_back([&nodes, &alloc, &free, ti]() {
+			std::vector<parser::Node*> &own = nodes[ti];
+			for(size_t i=0;i<kNodesPerThread;++i) {
+				own.push_back(alloc());
+				if(1 == (i % 4)) {
+					free(own[i-1]);
+					own[i-1] = nullptr;
+				}
+			}
+		});
+	}
+	for(std::thread &t : threads) {
+		t.join();
+	}
+	threads.clear();
+	for(unsigned ti=0;ti<n_threads;++ti) {
+		threads.emplace_back([&nodes, &free, ti, n_threads]() {
+			std::vector<parser::Node*> &neighbour = nodes[(ti+1) % n_threads];
+			for(size_t i=0;i<neighbour.size();i+=2) {
+				if(neighbour[i]) {
+					free(neighbour[i]);
+				}
+			}
+		});
+	}
+	for(std::thread &t : threads) {
+		t.join();
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+	const unsigned max_threads = (argc > 1) ? atoi(argv[1]) : std::max(1u, std::thread::hardware_concurrency());
+	parser::Rule const&rule = parser::GetRulesForTokenName(parser::GetTokenInstName("top"))[0];
+
+	printf("threads  new/delete ms  arena ms\n");
+	for(unsigned n_threads=1;n_threads<=max_threads;n_threads*=2) {
+		const double heap_ms = Run(n_threads,
+			[&rule]() {
+				return new parser::Node(rule);
+			},
+			[](parser::Node* n) {
+				delete n;
+			});
+
+		ConcurrentAllocator<parser::Node> arena;
+		const double arena_ms = Run(n_threads,
+			[&rule, &arena]() {
+				return new (arena.allocate()) parser::Node(rule);
+			},
+			[&arena](parser::Node* n) {
+				arena.deallocate(n);
+			});
+
+		printf("%7u  %13.2f  %8.2f\n", n_threads, heap_ms, arena_ms);
+	}
+	return 0;
+}
@@ -0,0 +1,151 @@
+
+
+#include "gtest/gtest.h"
+#include "thread_arena.h"
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+namespace {
+
+TEST(ThreadArenaTest, Simple) {
+	PagePool pool;
+	ConcurrentAllocator<long> test(pool);
+	std::vector<long*> ptrs;
+	for(long i=0;i<20000;++i) {
+		ptrs.push_back(new (test.allocate()) long(i));
+	}
+	EXPECT_EQ(20000u, test.size());
+	EXPECT_EQ(1u, test.num_arenas());
+	for(long i=0;i<20000;++i) {
+		ASSERT_EQ(i, *ptrs[i]);
+	}
+
+	// Reused before taking another page
+	test.deallocate(ptrs[5]);
+	EXPECT_EQ(ptrs[5], test.allocate());
+}
+
+TEST(ThreadArenaTest, FreedOnOtherThread) {
+	PagePool pool;
+	ConcurrentAllocator<long> test(pool);
+	std::vector<long*> ptrs;
+	const size_t n = ConcurrentAllocator<long>::kBatchSize + 10;
+	for(size_t i=0;i<n;++i) {
+		ptrs.push_back(new (test.allocate()) long(i));
+	}
+
+	std::thread other([&test, &ptrs]() {
+		for(long* p : ptrs) {
+			test.deallocate(p);
+		}
+		test.flush();
+	});
+	other.join();
+	EXPECT_EQ(2u, test.num_arenas());
+	EXPECT_EQ(0u, test.size());
+
+	// All of them came back to this thread
+	std::sort(ptrs.begin(), ptrs.end());
+	for(size_t i=0;i<n;++i) {
+		long* p = test.allocate();
+		EXPECT_TRUE(std::binary_search(ptrs.begin(), ptrs.end(), p));
+	}
+}
+
+TEST(ThreadArenaTest, Destroy) {
+	static std::atomic<int> tests(0);
+
+	struct CountedTest {
+		CountedTest() {
+			++tests;
+		}
+		~CountedTest() {
+			--tests;
+		}
+		CountedTest(CountedTest const&o) = delete;
+		CountedTest(CountedTest &&o) = delete;
+		char pad[100];
+	};
+
+	PagePool pool;
+	{
+		ConcurrentAllocator<CountedTest> test(pool);
+		const int kThreads = 4;
+		const int kPerThread = 2000;
+		std::vector<std::vector<CountedTest*> > ptrs(kThreads);
+		std::vector<std::thread> threads;
+		for(int ti=0;ti<kThreads;++ti) {
+			threads.emplace_back([&test, &ptrs, ti]() {
+				for(int i=0;i<kPerThread;++i) {
+					ptrs[ti].push_back(new (test.allocate()) CountedTest);
+				}
+			});
+		}
+		for(std::thread &t : threads) {
+			t.join();
+		}
+		threads.clear();
+		EXPECT_EQ(kThreads*kPerThread, tests);
+
+		// Each frees every other object of its neighbour, some left in batches
+		for(int ti=0;ti<kThreads;++ti) {
+			threads.emplace_back([&test, &ptrs, ti]() {
+				std::vector<CountedTest*> const&from = ptrs[(ti+1) % kThreads];
+				for(size_t i=0;i<from.size();i+=2) {
+					test.deallocate(from[i]);
+				}
+			});
+		}
+		for(std::thread &t : threads) {
+			t.join();
+		}
+		EXPECT_EQ(kThreads*kPerThread/2, tests);
+		EXPECT_EQ(size_t(kThreads*kPerThread/2), test.size());
+		EXPECT_EQ(0u, pool.num_free());
+	}
+	EXPECT_EQ(0, tests);
+	// Pages went back for the next allocator
+	EXPECT_LT(0u, pool.num_free());
+}
+
+TEST(ThreadArenaTest, Random) {
+	PagePool pool;
+	ConcurrentAllocator<std::pair<int, int> > test(pool);
+	const int kThreads = 4;
+	std::vector<std::thread> threads;
+	std::atomic<int> bad(0);
+	for(int ti=0;ti<kThreads;++ti) {
+		threads.emplace_back([&test, &bad, ti]() {
+			unsigned seed = 1234 + ti;
+			std::vector<std::pair<int, int>*> live;
+			for(int i=0;i<50000;++i) {
+				if(live.size() && (0 == (rand_r(&seed) % 3))) {
+					const size_t li = rand_r(&seed) % live.size();
+					if((live[li]->first != ti) || (live[li]->second != int(li))) {
+						++bad;
+					}
+					test.deallocate(live[li]);
+					live[li] = live.back();
+					live.pop_back();
+					if(li < live.size()) {
+						live[li]->second = li;
+					}
+				} else {
+					live.push_back(new (test.allocate()) std::pair<int, int>(ti, live.size()));
+				}
+			}
+			for(std::pair<int, int>* p : live) {
+				test.deallocate(p);
+			}
+		});
+	}
+	for(std::thread &t : threads) {
+		t.join();
+	}
+	EXPECT_EQ(0, bad.load());
+	EXPECT_EQ(0u, test.size());
+}
+
+}  // namespace
@@ -0,0 +1,162 @@
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads, each with its own deque of tasks.
+// Workers pop from the back of their own deque and steal from the front of
+//  the others when it runs dry.
+// ParallelFor() is meant for short bursts of independent work, like expanding
+//  one parser frontier. The calling thread works too, and it blocks until the
+//  whole range is done.
+struct WorkStealingPool {
+	// n_threads includes the calling thread, so 1 means no workers
+	explicit WorkStealingPool(unsigned n_threads)
+	  : queues_(n_threads), stop_(false), generation_(0) {
+		assert(n_threads > 0);
+		for(unsigned i=0;i<n_threads;++i) {
+			queues_[i].reset(new Queue);
+		}
+		for(unsigned i=1;i<n_threads;++i) {
+			workers_.emplace_back([this, i]() { WorkerLoop(i); });
+		}
+	}
+
+	~WorkStealingPool() {
+		{
+			std::lock_guard<std::mutex> lock(wake_mutex_);
+			stop_ = true;
+		}
+		wake_.notify_all();
+		for(std::thread &t : workers_) {
+			t.join();
+		}
+	}
+
+	unsigned size()const {
+		return queues_.size();
+	}
+
+	// Calls fn(i) for every i in [0, n). Indices are dealt out to the queues
+	//  in contiguous runs, so neighbouring indices usually run on one thread.
+	void ParallelFor(unsigned n, std::function<void(unsigned)> const&fn) {
+		if(n == 0) {
+			return;
+		}
+
+		Batch batch(fn, n);
+
+		const unsigned n_queues = queues_.size();
+		for(unsigned qi=0;qi<n_queues;++qi) {
+			const unsigned begin = (n * qi) / n_queues;
+			const unsigned end = (n * (qi+1)) / n_queues;
+			Queue &q = *queues_[qi];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			for(unsigned i=begin;i<end;++i) {
+				q.tasks.push_back(Task{&batch, i});
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lock(wake_mutex_);
+			++generation_;
+		}
+		wake_.notify_all();
+
+		// The calling thread uses queue 0
+		Task task;
+		while(batch.remaining.load(std::memory_order_acquire) > 0) {
+			if(TakeTask(0, task)) {
+				Run(task);
+			} else {
+				std::this_thread::yield();
+			}
+		}
+	}
+
+  private:
+
+	struct Batch {
+		Batch(std::function<void(unsigned)> const&fn, unsigned n)
+		  : fn(fn), remaining(n) {
+		}
+
+		std::function<void(unsigned)> const&fn;
+		std::atomic<unsigned> remaining;
+	};
+
+	struct Task {
+		Batch *batch;
+		unsigned index;
+	};
+
+	struct Queue {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	static void Run(Task const&task) {
+		task.batch->fn(task.index);
+		task.batch->remaining.fetch_sub(1, std::memory_order_release);
+	}
+
+	bool TakeTask(unsigned self, Task &task) {
+		{
+			Queue &own = *queues_[self];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if(!own.tasks.empty()) {
+				task = own.tasks.back();
+				own.tasks.pop_back();
+				return true;
+			}
+		}
+		const unsigned n_queues = queues_.size();
+		for(unsigned offset=1;offset<n_queues;++offset) {
+			Queue &victim = *queues_[(self + offset) % n_queues];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if(!victim.tasks.empty()) {
+				task = victim.tasks.front();
+				victim.tasks.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void WorkerLoop(unsigned self) {
+		unsigned long long seen_generation = 0;
+		Task task;
+		while(true) {
+			while(TakeTask(self, task)) {
+				Run(task);
+			}
+
+			std::unique_lock<std::mutex> lock(wake_mutex_);
+			wake_.wait(lock, [&]() {
+				return stop_ || (generation_ != seen_generation);
+			});
+			if(stop_) {
+				return;
+			}
+			seen_generation = generation_;
+		}
+	}
+
+	std::vector<std::unique_ptr<Queue> > queues_;
+	std::vector<std::thread> workers_;
+
+	std::mutex wake_mutex_;
+	std::condition_variable wake_;
+	bool stop_;
+	unsigned long long generation_;
+};
+
+#endif//THREAD_POOL_H
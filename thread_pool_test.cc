@@ -0,0 +1,64 @@
+
+
+#include "gtest/gtest.h"
+#include "thread_pool.h"
+
+#include <atomic>
+#include <vector>
+
+namespace {
+
+TEST(WorkStealingPoolTest, SingleThread) {
+	WorkStealingPool pool(1);
+	std::vector<int> out(100, 0);
+	pool.ParallelFor(out.size(), [&](unsigned i) {
+		out[i] = i * 2;
+	});
+	for(unsigned i=0;i<out.size();++i) {
+		EXPECT_EQ(i * 2, out[i]);
+	}
+}
+
+TEST(WorkStealingPoolTest, EveryIndexOnce) {
+	WorkStealingPool pool(4);
+	for(unsigned n : {0u, 1u, 3u, 4u, 17u, 1000u}) {
+		std::vector<std::atomic<int> > counts(n);
+		for(auto &c : counts) {
+			c = 0;
+		}
+		pool.ParallelFor(n, [&](unsigned i) {
+			++counts[i];
+		});
+		for(unsigned i=0;i<n;++i) {
+			EXPECT_EQ(1, counts[i].load());
+		}
+	}
+}
+
+TEST(WorkStealingPoolTest, UnevenWork) {
+	// One slow index per queue run; the others should get stolen
+	WorkStealingPool pool(3);
+	std::atomic<unsigned long long> sum(0);
+	pool.ParallelFor(60, [&](unsigned i) {
+		unsigned long long local = 0;
+		const unsigned spins = (i % 20 == 0) ? 2000000 : 1000;
+		for(unsigned s=0;s<spins;++s) {
+			local += s ^ i;
+		}
+		sum += (local > 0) ? 1 : 0;
+	});
+	EXPECT_EQ(60, sum.load());
+}
+
+TEST(WorkStealingPoolTest, ManyBatches) {
+	WorkStealingPool pool(4);
+	for(int batch=0;batch<500;++batch) {
+		std::atomic<int> count(0);
+		pool.ParallelFor(batch % 9, [&](unsigned i) {
+			++count;
+		});
+		EXPECT_EQ(batch % 9, count.load());
+	}
+}
+
+}  // namespace
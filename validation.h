@@ -0,0 +1,43 @@
+
+#ifndef VALIDATION_H
+#define VALIDATION_H
+
+namespace parser {
+
+// How much a parse checks its own state as it goes, chosen at runtime
+// Unlike assert() these stay in release builds, and a failed check fails the parse
+enum ValidationLevel {
+	// Nothing beyond what parsing needs
+	ValidationNone,
+	// Invariants costing constant time per work item, on every token
+	ValidationCheap,
+	// Also walks all of the parse state, on every full_every'th token
+	ValidationFull,
+};
+
+struct Validation {
+	Validation()
+	  :
+#ifdef NDEBUG
+	  	level(ValidationNone),
+#else
+	  	level(ValidationCheap),
+#endif
+	  	full_every(1) {
+	}
+
+	bool Cheap()const {
+		return level >= ValidationCheap;
+	}
+
+	bool FullAt(unsigned token_idx)const {
+		return (level >= ValidationFull) && full_every && ((token_idx % full_every) == 0);
+	}
+
+	ValidationLevel level;
+	unsigned full_every;
+};
+
+};  // namespace parser
+
+#endif//VALIDATION_H